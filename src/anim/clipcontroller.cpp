@@ -17,37 +17,41 @@ ClipController::ClipController(const Skeleton* skel)
 {
 }
 
-void ClipController::ComputePose( ) 
+// Interpolates the frames on either side of frame, which must be within the clip.
+static void InterpolateFrame( const Clip* clip, float frame, int num_joints,
+							  Vec3& root_pos, Quaternion& root_rot, Quaternion* out_rotations )
 {
-	if(m_clip) 
-	{
-		float frame_low = floor(m_frame);
-		float frame_hi = ceil(m_frame);
-		float fraction = m_frame - frame_low;
-		float one_minus_fraction = 1.0 - fraction;
+	float frame_low = floor(frame);
+	float frame_hi = ceil(frame);
+	float fraction = frame - frame_low;
+	float one_minus_fraction = 1.0 - fraction;
 
-		int iframe_low = frame_low;
-		int iframe_hi = frame_hi;
+	int iframe_low = frame_low;
+	int iframe_hi = frame_hi;
 
-		const Quaternion *rotations_low = m_clip->GetFrameRotations(iframe_low);
-		const Quaternion *rotations_hi = m_clip->GetFrameRotations(iframe_hi);
+	const Quaternion *rotations_low = clip->GetFrameRotations(iframe_low);
+	const Quaternion *rotations_hi = clip->GetFrameRotations(iframe_hi);
 
-		Vec3 root_pos = one_minus_fraction * m_clip->GetFrameRootOffset(iframe_low) 
-			+ fraction * m_clip->GetFrameRootOffset(iframe_hi) ;
-
-		Quaternion root_rot;
-		slerp_rotation( root_rot, m_clip->GetFrameRootOrientation(iframe_low),
-						m_clip->GetFrameRootOrientation(iframe_hi), fraction);
+	root_pos = one_minus_fraction * clip->GetFrameRootOffset(iframe_low) 
+		+ fraction * clip->GetFrameRootOffset(iframe_hi) ;
 
-		Quaternion* out_rotations = m_pose->GetRotations();
+	slerp_rotation( root_rot, clip->GetFrameRootOrientation(iframe_low),
+					clip->GetFrameRootOrientation(iframe_hi), fraction);
 
-		int num_joints = m_skel->GetNumJoints();
+	Quaternion anim_rot ;
+	for(int i = 0; i < num_joints; ++i) {
+		slerp_rotation(anim_rot, rotations_low[i], rotations_hi[i], fraction);
+		out_rotations[i] = anim_rot;
+	}	
+}
 
-		Quaternion anim_rot ;
-		for(int i = 0; i < num_joints; ++i) {
-			slerp_rotation(anim_rot, rotations_low[i], rotations_hi[i], fraction);
-			out_rotations[i] = anim_rot;
-		}	
+void ClipController::ComputePose( ) 
+{
+	if(m_clip) 
+	{
+		Vec3 root_pos;
+		Quaternion root_rot;
+		InterpolateFrame(m_clip, m_frame, m_skel->GetNumJoints(), root_pos, root_rot, m_pose->GetRotations());
 
         // Roll in alignment transforms
         root_pos = m_offset + rotate(root_pos, m_rotation);
@@ -137,3 +141,21 @@ void ClipController::SetPartialRange( float min_frame, float max_frame )
 
 	m_frame = Clamp(m_frame, min_frame, max_frame);
 }
+
+void EvaluatePoses( const Clip* clip, const float* times, int n,
+					Vec3* root_offsets, Quaternion* root_rotations, Quaternion* rotations,
+					int num_threads )
+{
+	const int num_joints = clip->GetNumJoints();
+	const float fps = clip->GetClipFPS();
+	const float max_frame = clip->GetNumFrames() - 1;
+	int k = 0;
+
+	// Consecutive times read neighbouring frames, so give each thread one contiguous run of them.
+#pragma omp parallel for if(num_threads > 1) num_threads(Max(num_threads,1)) schedule(static) private(k)
+	for(k = 0; k < n; ++k)
+	{
+		const float frame = Clamp(times[k] * fps, 0.f, max_frame);
+		InterpolateFrame(clip, frame, num_joints, root_offsets[k], root_rotations[k], &rotations[k * num_joints]);
+	}
+}
@@ -39,4 +39,13 @@ private:
 	void ClampSetFrame( float frame );
 };
 
+// Poses of clip at n times without a controller. Each time is clamped to the clip and its frames
+// are interpolated like ClipController::ComputePose, with no offset or rotation applied. Pose k
+// goes to root_offsets[k], root_rotations[k] and the clip's GetNumJoints() local rotations from
+// rotations[k * clip->GetNumJoints()]. With num_threads > 1 the times are split between OpenMP
+// threads.
+void EvaluatePoses( const Clip* clip, const float* times, int n,
+					Vec3* root_offsets, Quaternion* root_rotations, Quaternion* rotations,
+					int num_threads = 1 );
+
 #endif
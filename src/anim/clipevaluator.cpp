@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <cstring>
+#include "clipevaluator.hh"
+#include "clipcontroller.hh"
+#include "clip.hh"
+#include "skeleton.hh"
+#include "assert.hh"
+
+ClipEvaluator::ClipEvaluator(const Skeleton* skel, Mat4_arg model_to_skel)
+	: m_skel(skel)
+	, m_clip(0)
+	, m_pose(skel)
+{
+	const int num_joints = skel->GetNumJoints();
+	m_bind.resize(num_joints * 12);
+	for(int i = 0; i < num_joints; ++i) {
+		Mat4 bind = skel->GetSkelToJointTransform(i) * model_to_skel;
+		memcpy(&m_bind[i * 12], bind.m, sizeof(float) * 12);
+	}
+}
+
+// Interpolates the clip at the first n entries of m_times, or the rest pose without a clip.
+void ClipEvaluator::EvaluateFrames(int n)
+{
+	const int num_joints = m_skel->GetNumJoints();
+	m_root_offsets.resize(n);
+	m_root_rotations.resize(n);
+	m_rotations.resize(n * num_joints);
+
+	if(m_clip) {
+		ASSERT(m_clip->GetNumJoints() == num_joints);
+		EvaluatePoses(m_clip, &m_times[0], n, &m_root_offsets[0], &m_root_rotations[0], &m_rotations[0]);
+	} else {
+		std::fill(m_root_offsets.begin(), m_root_offsets.end(), Vec3(0,0,0));
+		std::fill(m_root_rotations.begin(), m_root_rotations.end(), Quaternion(0,0,0,1));
+		std::fill(m_rotations.begin(), m_rotations.end(), Quaternion(0,0,0,1));
+	}
+}
+
+// Flattens evaluated pose k into m_pose. Renormalizing the root rotation matches the identity
+// alignment ClipController::ComputePose rolls in, so the samples don't change.
+void ClipEvaluator::ComputePoseJoints(int k)
+{
+	const int num_joints = m_skel->GetNumJoints();
+	m_pose.SetRootOffset(m_root_offsets[k]);
+	m_pose.SetRootRotation(m_clip ? normalize(m_root_rotations[k]) : m_root_rotations[k]);
+	memcpy(m_pose.GetRotations(), &m_rotations[k * num_joints], sizeof(Quaternion) * num_joints);
+	m_pose.ComputeJoints(m_skel);
+}
+
+void ClipEvaluator::ComputeJoints(float time, Vec3* positions, Quaternion* rotations)
+{
+	m_times.resize(1);
+	m_times[0] = time;
+	EvaluateFrames(1);
+	ComputePoseJoints(0);
+
+	const int num_joints = m_skel->GetNumJoints();
+	memcpy(positions, m_pose.GetOffsets(), sizeof(Vec3) * num_joints);
+	memcpy(rotations, m_pose.GetFlattenedRotations(), sizeof(Quaternion) * num_joints);
+}
+
+void ClipEvaluator::ComputeMatrices(int first_frame, int num_frames, float interval, float* mats, int frame_stride)
+{
+	const Vec3* offsets = m_pose.GetOffsets();
+	const Quaternion* rotations = m_pose.GetFlattenedRotations();
+	const int num_joints = m_skel->GetNumJoints();
+
+	m_times.resize(num_frames);
+	for(int frame = 0; frame < num_frames; ++frame)
+		m_times[frame] = (first_frame + frame) * interval;
+	EvaluateFrames(num_frames);
+
+	for(int frame = 0; frame < num_frames; ++frame)
+	{
+		ComputePoseJoints(frame);
+
+		for(int i = 0; i < num_joints; ++i)
+		{
+			// translation(offset) * rotation is exactly the rotation with the offset in the last
+			// column, and the bottom rows are 0 0 0 1, so this sums the same products as the Mat4
+			// multiplication without the ones that are zero.
+			const Mat4 rot = rotations[i].to_matrix();
+			const float translation[3] = { offsets[i].x, offsets[i].y, offsets[i].z };
+			const float* bind = &m_bind[i * 12];
+			float* out = &mats[i * 12 * frame_stride + frame];
+
+			for(int row = 0; row < 3; ++row) {
+				const float* r = &rot.m[row * 4];
+				for(int col = 0; col < 3; ++col)
+					out[(row * 4 + col) * frame_stride] = r[0] * bind[col] + r[1] * bind[col + 4] + r[2] * bind[col + 8];
+				out[(row * 4 + 3) * frame_stride] = r[0] * bind[3] + r[1] * bind[7] + r[2] * bind[11] + translation[row];
+			}
+		}
+	}
+}
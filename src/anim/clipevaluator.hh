@@ -0,0 +1,46 @@
+#ifndef INCLUDED_anim_clipevaluator_HH
+#define INCLUDED_anim_clipevaluator_HH
+
+#include <vector>
+#include "pose.hh"
+#include "Mat4.hh"
+
+class Clip;
+class Skeleton;
+
+// Forward kinematics for sampling many frames of a clip. The skeleton's skel_to_joint transforms
+// are multiplied with model_to_skel once, instead of for every joint of every frame like
+// Pose::ComputeMatrices does, and only the top three rows of the matrices are computed. The clip
+// is interpolated for all the frames at once with EvaluatePoses.
+class ClipEvaluator
+{
+	const Skeleton* m_skel;
+	const Clip* m_clip;
+	Pose m_pose;
+	std::vector<float> m_bind;                  // top rows of skel_to_joint * model_to_skel, 12 per joint
+
+	// EvaluatePoses output for the frames of one ComputeMatrices call
+	std::vector<float> m_times;
+	std::vector<Vec3> m_root_offsets;
+	std::vector<Quaternion> m_root_rotations;
+	std::vector<Quaternion> m_rotations;
+public:
+	ClipEvaluator(const Skeleton* skel, Mat4_arg model_to_skel);
+
+	void SetClip(const Clip* clip) { m_clip = clip; }
+
+	// Joint positions and rotations in skeleton space at time, like the offsets and flattened
+	// rotations of a Pose after ComputeJoints.
+	void ComputeJoints(float time, Vec3* positions, Quaternion* rotations);
+
+	// Matrices of the frames sampled every interval seconds from first_frame to
+	// first_frame + num_frames - 1. Element e of joint j's matrix for frame f goes to
+	// mats[(j*12 + e)*frame_stride + f - first_frame], so consecutive frames of an element are
+	// adjacent. Gives the same values as Pose::ComputeMatrices when model_to_skel is the identity.
+	void ComputeMatrices(int first_frame, int num_frames, float interval, float* mats, int frame_stride);
+private:
+	void EvaluateFrames(int n);
+	void ComputePoseJoints(int k);
+};
+
+#endif
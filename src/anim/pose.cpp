@@ -49,7 +49,7 @@ void Pose::RestPose(const Skeleton* skel )
 	}
 }
 
-void Pose::ComputeMatrices(const Skeleton* skel, Mat4_arg model_to_skel)
+void Pose::ComputeJoints(const Skeleton* skel)
 {
 	const int num_joints = m_count;
 
@@ -72,6 +72,12 @@ void Pose::ComputeMatrices(const Skeleton* skel, Mat4_arg model_to_skel)
 			m_offsets[i] = m_offsets[parent] + rotate(skel_rest_offsets[parent], m_rotations[parent]);
 		}
 	}			
+}
+
+void Pose::ComputeMatrices(const Skeleton* skel, Mat4_arg model_to_skel)
+{
+	const int num_joints = m_count;
+	ComputeJoints(skel);
 
 	// and build render friendly matrices
 	for(int i = 0; i < num_joints; ++i) {
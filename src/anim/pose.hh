@@ -20,6 +20,8 @@ public:
 	Pose(const Skeleton* skel);
 	~Pose();
 
+	// flattens the hierarchy into the flattened rotations and offsets only.
+	void ComputeJoints(const Skeleton* skel);
 	void ComputeMatrices(const Skeleton* skel, Mat4_arg model_to_local);
 	void RestPose(const Skeleton* skel) ;
 
@@ -36,7 +38,7 @@ public:
 	Quaternion* GetRotations() { return m_local_rotations; }
 	const Quaternion* GetRotations() const { return m_local_rotations; }
 
-	// valid after ComputeMatrices is called
+	// valid after ComputeJoints or ComputeMatrices is called
 	const Quaternion* GetFlattenedRotations() const { return m_rotations; }
 
 	const Mat4* GetMatricesPtr() const { return m_mats; }
@@ -55,6 +55,7 @@ public:
     const Quaternion& GetFrameRootOrientation(int frameIdx) const;
 
     int GetNumFrames() const { return m_num_frames; }
+    int GetNumJoints() const { return m_joints_per_frame; }
     float GetClipTime() const { return m_num_frames / m_fps; }
     float GetClipFPS() const { return m_fps; }
 
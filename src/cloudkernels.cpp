@@ -0,0 +1,252 @@
+#include <cstring>
+#include "cloudkernels.hh"
+#include "motiongraph.hh"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MOGED_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+SoACloud::SoACloud()
+	: m_x(0), m_y(0), m_z(0), m_points_per_frame(0), m_stride(0), m_num_frames(0)
+{
+}
+
+void SoACloud::Split(const Vec3* points, int points_per_frame, int num_frames)
+{
+	m_points_per_frame = points_per_frame;
+	m_stride = (points_per_frame + kSoALanes - 1) / kSoALanes * kSoALanes;
+	m_num_frames = num_frames;
+
+	// one block for all three arrays, plus enough to move the start to a 32 byte boundary.
+	const int len = m_stride * num_frames;
+	m_storage.assign(3 * len + kSoALanes, 0.f);
+	float* base = &m_storage[0];
+	while(reinterpret_cast<size_t>(base) % (kSoALanes * sizeof(float)) != 0)
+		++base;
+	m_x = base;
+	m_y = base + len;
+	m_z = base + 2 * len;
+
+	for(int frame = 0; frame < num_frames; ++frame) {
+		for(int sample = 0; sample < points_per_frame; ++sample) {
+			const Vec3& point = points[frame * points_per_frame + sample];
+			const int i = frame * m_stride + sample;
+			m_x[i] = point.x;
+			m_y[i] = point.y;
+			m_z[i] = point.z;
+		}
+	}
+}
+
+void SoACloud::Join(int first_frame, int num_frames, Vec3* out) const
+{
+	for(int frame = 0; frame < num_frames; ++frame)
+		for(int sample = 0; sample < m_points_per_frame; ++sample)
+			out[frame * m_points_per_frame + sample] = GetPoint(first_frame + frame, sample);
+}
+
+namespace {
+	typedef void (*MomentsKernel)(const float* from_x, const float* from_y, const float* from_z,
+								  const float* to_x, const float* to_y, const float* to_z,
+								  const float* weights, int count, CloudMoments& out);
+
+	// the same operations in the same order as accumulateCloudMoments.
+	void accumulateMomentsScalar(const float* from_x, const float* from_y, const float* from_z,
+								 const float* to_x, const float* to_y, const float* to_z,
+								 const float* weights, int count, CloudMoments& out)
+	{
+		for(int i = 0; i < count; ++i) {
+			const double w = weights[i];
+			const float fx = from_x[i], fy = from_y[i], fz = from_z[i];
+			const float tx = to_x[i], ty = to_y[i], tz = to_z[i];
+			out.w += w;
+			out.from_x += fx * w;
+			out.from_z += fz * w;
+			out.to_x += tx * w;
+			out.to_z += tz * w;
+			out.a += w * (double(fx) * tz - double(tx) * fz);
+			out.b += w * (double(fx) * tx + double(fz) * tz);
+			out.c += w * (double(fx) * fx + double(fy) * fy + double(fz) * fz +
+						  double(tx) * tx + double(ty) * ty + double(tz) * tz -
+						  2.0 * double(fy) * ty);
+		}
+	}
+
+#ifdef MOGED_X86_KERNELS
+	// The moments are summed in double precision like the scalar kernel, since the error is a
+	// difference of large sums that have to cancel. Points are converted to doubles as they're
+	// loaded, two per register for SSE2 and four for AVX. The last partial vector reads the
+	// coordinates' zero padding, and a zero padded copy of the weights.
+
+	__attribute__((target("sse2")))
+	void accumulateMomentsSSE2(const float* from_x, const float* from_y, const float* from_z,
+							   const float* to_x, const float* to_y, const float* to_z,
+							   const float* weights, int count, CloudMoments& out)
+	{
+		__m128d sum_w = _mm_setzero_pd(), sum_fx = _mm_setzero_pd(), sum_fz = _mm_setzero_pd();
+		__m128d sum_tx = _mm_setzero_pd(), sum_tz = _mm_setzero_pd();
+		__m128d sum_a = _mm_setzero_pd(), sum_b = _mm_setzero_pd(), sum_c = _mm_setzero_pd();
+		const __m128d two = _mm_set1_pd(2.0);
+
+		for(int i = 0; i < count; i += 4) {
+			__m128 w4;
+			if(i + 4 <= count)
+				w4 = _mm_loadu_ps(&weights[i]);
+			else {
+				float tail[4] = { 0.f, 0.f, 0.f, 0.f };
+				memcpy(tail, &weights[i], sizeof(float) * (count - i));
+				w4 = _mm_loadu_ps(tail);
+			}
+			const __m128 fx4 = _mm_load_ps(&from_x[i]), fy4 = _mm_load_ps(&from_y[i]), fz4 = _mm_load_ps(&from_z[i]);
+			const __m128 tx4 = _mm_load_ps(&to_x[i]), ty4 = _mm_load_ps(&to_y[i]), tz4 = _mm_load_ps(&to_z[i]);
+
+			for(int half = 0; half < 2; ++half) {
+				__m128d w, fx, fy, fz, tx, ty, tz;
+				if(half == 0) {
+					w = _mm_cvtps_pd(w4);
+					fx = _mm_cvtps_pd(fx4); fy = _mm_cvtps_pd(fy4); fz = _mm_cvtps_pd(fz4);
+					tx = _mm_cvtps_pd(tx4); ty = _mm_cvtps_pd(ty4); tz = _mm_cvtps_pd(tz4);
+				} else {
+					w = _mm_cvtps_pd(_mm_movehl_ps(w4, w4));
+					fx = _mm_cvtps_pd(_mm_movehl_ps(fx4, fx4));
+					fy = _mm_cvtps_pd(_mm_movehl_ps(fy4, fy4));
+					fz = _mm_cvtps_pd(_mm_movehl_ps(fz4, fz4));
+					tx = _mm_cvtps_pd(_mm_movehl_ps(tx4, tx4));
+					ty = _mm_cvtps_pd(_mm_movehl_ps(ty4, ty4));
+					tz = _mm_cvtps_pd(_mm_movehl_ps(tz4, tz4));
+				}
+				sum_w = _mm_add_pd(sum_w, w);
+				sum_fx = _mm_add_pd(sum_fx, _mm_mul_pd(fx, w));
+				sum_fz = _mm_add_pd(sum_fz, _mm_mul_pd(fz, w));
+				sum_tx = _mm_add_pd(sum_tx, _mm_mul_pd(tx, w));
+				sum_tz = _mm_add_pd(sum_tz, _mm_mul_pd(tz, w));
+				sum_a = _mm_add_pd(sum_a, _mm_mul_pd(w, _mm_sub_pd(_mm_mul_pd(fx, tz), _mm_mul_pd(tx, fz))));
+				sum_b = _mm_add_pd(sum_b, _mm_mul_pd(w, _mm_add_pd(_mm_mul_pd(fx, tx), _mm_mul_pd(fz, tz))));
+				__m128d c = _mm_add_pd(_mm_add_pd(_mm_mul_pd(fx, fx), _mm_mul_pd(fy, fy)), _mm_mul_pd(fz, fz));
+				c = _mm_add_pd(c, _mm_add_pd(_mm_add_pd(_mm_mul_pd(tx, tx), _mm_mul_pd(ty, ty)), _mm_mul_pd(tz, tz)));
+				c = _mm_sub_pd(c, _mm_mul_pd(two, _mm_mul_pd(fy, ty)));
+				sum_c = _mm_add_pd(sum_c, _mm_mul_pd(w, c));
+			}
+		}
+
+		double lanes[2];
+		_mm_storeu_pd(lanes, sum_w);  out.w += lanes[0] + lanes[1];
+		_mm_storeu_pd(lanes, sum_fx); out.from_x += lanes[0] + lanes[1];
+		_mm_storeu_pd(lanes, sum_fz); out.from_z += lanes[0] + lanes[1];
+		_mm_storeu_pd(lanes, sum_tx); out.to_x += lanes[0] + lanes[1];
+		_mm_storeu_pd(lanes, sum_tz); out.to_z += lanes[0] + lanes[1];
+		_mm_storeu_pd(lanes, sum_a);  out.a += lanes[0] + lanes[1];
+		_mm_storeu_pd(lanes, sum_b);  out.b += lanes[0] + lanes[1];
+		_mm_storeu_pd(lanes, sum_c);  out.c += lanes[0] + lanes[1];
+	}
+
+	__attribute__((target("avx")))
+	double sumLanes(__m256d v)
+	{
+		double lanes[4];
+		_mm256_storeu_pd(lanes, v);
+		return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	}
+
+	__attribute__((target("avx")))
+	void accumulateMomentsAVX(const float* from_x, const float* from_y, const float* from_z,
+							  const float* to_x, const float* to_y, const float* to_z,
+							  const float* weights, int count, CloudMoments& out)
+	{
+		__m256d sum_w = _mm256_setzero_pd(), sum_fx = _mm256_setzero_pd(), sum_fz = _mm256_setzero_pd();
+		__m256d sum_tx = _mm256_setzero_pd(), sum_tz = _mm256_setzero_pd();
+		__m256d sum_a = _mm256_setzero_pd(), sum_b = _mm256_setzero_pd(), sum_c = _mm256_setzero_pd();
+		const __m256d two = _mm256_set1_pd(2.0);
+
+		for(int i = 0; i < count; i += 4) {
+			__m256d w;
+			if(i + 4 <= count)
+				w = _mm256_cvtps_pd(_mm_loadu_ps(&weights[i]));
+			else {
+				float tail[4] = { 0.f, 0.f, 0.f, 0.f };
+				memcpy(tail, &weights[i], sizeof(float) * (count - i));
+				w = _mm256_cvtps_pd(_mm_loadu_ps(tail));
+			}
+			const __m256d fx = _mm256_cvtps_pd(_mm_load_ps(&from_x[i]));
+			const __m256d fy = _mm256_cvtps_pd(_mm_load_ps(&from_y[i]));
+			const __m256d fz = _mm256_cvtps_pd(_mm_load_ps(&from_z[i]));
+			const __m256d tx = _mm256_cvtps_pd(_mm_load_ps(&to_x[i]));
+			const __m256d ty = _mm256_cvtps_pd(_mm_load_ps(&to_y[i]));
+			const __m256d tz = _mm256_cvtps_pd(_mm_load_ps(&to_z[i]));
+
+			sum_w = _mm256_add_pd(sum_w, w);
+			sum_fx = _mm256_add_pd(sum_fx, _mm256_mul_pd(fx, w));
+			sum_fz = _mm256_add_pd(sum_fz, _mm256_mul_pd(fz, w));
+			sum_tx = _mm256_add_pd(sum_tx, _mm256_mul_pd(tx, w));
+			sum_tz = _mm256_add_pd(sum_tz, _mm256_mul_pd(tz, w));
+			sum_a = _mm256_add_pd(sum_a, _mm256_mul_pd(w, _mm256_sub_pd(_mm256_mul_pd(fx, tz), _mm256_mul_pd(tx, fz))));
+			sum_b = _mm256_add_pd(sum_b, _mm256_mul_pd(w, _mm256_add_pd(_mm256_mul_pd(fx, tx), _mm256_mul_pd(fz, tz))));
+			__m256d c = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(fx, fx), _mm256_mul_pd(fy, fy)), _mm256_mul_pd(fz, fz));
+			c = _mm256_add_pd(c, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(tx, tx), _mm256_mul_pd(ty, ty)), _mm256_mul_pd(tz, tz)));
+			c = _mm256_sub_pd(c, _mm256_mul_pd(two, _mm256_mul_pd(fy, ty)));
+			sum_c = _mm256_add_pd(sum_c, _mm256_mul_pd(w, c));
+		}
+
+		out.w += sumLanes(sum_w);
+		out.from_x += sumLanes(sum_fx);
+		out.from_z += sumLanes(sum_fz);
+		out.to_x += sumLanes(sum_tx);
+		out.to_z += sumLanes(sum_tz);
+		out.a += sumLanes(sum_a);
+		out.b += sumLanes(sum_b);
+		out.c += sumLanes(sum_c);
+	}
+#endif
+
+	bool cpuSupports(CloudKernel kernel)
+	{
+		switch(kernel) {
+		case kCloudKernelScalar: return true;
+#ifdef MOGED_X86_KERNELS
+		case kCloudKernelSSE2: return __builtin_cpu_supports("sse2");
+		case kCloudKernelAVX: return __builtin_cpu_supports("avx");
+#endif
+		default: return false;
+		}
+	}
+
+	CloudKernel g_kernel = kCloudKernelScalar;
+	MomentsKernel g_moments_kernel = accumulateMomentsScalar;
+}
+
+CloudKernel selectCloudKernel(CloudKernel kernel)
+{
+	if(kernel == kCloudKernelAuto || kernel >= kNumCloudKernels)
+		kernel = CloudKernel(kNumCloudKernels - 1);
+	while(kernel > kCloudKernelScalar && !cpuSupports(kernel))
+		kernel = CloudKernel(kernel - 1);
+
+	switch(kernel) {
+#ifdef MOGED_X86_KERNELS
+	case kCloudKernelSSE2: g_moments_kernel = accumulateMomentsSSE2; break;
+	case kCloudKernelAVX: g_moments_kernel = accumulateMomentsAVX; break;
+#endif
+	default: kernel = kCloudKernelScalar; g_moments_kernel = accumulateMomentsScalar; break;
+	}
+	g_kernel = kernel;
+	return kernel;
+}
+
+CloudKernel getCloudKernel()
+{
+	return g_kernel;
+}
+
+const char* getCloudKernelName(CloudKernel kernel)
+{
+	static const char* const names[kNumCloudKernels] = { "auto", "scalar", "sse2", "avx" };
+	return kernel >= 0 && kernel < kNumCloudKernels ? names[kernel] : "unknown";
+}
+
+void accumulateSoAMoments(const float* from_x, const float* from_y, const float* from_z,
+						  const float* to_x, const float* to_y, const float* to_z,
+						  const float* weights, int count, CloudMoments& out)
+{
+	g_moments_kernel(from_x, from_y, from_z, to_x, to_y, to_z, weights, count, out);
+}
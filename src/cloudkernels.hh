@@ -0,0 +1,64 @@
+#ifndef INCLUDED_moged_cloudkernels_HH
+#define INCLUDED_moged_cloudkernels_HH
+
+#include <vector>
+#include "NonCopyable.hh"
+#include "Vector.hh"
+
+struct CloudMoments;
+
+// Frames of a SoACloud are padded to a multiple of this many points.
+enum { kSoALanes = 8 };
+
+// Point cloud with each coordinate in its own array, for the vector kernels below. Each frame is
+// padded with zero points to a multiple of kSoALanes, and the arrays are 32 byte aligned, so
+// every frame starts on a vector boundary and kernels never read past the end.
+class SoACloud : non_copyable
+{
+	std::vector<float> m_storage;
+	float *m_x, *m_y, *m_z;                     // num_frames * stride each, in m_storage
+	int m_points_per_frame;
+	int m_stride;                               // points_per_frame rounded up to kSoALanes
+	int m_num_frames;
+public:
+	SoACloud();
+
+	void Split(const Vec3* points, int points_per_frame, int num_frames);
+	// writes num_frames frames without the padding.
+	void Join(int first_frame, int num_frames, Vec3* out) const;
+
+	const float* GetX(int frame) const { return &m_x[frame * m_stride]; }
+	const float* GetY(int frame) const { return &m_y[frame * m_stride]; }
+	const float* GetZ(int frame) const { return &m_z[frame * m_stride]; }
+	Vec3 GetPoint(int frame, int sample) const {
+		const int i = frame * m_stride + sample;
+		return Vec3(m_x[i], m_y[i], m_z[i]);
+	}
+	int GetPointsPerFrame() const { return m_points_per_frame; }
+	int GetNumFrames() const { return m_num_frames; }
+};
+
+enum CloudKernel {
+	kCloudKernelAuto,
+	kCloudKernelScalar,                         // same results as accumulateCloudMoments
+	kCloudKernelSSE2,
+	kCloudKernelAVX,
+	kNumCloudKernels
+};
+
+// Use kernel for SoACloud comparisons from now on. Auto picks the widest one the CPU supports, and
+// a kernel the CPU (or compiler) doesn't support falls back to the next narrower one. Returns the
+// kernel used. Not thread safe, select before starting a search.
+CloudKernel selectCloudKernel(CloudKernel kernel);
+CloudKernel getCloudKernel();
+const char* getCloudKernelName(CloudKernel kernel);
+
+// Adds the moments of count corresponding points of a frame of each cloud to out, like
+// accumulateCloudMoments. Coordinates must be 16 byte aligned and readable up to count rounded up
+// to kSoALanes, weights only up to count. The vector kernels keep a sum per lane, so their
+// results differ from the scalar kernel's in the last few bits.
+void accumulateSoAMoments(const float* from_x, const float* from_y, const float* from_z,
+						  const float* to_x, const float* to_y, const float* to_z,
+						  const float* weights, int count, CloudMoments& out);
+
+#endif
@@ -60,6 +60,22 @@ int sql_rollback_transaction( sqlite3 *db )
 	return sqlite3_exec(db, "ROLLBACK TRANSACTION",NULL, NULL, NULL);
 }
 
+int sql_copy_database( sqlite3 *db, const char* filename )
+{
+	sqlite3* copy = 0;
+	int err = sqlite3_open(filename, &copy);
+	if(err == SQLITE_OK) {
+		sqlite3_backup* backup = sqlite3_backup_init(copy, "main", db, "main");
+		if(backup) {
+			sqlite3_backup_step(backup, -1);
+			sqlite3_backup_finish(backup);
+		}
+		err = sqlite3_errcode(copy);
+	}
+	sqlite3_close(copy);
+	return err;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // query helper class
 Query::Query(sqlite3* db)
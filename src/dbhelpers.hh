@@ -16,6 +16,9 @@ int sql_begin_transaction( sqlite3 *db );
 int sql_end_transaction( sqlite3 *db );
 int sql_rollback_transaction( sqlite3 *db );
 
+// copy the whole main database of db to a new file with sqlite's backup api.
+int sql_copy_database( sqlite3 *db, const char* filename );
+
 ////////////////////////////////////////////////////////////////////////////////
 // transaction scoped helper class
 class Transaction {
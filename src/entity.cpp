@@ -450,6 +450,77 @@ void Entity::CreateMissingTables()
 
 	static const char *indexMgNodes1 =
 		"CREATE UNIQUE INDEX IF NOT EXISTS idx_mg_nodes ON motion_graph_nodes (id)";		
+
+	static const char* createCloudCacheStmt =
+		"CREATE TABLE IF NOT EXISTS cloud_cache ("
+		"id INTEGER PRIMARY KEY ASC AUTOINCREMENT,"
+		"clip_id INTEGER NOT NULL,"
+		"skel_id INTEGER NOT NULL,"
+		"mesh_id INTEGER NOT NULL," // 0 when sampling the skeleton
+		"sampler BLOB NOT NULL," // CloudSampler::GetSignature
+		"num_frames INTEGER NOT NULL,"
+		"samples_per_frame INTEGER NOT NULL,"
+		"points BLOB," // vec3s, num_frames * samples_per_frame
+		"UNIQUE(clip_id),"
+		"CONSTRAINT cloud_clip_d FOREIGN KEY (clip_id) REFERENCES clips(id) ON DELETE CASCADE)";
+
+	static const char *indexCloudCache =
+		"CREATE UNIQUE INDEX IF NOT EXISTS idx_cloud_cache ON cloud_cache (clip_id)";
+
+	static const char* createErrorFunctionsStmt =
+		"CREATE TABLE IF NOT EXISTS error_functions ("
+		"id INTEGER PRIMARY KEY ASC AUTOINCREMENT,"
+		"motion_graph_id INTEGER NOT NULL,"
+		"from_clip_id INTEGER NOT NULL,"
+		"to_clip_id INTEGER NOT NULL,"
+		"settings BLOB NOT NULL," // sampler signature and the settings that change values
+		"from_max INTEGER NOT NULL,"
+		"to_max INTEGER NOT NULL,"
+		"bound_threshold REAL," // NULL if all values are exact, otherwise values over it may be lower bounds
+		"error_values BLOB," // floats, from_max * to_max
+		"translations BLOB," // vec3s
+		"angles BLOB," // floats
+		"UNIQUE(motion_graph_id,from_clip_id,to_clip_id),"
+		"CONSTRAINT errfn_owner FOREIGN KEY (motion_graph_id) REFERENCES motion_graphs(id) ON DELETE CASCADE,"
+		"CONSTRAINT errfn_from_clip FOREIGN KEY (from_clip_id) REFERENCES clips(id) ON DELETE CASCADE,"
+		"CONSTRAINT errfn_to_clip FOREIGN KEY (to_clip_id) REFERENCES clips(id) ON DELETE CASCADE)";
+
+	static const char *indexErrorFunctions =
+		"CREATE UNIQUE INDEX IF NOT EXISTS idx_error_functions ON error_functions (motion_graph_id,from_clip_id,to_clip_id)";
+
+	static const char* createBuildCheckpointsStmt =
+		"CREATE TABLE IF NOT EXISTS build_checkpoints ("
+		"id INTEGER PRIMARY KEY ASC AUTOINCREMENT,"
+		"motion_graph_id INTEGER NOT NULL,"
+		"settings BLOB NOT NULL," // error function settings and threshold the search was started with
+		"new_clips BLOB," // int64 ids of the clips the build is adding
+		"UNIQUE(motion_graph_id),"
+		"CONSTRAINT checkpoint_owner FOREIGN KEY (motion_graph_id) REFERENCES motion_graphs(id) ON DELETE CASCADE)";
+
+	static const char* createBuildPairsStmt =
+		"CREATE TABLE IF NOT EXISTS build_pairs ("
+		"id INTEGER PRIMARY KEY ASC AUTOINCREMENT,"
+		"motion_graph_id INTEGER NOT NULL,"
+		"from_clip_id INTEGER NOT NULL,"
+		"to_clip_id INTEGER NOT NULL,"
+		"UNIQUE(motion_graph_id,from_clip_id,to_clip_id),"
+		"CONSTRAINT build_pair_owner FOREIGN KEY (motion_graph_id) REFERENCES motion_graphs(id) ON DELETE CASCADE)";
+
+	static const char* createBuildCandidatesStmt =
+		"CREATE TABLE IF NOT EXISTS build_candidates ("
+		"id INTEGER PRIMARY KEY ASC AUTOINCREMENT,"
+		"motion_graph_id INTEGER NOT NULL,"
+		"from_clip_id INTEGER NOT NULL,"
+		"from_frame INTEGER NOT NULL," // in sample time
+		"to_clip_id INTEGER NOT NULL,"
+		"to_frame INTEGER NOT NULL,"
+		"align_translation BLOB,"
+		"align_rotation REAL,"
+		"error REAL,"
+		"CONSTRAINT build_candidate_owner FOREIGN KEY (motion_graph_id) REFERENCES motion_graphs(id) ON DELETE CASCADE)";
+
+	static const char *indexBuildCandidates =
+		"CREATE INDEX IF NOT EXISTS idx_build_candidates ON build_candidates (motion_graph_id)";
 	const char* toCreate[] = 
 	{
 		beginTransaction,
@@ -474,6 +545,14 @@ void Entity::CreateMissingTables()
 		indexMgEdges1,
 		createMotionGraphNodesStmt,
 		indexMgNodes1,
+		createCloudCacheStmt,
+		indexCloudCache,
+		createErrorFunctionsStmt,
+		indexErrorFunctions,
+		createBuildCheckpointsStmt,
+		createBuildPairsStmt,
+		createBuildCandidatesStmt,
+		indexBuildCandidates,
 		endTransaction,
 	};
 		
@@ -16,8 +16,7 @@
 #include "mesh.hh"
 #include "skeleton.hh"
 #include "mogedevents.hh"
-#include "samplers/mesh_sampler.hh"
-#include "samplers/skeleton_sampler.hh"
+#include "mgbuilder.hh"
 
 // TODO: major todo: this entire thing could be way more parallel. It would be
 // cleaner than the state machine it is now. Instead of a state machine, yield
@@ -49,7 +48,12 @@ mogedMotionGraphEditor::mogedMotionGraphEditor( wxWindow* parent, AppContext* ct
 MotionGraphEditor( parent )
 , m_ctx(ctx)
 , m_current_state(StateType_Idle)
+, m_builder(0)
+, m_next_sample_idx(0)
 {
+	for(int i = 0; i < TIMING_SAMPLES; ++i)
+		m_processed_per_second[i] = 0.f;
+
 	RestoreSavedSettings();
 
 	m_btn_create->Enable();
@@ -73,10 +77,13 @@ MotionGraphEditor( parent )
 mogedMotionGraphEditor::~mogedMotionGraphEditor()
 {
 	SaveSettings();
+	delete m_builder;
 }
 
+
 void mogedMotionGraphEditor::OnIdle( wxIdleEvent& event )
 {
+	static const double kMaxTime = 1.f;
 	ostream out(m_report);
 
 	const ClipDB* clips = m_ctx->GetEntity()->GetClips();
@@ -93,36 +100,38 @@ void mogedMotionGraphEditor::OnIdle( wxIdleEvent& event )
 			return;
 		} 
 	
-		if( m_clipPairs.empty() ) { 
+		if( !m_builder->HasPendingPairs() ) { 
 			out << "No pairs left to process. " << endl;
-			out << "Found a total of " << m_working.transition_candidates.size() << " suitable transition candidates." << endl
+			out << "Found a total of " << m_builder->GetNumCandidates() << " suitable transition candidates." << endl
 				<< "Subdividing graph edges..." << endl;
 
-			m_progress->SetRange(m_working.split_list.size());
+			m_progress->SetRange(m_builder->GetNumClips());
 			m_progress->SetValue(0);
-			m_working.cur_split = 0;
 			m_current_state = StateType_SubdividingEdges;
 		} else {
-			CreateTransitionWorkListAndStart(clips, out);
+			StartNextClipPair(clips, out);
 		}
 		break;
 
 	case StateType_FindingTransitions:
+	{
 		if(clips == 0) {
 			out << "FATAL ERROR: clips has somehow become null!" << endl;
 			m_current_state = StateType_Idle;
 			return;
 		} 
 
-		if(!ProcessNextTransition()) 
-		{
-			// Compute minima
-			findErrorFunctionMinima( m_transition_finding.error_function_values, 
-									 m_transition_finding.to_max,
-									 m_transition_finding.from_max,
-									 m_transition_finding.minima_indices );
+		int num_processed = 0;
+		double start_time = omp_get_wtime();
+		bool more = m_builder->ProcessNextTransition(kMaxTime, &num_processed);
+		double end_time = omp_get_wtime();
+
+	 	m_progress->SetValue(m_progress->GetValue() + num_processed);	
+		UpdateTiming(num_processed/(float)(end_time - start_time));
 
-			ExtractTransitionCandidates();
+		if(!more) 
+		{
+			m_builder->FinishPair();
 
 			m_current_state = StateType_ProcessNextClipPair;
 			if(m_stepping) {
@@ -138,13 +147,16 @@ void mogedMotionGraphEditor::OnIdle( wxIdleEvent& event )
 		}
 
 		break;
+	}
 
 	case StateType_SubdividingEdges:
-		if(!ProcessSplits()) {
+		if(!m_builder->ProcessSplits()) {
 			out << "Subdivided edges with new nodes, creating transition edges..." << endl;
-			m_progress->SetRange(m_working.transition_candidates.size());
+			m_progress->SetRange(m_builder->GetNumCandidates());
 			m_progress->SetValue(0);
 			m_current_state = StateType_CreatingBlends;
+		} else {
+			m_progress->SetValue( m_progress->GetValue() + 1);
 		}
 		break;
 
@@ -155,7 +167,7 @@ void mogedMotionGraphEditor::OnIdle( wxIdleEvent& event )
 			return;
 		}
 
-		if(m_working.transition_candidates.empty()) {
+		if(!m_builder->HasPendingCandidates()) {
 			out << "Finished creating transition edges. " << endl;
 			
 			m_btn_create->Enable();
@@ -174,29 +186,23 @@ void mogedMotionGraphEditor::OnIdle( wxIdleEvent& event )
 			m_current_state = StateType_Idle;
 		}
 		else {
-			CreateBlendFromCandidate(out);
+			m_progress->SetValue( m_progress->GetValue() + 1 ); 
+			m_builder->CreateBlendFromCandidate(out);
 		}
 		break;
 
 	case StateType_PruningGraph:
 	{
 		ostream transition_out(m_transition_report);
-		if(!PruneStep(transition_out)) {
-			int numEdgesDeleted = 0;
-            int numNodesDeleted = 0;
-			if( m_working.algo_graph->Commit(&numEdgesDeleted, &numNodesDeleted, m_working.keepFlags) ) {
-				transition_out << "Graph pruning saved, " << numEdgesDeleted << " edges removed and " 
-                    << numNodesDeleted << " nodes removed." << endl;
-			} else {
-				transition_out << "Failed to save graph pruning." << endl;
-			}
+		if(!m_builder->PruneStep(transition_out)) {
+			m_builder->FinishPruning(transition_out);
 
-			int redundantNodesDeleted = 0;
-            m_ctx->GetEntity()->GetMotionGraph()->RemoveRedundantNodes(&redundantNodesDeleted);
-			transition_out << "Removed " << redundantNodesDeleted << " redundant nodes." << endl;
-
-			StartVerifyGraph(transition_out);
+			m_builder->StartVerifyGraph(transition_out);
+			m_prune_progress->SetRange(m_builder->GetNumPruneItems());
+			m_prune_progress->SetValue( 0 );
 			m_current_state = StateType_VerifyGraph;
+		} else {
+			m_prune_progress->SetValue( m_prune_progress->GetValue() + 1 );
 		}
 		break;
 	}
@@ -204,7 +210,7 @@ void mogedMotionGraphEditor::OnIdle( wxIdleEvent& event )
 	case StateType_VerifyGraph:
 	{
 		ostream transition_out(m_transition_report);
-		if(!VerifyGraphStep(transition_out)) {
+		if(!m_builder->VerifyGraphStep(transition_out)) {
 			transition_out << "Done." << endl;
 
 			{
@@ -214,6 +220,8 @@ void mogedMotionGraphEditor::OnIdle( wxIdleEvent& event )
 			}
 
 			m_current_state = StateType_Idle;
+		} else {
+			m_prune_progress->SetValue( m_prune_progress->GetValue() + 1 );
 		}
 		break;
 	}
@@ -331,18 +339,11 @@ void mogedMotionGraphEditor::OnCreate( wxCommandEvent& event )
 {
 	(void)event;
 
-	{
-		// clear all cloud data from other windows before we delete it (m_working.clear())
-		Events::PublishCloudDataEvent ev;
-		ev.CloudA = 0;
-		ev.CloudALen = 0;
-		ev.CloudB = 0;
-		ev.CloudBLen = 0;
-		m_ctx->GetEventSystem()->Send(&ev);
-	}
+	// clear all cloud data from other windows before we delete it (ResetBuilder())
+	ClearCloudData();
 
 	m_settings.clear();
-	m_working.clear();
+	ResetBuilder();
 
 	m_time_left->Clear();
 	*m_time_left << _("N/A");
@@ -364,55 +365,19 @@ void mogedMotionGraphEditor::OnCreate( wxCommandEvent& event )
 	
 	ReadSettings();
 
-	if(m_settings.transition_length <= 0.f) {
-		wxMessageDialog dlg(this, _("Must have a positive transition length."), _("Error"), wxOK|wxICON_ERROR);
+	std::string error;
+	if(!m_builder->Init(m_settings, error)) {
+		wxMessageDialog dlg(this, wxString(error.c_str(), wxConvUTF8), _("Error"), wxOK|wxICON_ERROR);
 		dlg.ShowModal();
 		return;
 	}
 
-	if(m_settings.sample_rate <= 0.f) {
-		wxMessageDialog dlg(this, _("Must have a positive fps sample rate."), _("Error"), wxOK|wxICON_ERROR);
-		dlg.ShowModal();
-		return;
-	}
-
-	// InitCloudSampler() ... 
-
-	const Mesh* mesh = m_ctx->GetEntity()->GetMesh();
-	int num_points_in_cloud = 0; // to be filled in below
-	ASSERT(!m_working.sampler);
-	if(mesh)
-	{
-		// Use a Mesh cloud sampler
-		num_points_in_cloud = mesh->GetNumVerts() * m_settings.point_cloud_rate;
-		if(num_points_in_cloud <= 0) {
-			wxMessageDialog dlg(this, _("Empty point cloud. Try increasing cloud sample percentage."), _("Error"), wxOK|wxICON_ERROR);
-			dlg.ShowModal();
-			return;
-		}
-
-		int max_point_cloud_size = atoi( m_max_point_cloud_size->GetValue().char_str());
-		num_points_in_cloud = Min(max_point_cloud_size, num_points_in_cloud);
-
-		MeshCloudSampler *meshSampler = new MeshCloudSampler;
-		m_working.sampler = meshSampler;
-		meshSampler->Init(num_points_in_cloud, skel, mesh, m_settings.num_threads, m_settings.sample_interval);
-	}
-	else
-	{
-		// We have no mesh, so sample points on the skeleton.
-		int point_cloud_size = atoi( m_max_point_cloud_size->GetValue().char_str());
-        SkeletonCloudSampler *skeletonSampler = new SkeletonCloudSampler;
-        m_working.sampler = skeletonSampler;
-        skeletonSampler->Init(point_cloud_size, skel, m_settings.sample_interval);
-	}
-
 	out << "Starting with: " << endl
 		<< "No. OMP Threads: " << m_settings.num_threads << endl
 		<< "Maximum Error Threshold: " << m_settings.error_threshold << endl
 		<< "Point Cloud Sample Rate: " << m_settings.point_cloud_rate << endl
-		<< "Requested Number of points in cloud: " << num_points_in_cloud << endl
-		<< "Cloud Samples Per Frame: " << m_working.sampler->GetSamplesPerFrame() << endl
+		<< "Requested Number of points in cloud: " << m_builder->GetNumPointsRequested() << endl
+		<< "Cloud Samples Per Frame: " << m_builder->GetSamplesPerFrame() << endl
 		<< "Transition Length: " << m_settings.transition_length << endl
 		<< "FPS Sample Rate: " << m_settings.sample_rate << endl
 		<< "Transition Samples: " << m_settings.num_samples << endl
@@ -431,22 +396,15 @@ void mogedMotionGraphEditor::OnCreate( wxCommandEvent& event )
 		return;
 	}
 	
-	PopulateInitialMotionGraph(graph, clips, out);
-
-	// TODO: below should probably be in a func: AllocatePointCloudStorage() ...
-
-	m_working.num_clouds = graph->GetNumEdges(); // one cloud array per clip
-	m_working.clouds = new Vec3*[ m_working.num_clouds ];
-	m_working.cloud_lengths = new int[ m_working.num_clouds ];
-	memset(m_working.clouds, 0, sizeof(Vec3*)*m_working.num_clouds);
-	memset(m_working.cloud_lengths, 0, sizeof(int)*m_working.num_clouds);
-
-	omp_set_num_threads(m_settings.num_threads);
+	m_builder->Start(graph, clips, out);
 
-	InitJointWeights();
-	out << "Inverse sum of weights is " << m_working.inv_sum_weights << endl;
+	for(int i = 0; i < TIMING_SAMPLES; ++i)
+		m_processed_per_second[i] = 0.f;
+	m_next_sample_idx = 0;
 
-	CreateWorkListAndStart();
+	m_progress->SetRange(m_builder->GetTotalWork());
+	m_progress->SetValue(0);
+	m_current_state = StateType_ProcessNextClipPair;
 }
 
 void mogedMotionGraphEditor::OnCancel( wxCommandEvent& event )
@@ -521,22 +479,26 @@ void mogedMotionGraphEditor::OnContinue( wxCommandEvent& event )
 	m_current_state = StateType_FindingTransitions;
 }
 
+
 void mogedMotionGraphEditor::OnViewDistanceFunction( wxCommandEvent& event )
 {
 	(void)event;
+	if(m_builder == 0) return;
+
+	const MotionGraphBuilder::TransitionFindingData& finding = m_builder->GetTransitionFinding();
 	if((m_current_state == StateType_TransitionsStepPaused ||
 		m_current_state == StateType_TransitionsPaused) 
-        && !m_transition_finding.fromClip.Null() && !m_transition_finding.toClip.Null())
+        && !finding.fromClip.Null() && !finding.toClip.Null())
 	{
-		ASSERT(m_transition_finding.error_function_values);
-
-		const int dim_y = m_transition_finding.from_max;
-		const int dim_x = m_transition_finding.to_max;
-		mogedDifferenceFunctionViewer dlg(this, dim_y, dim_x, m_transition_finding.error_function_values,
-										  m_transition_finding.current_error_threshold,
-										  m_transition_finding.minima_indices,
-										  m_transition_finding.fromClip->GetName(),
-										  m_transition_finding.toClip->GetName());
+		ASSERT(finding.error_function_values);
+
+		const int dim_y = finding.from_max;
+		const int dim_x = finding.to_max;
+		mogedDifferenceFunctionViewer dlg(this, dim_y, dim_x, finding.error_function_values,
+										  finding.current_error_threshold,
+										  finding.minima_indices,
+										  finding.fromClip->GetName(),
+										  finding.toClip->GetName());
 		dlg.ShowModal();
 	}
 }
@@ -544,12 +506,7 @@ void mogedMotionGraphEditor::OnViewDistanceFunction( wxCommandEvent& event )
 void mogedMotionGraphEditor::OnClose( wxCloseEvent& event ) 
 {
 	// this stuff will be deleted when we exit, so tell other windows to stop looking at it.
-	Events::PublishCloudDataEvent ev;
-	ev.CloudA = 0;
-	ev.CloudALen = 0;
-	ev.CloudB = 0;
-	ev.CloudBLen = 0;
-	m_ctx->GetEventSystem()->Send(&ev);
+	ClearCloudData();
 
 	event.Skip();
 }
@@ -586,21 +543,11 @@ void mogedMotionGraphEditor::OnPruneGraph( wxCommandEvent& event )
 	}
 	
 	out << "Pruning graph ... " << endl;
-	m_working.algo_graph = graph->GetAlgorithmGraph();
-	m_working.algo_graph->InitializePruning(m_working.keepFlags);
-
-	m_working.cur_prune_item = 0;
-	m_working.graph_pruning_queue.clear();
-	m_working.graph_pruning_queue.push_back(PruneWorkItem(0, "Main"));
-
-	Query get_annos(m_ctx->GetEntity()->GetDB(), "SELECT id,name FROM annotations");
-	// TODO: add a work item for each unique set of annotations
-	while(get_annos.Step()) {
-		m_working.graph_pruning_queue.push_back(PruneWorkItem(get_annos.ColInt64(0),
-															  get_annos.ColText(1)));
-	}
+	ClearCloudData();
+	ResetBuilder();
+	m_builder->StartPruning(graph);
 
-	m_prune_progress->SetRange(m_working.graph_pruning_queue.size());
+	m_prune_progress->SetRange(m_builder->GetNumPruneItems());
 	m_prune_progress->SetValue(0);
 
 	out << "Starting..." << endl;
@@ -641,84 +588,6 @@ void mogedMotionGraphEditor::OnExportGraphViz( wxCommandEvent& event )
 }
 
 
-////////////////////////////////////////////////////////////////////////////////
-mogedMotionGraphEditor::TransitionWorkingData::TransitionWorkingData()
-	: sampler(0), num_clouds(0), clouds(0), cloud_lengths(0), joint_weights(0)
-{
-	clear();
-}
-
-void mogedMotionGraphEditor::TransitionWorkingData::clear()
-{
-	delete sampler; sampler = 0;
-
-	for(int i = 0; i < num_clouds; ++i) {
-		delete[] clouds[i];
-	}
-	delete[] clouds; clouds = 0;
-	delete[] cloud_lengths; cloud_lengths = 0;
-	num_clouds = 0;
-
-	for(int i = 0; i < mogedMotionGraphEditor::TIMING_SAMPLES; ++i)
-		processed_per_second[i] = 0.f;
-	next_sample_idx = 0;
-
-	delete[] joint_weights; joint_weights = 0;
-	inv_sum_weights = 0.f;
-
-	transition_candidates.clear();
-	split_list.clear();
-	cur_split = 0;
-	
-	working_set.clear();
-    initial_edges.clear();
-
-	algo_graph = AlgorithmMotionGraphHandle();
-
-    keepFlags.clear();
-
-	graph_pruning_queue.clear();
-	cur_prune_item = 0;
-}
-
-////////////////////////////////////////////////////////////////////////////////
-mogedMotionGraphEditor::TransitionFindingData::TransitionFindingData()
-	: error_function_values(0), alignment_translations(0), alignment_angles(0)
-{ 
-	clear() ;
-}
-
-void mogedMotionGraphEditor::TransitionFindingData::clear()
-{
-	from_idx = 0;
-	to_idx = 0;
-	fromClip = ClipHandle();
-	toClip = ClipHandle();
-	from_frame = 0;
-	to_frame = 0;
-	from_max = 0;
-	to_max = 0;
-
-	current_error_threshold = 0.f;
-	delete[] error_function_values; error_function_values = 0;
-	minima_indices.clear();
-
-	delete[] alignment_translations; alignment_translations = 0;
-	delete[] alignment_angles; alignment_angles = 0;
-}
-
-void mogedMotionGraphEditor::Settings::clear()
-{
-	num_threads = 0;
-	error_threshold = 0.f;
-	point_cloud_rate = 0.f;
-	transition_length = 0.f;
-	sample_rate = 0.f;
-	weight_falloff = 0.f;
-	num_samples = 0;
-	sample_interval = 0.f;
-}
-
 ////////////////////////////////////////////////////////////////////////////////
 void mogedMotionGraphEditor::ReadSettings()
 {
@@ -733,6 +602,8 @@ void mogedMotionGraphEditor::ReadSettings()
 	
 	float sample_rate = atof(m_point_cloud_rate_value->GetValue().char_str());
 	m_settings.point_cloud_rate = Clamp(sample_rate,0.f,1.f);
+
+	m_settings.max_point_cloud_size = atoi( m_max_point_cloud_size->GetValue().char_str());
 	
 	float fps_rate = atof(m_fps_sample_rate->GetValue().char_str());
 	m_settings.sample_rate = fps_rate;
@@ -742,97 +613,24 @@ void mogedMotionGraphEditor::ReadSettings()
 
 	float weight_falloff = atof(m_weight_falloff_value->GetValue().char_str());
 	m_settings.weight_falloff = Clamp(weight_falloff, 0.f, 1.f);
+	m_settings.cache_clouds = true;
 	
-	m_settings.num_samples = int(transition_length * fps_rate);
-	if(fps_rate > 0.f)
-		m_settings.sample_interval = 1.f/fps_rate;
+	m_settings.ComputeSampling();
 }
 
-void mogedMotionGraphEditor::CreateWorkListAndStart()
+void mogedMotionGraphEditor::ResetBuilder()
 {
-	m_clipPairs.clear();
-    const int numClips = m_working.working_set.size();
-
-	// now generate pairs from this list - as a side effect this will pre-cache all of the clips.
-	int work_size = 0;
-	for(int from = 0; from < numClips; ++from)
-	{
-		ClipHandle fromClip = m_working.working_set[from];
-		const int from_size = Max(0,int(fromClip->GetClipTime() * m_settings.sample_rate) - m_settings.num_samples);
-		for(int to = 0; to < numClips; ++to) {
-			ClipHandle toClip = m_working.working_set[to];
-			const int to_size = Max(0,int(toClip->GetClipTime() * m_settings.sample_rate) - m_settings.num_samples);
-			work_size += from_size * to_size; // for progress bar - work size inc for each comparison
-			m_clipPairs.push_back( make_pair(from,to) );
-		}
-	}
-
-	// create empty buckets for splitting later
-	m_working.split_list.clear();
-	m_working.split_list.resize(numClips);
-	
-    // progress bar stuff
-	work_size += numClips; // increase work size by one per clip (for splitting?)
-	m_progress->SetRange(work_size);
-	m_progress->SetValue(0);
-	m_current_state = StateType_ProcessNextClipPair;
+	delete m_builder;
+	m_builder = new MotionGraphBuilder(m_ctx->GetEntity()->GetDB(), 
+									   m_ctx->GetEntity()->GetSkeleton(),
+									   m_ctx->GetEntity()->GetMesh());
+	m_builder->SetListener(this);
 }
-	
-void mogedMotionGraphEditor::CreateTransitionWorkListAndStart(const ClipDB * clips, ostream& out)
-{
-	ClipPair pair = m_clipPairs.front();
-	m_clipPairs.pop_front();
-
-	ClipHandle fromClip = m_working.working_set[pair.first];
-	ClipHandle toClip = m_working.working_set[pair.second];
-
-	out << "Finding transitions from \"" << fromClip->GetName() << "\" to \"" <<
-		toClip->GetName() << "\". " << endl;			
 
-	m_transition_finding.clear();
-	m_transition_finding.from_idx = pair.first;
-	m_transition_finding.to_idx = pair.second;
-	m_transition_finding.fromClip = fromClip;
-	m_transition_finding.toClip = toClip;	
-	m_transition_finding.from_frame = 0;
-
-	m_transition_finding.from_max = Max(0,int(fromClip->GetClipTime() * m_settings.sample_rate) - m_settings.num_samples);
-	m_transition_finding.to_max = Max(0,int(toClip->GetClipTime() * m_settings.sample_rate) - m_settings.num_samples);
-	m_transition_finding.to_frame = 0;
-
-	if(m_transition_finding.from_max == 0)
-	{
-		out << "Discarding pair, \"" << fromClip->GetName() << "\" isn't long enough to have a transition of length " << m_settings.transition_length << endl;
-		m_transition_finding.clear();
-		return;
-	}
-	else if(m_transition_finding.to_max == 0)
-	{
-		out << "Discarding pair, \"" << toClip->GetName() << "\" isn't long enough to have a transition of length " << m_settings.transition_length << endl;
-		m_transition_finding.clear();
+void mogedMotionGraphEditor::StartNextClipPair(const ClipDB * clips, ostream& out)
+{
+	if(!m_builder->StartNextPair(clips, out))
 		return;
-	}
-
-	std::vector< Annotation > from_clip_annotations, to_clip_annotations;
-	clips->GetAnnotations(from_clip_annotations, fromClip->GetID());
-	clips->GetAnnotations(to_clip_annotations, toClip->GetID());
-	m_transition_finding.current_error_threshold = m_settings.error_threshold;
-	int count = from_clip_annotations.size();
-	for(int i = 0; i < count; ++i) 
-		m_transition_finding.current_error_threshold = Min(m_transition_finding.current_error_threshold,
-														   from_clip_annotations[i].GetFidelity());
-	count = to_clip_annotations.size();
-	for(int i = 0; i < count; ++i) 
-		m_transition_finding.current_error_threshold = Min(m_transition_finding.current_error_threshold,
-														   to_clip_annotations[i].GetFidelity());
-
-	const int num_error_vals = 	m_transition_finding.from_max * m_transition_finding.to_max;
-	m_transition_finding.error_function_values = new float[num_error_vals];
-	for(int i = 0; i < num_error_vals; ++i) m_transition_finding.error_function_values[i] = 9999.f;
-	m_transition_finding.alignment_translations = new Vec3[num_error_vals];
-	memset(m_transition_finding.alignment_translations, 0, sizeof(Vec3)*num_error_vals);
-	m_transition_finding.alignment_angles = new float[num_error_vals];
-	memset(m_transition_finding.alignment_angles, 0, sizeof(float)*num_error_vals);
 
 	m_current_state = StateType_FindingTransitions;
 	m_btn_create->Disable();
@@ -840,151 +638,13 @@ void mogedMotionGraphEditor::CreateTransitionWorkListAndStart(const ClipDB * cli
 	m_btn_pause->Enable();
 }
 
-bool mogedMotionGraphEditor::ProcessNextTransition()
-{
-	static const double kMaxTime = 1.f;
-	const int num_from = m_transition_finding.from_max;
-	const int num_to = m_transition_finding.to_max;
-	const int samplesPerFrame = m_working.sampler->GetSamplesPerFrame();
-
-	ASSERT(m_working.clouds && m_working.num_clouds > 0 && m_working.cloud_lengths);
-
-	int num_processed = 0;
-	double start_time = omp_get_wtime();
-
-	// always do at least one thing every time this function is called, 
-	// and don't take longer than kMaxTime. This is enforced through the time_so_far && num_processed checks.
-
-	// Allocate missing point clouds lazily to avoid resampling.
-	if(m_working.clouds[m_transition_finding.from_idx] == 0)
-	{
-		int num_frames = Max(1,
-			int(m_transition_finding.fromClip->GetClipTime() * m_settings.sample_rate));
-		int len = samplesPerFrame * num_frames;
-		m_working.clouds[m_transition_finding.from_idx] = new Vec3[ len ];
-		m_working.cloud_lengths[m_transition_finding.from_idx] = num_frames;
-
-		m_working.sampler->GetSamples(m_working.clouds[m_transition_finding.from_idx], len, 
-			m_transition_finding.fromClip.RawPtr(), num_frames);
-		
-		PublishCloudData(false, Vec3(), 0);
-		++num_processed;
-	}
-
-	double time_so_far = omp_get_wtime() - start_time;
-	if( (time_so_far < kMaxTime || num_processed == 0) &&
-		m_working.clouds[m_transition_finding.to_idx] == 0)
-	{
-		int num_frames = Max(1,
-			int(m_transition_finding.toClip->GetClipTime() * m_settings.sample_rate));
-		int len = samplesPerFrame * num_frames;
-		m_working.clouds[m_transition_finding.to_idx] = new Vec3[ len ];
-		m_working.cloud_lengths[m_transition_finding.to_idx] = num_frames;
-
-		m_working.sampler->GetSamples(m_working.clouds[m_transition_finding.to_idx], len,
-			m_transition_finding.toClip.RawPtr(), num_frames);
-		
-		PublishCloudData(false, Vec3(), 0);
-		++num_processed;
-	}
-
-	// Compute difference points.
-	int from = m_transition_finding.from_frame,
-		to = m_transition_finding.to_frame;
-
-	time_so_far = omp_get_wtime() - start_time;
-	while(from < num_from && (time_so_far < kMaxTime || num_processed == 0)) {
-		if(m_working.clouds[m_transition_finding.from_idx] &&
-		   m_working.clouds[m_transition_finding.to_idx])
-		{
-			if(to < num_to) {
-				// do comparison
-				int from_end = from + m_settings.num_samples;
-				int to_end = to + m_settings.num_samples;
-
-				int from_cloud_len = m_working.cloud_lengths[m_transition_finding.from_idx];
-				int to_cloud_len =  m_working.cloud_lengths[m_transition_finding.to_idx];
-
-				// don't go past the end of what we've allocated - just shorten the comparison. 
-				from_end = Min(from_end, from_cloud_len);
-				to_end = Min(to_end, to_cloud_len);
-
-				int len = Min(from_end - from, to_end - to);
-				ASSERT(len > 0);
-				ASSERT(len <= m_settings.num_samples);
-
-				int from_cloud_offset = from * samplesPerFrame;
-				int to_cloud_offset = to * samplesPerFrame;
-
-				const Vec3* from_cloud = &m_working.clouds[m_transition_finding.from_idx][ from_cloud_offset ];
-				const Vec3* to_cloud = &m_working.clouds[m_transition_finding.to_idx][ to_cloud_offset ];
-
-				ASSERT(from_cloud + len * samplesPerFrame <= 
-					   m_working.clouds[m_transition_finding.from_idx] + from_cloud_len * samplesPerFrame);
-				ASSERT(to_cloud + len * samplesPerFrame <= 
-					   m_working.clouds[m_transition_finding.to_idx] + to_cloud_len * samplesPerFrame);
-
-				Vec3 align_translation(0,0,0);
-				float align_rotation = 0.f;
-
-				computeCloudAlignment(from_cloud, to_cloud, 
-									  samplesPerFrame, 
-									  len, 
-									  m_working.joint_weights, 
-									  m_working.inv_sum_weights, 
-									  align_translation, 
-									  align_rotation,
-									  m_settings.num_threads);
-
-				float difference = computeCloudDifference(from_cloud, to_cloud, 
-														  m_working.joint_weights, 
-														  samplesPerFrame, 
-														  len, 
-														  align_translation, align_rotation,
-														  m_settings.num_threads);							   
-				
-				if(difference < m_transition_finding.current_error_threshold)
-					PublishCloudData(true, align_translation, align_rotation, 
-									 from_cloud_offset, len, to_cloud_offset, len);
-
-                int transIndex = from * num_to + to;
-				m_transition_finding.error_function_values[transIndex] = difference;
-				m_transition_finding.alignment_translations[transIndex] = align_translation;
-				m_transition_finding.alignment_angles[transIndex] = align_rotation;
-				++num_processed;
-				++to;
-			} else {
-				++from;
-				to = 0;
-			}
-		} else {
-			break;
-		}
-		time_so_far = omp_get_wtime() - start_time;
-	}
-
-
-	int num_so_far = m_progress->GetValue() + num_processed;	
- 	m_progress->SetValue(num_so_far);	
-	double end_time = omp_get_wtime();
-
-	UpdateTiming(num_processed/(float)(end_time - start_time));
-
-	m_transition_finding.from_frame = from ;
-	m_transition_finding.to_frame = to ;
-
-	if(from < num_from)
-		return true;
- 	return false;
-}
-
 void mogedMotionGraphEditor::UpdateTiming(float num_per_sec)
 {
-	m_working.processed_per_second[m_working.next_sample_idx] = num_per_sec;
-	m_working.next_sample_idx = (m_working.next_sample_idx+1)%TIMING_SAMPLES;
+	m_processed_per_second[m_next_sample_idx] = num_per_sec;
+	m_next_sample_idx = (m_next_sample_idx+1)%TIMING_SAMPLES;
 	float avg = 0.f;
 	for(int i = 0; i < TIMING_SAMPLES; ++i)
-		avg += m_working.processed_per_second[i];
+		avg += m_processed_per_second[i];
 	avg /= float(TIMING_SAMPLES);
 	int num_left = 	m_progress->GetRange() - m_progress->GetValue();
 	
@@ -1013,56 +673,45 @@ void mogedMotionGraphEditor::UpdateTiming(float num_per_sec)
 void mogedMotionGraphEditor::PublishCloudData(bool do_align, Vec3_arg align_translation, float align_rotation,
 											  int from_offset, int from_len , int to_offset, int to_len)
 {
+	const MotionGraphBuilder::TransitionFindingData& finding = m_builder->GetTransitionFinding();
+	const Vec3* from_cloud = m_builder->GetCloud(finding.from_idx);
+	const Vec3* to_cloud = m_builder->GetCloud(finding.to_idx);
+	if(from_cloud == 0 || to_cloud == 0) 
+		return;
+
 	Events::PublishCloudDataEvent ev;
-	ev.SamplesPerFrame = m_working.sampler->GetSamplesPerFrame();
-	ev.CloudA = &m_working.clouds[m_transition_finding.from_idx][from_offset];
-	ev.CloudALen = from_len > 0 ? from_len : m_working.cloud_lengths[m_transition_finding.from_idx];
-	ev.CloudB = &m_working.clouds[m_transition_finding.to_idx][to_offset];
-	ev.CloudBLen = to_len > 0 ? to_len : m_working.cloud_lengths[m_transition_finding.to_idx];
+	ev.SamplesPerFrame = m_builder->GetSamplesPerFrame();
+	ev.CloudA = &from_cloud[from_offset];
+	ev.CloudALen = from_len > 0 ? from_len : m_builder->GetCloudLength(finding.from_idx);
+	ev.CloudB = &to_cloud[to_offset];
+	ev.CloudBLen = to_len > 0 ? to_len : m_builder->GetCloudLength(finding.to_idx);
 	ev.AlignRotation = align_rotation;
 	ev.AlignTranslation = align_translation;
 	ev.Align = do_align ? 1 : 0;
 	m_ctx->GetEventSystem()->Send(&ev);	
 }
 
-void mogedMotionGraphEditor::InitJointWeights()
+void mogedMotionGraphEditor::ClearCloudData()
 {
-	const int num_frames = m_settings.num_samples;
-	const int samples_per_frame = m_working.sampler->GetSamplesPerFrame();
-	const int numWeights = num_frames * samples_per_frame;
-
-	// allocate a sample for every point in the cloud.
-	m_working.joint_weights = new float[numWeights];
-	if(numWeights == 0) return;
-	memset(m_working.joint_weights, 0, sizeof(float)*numWeights);
-
-	float *out_weights = m_working.joint_weights;
-
-	// Get the weights for the first frame so we can compute falloff weights.
-	// these weights are related to the user set weights for importance of joints.
-	m_working.sampler->GetSampleWeights(out_weights);
-
-	int out_idx = samples_per_frame;
-	for(int frame = 1; frame < num_frames; ++frame)
-	{
-		float frac = float(frame) / float(num_frames);
-		for(int i = 0; i < samples_per_frame; ++i) {
-			// compute falloff start and end weights
-			float startw = out_weights[i];
-			float endw = startw * m_settings.weight_falloff;
-
-			// use frac to determine how much of the fall off we use and taper off as we near the 
-			// end of the comparison window
-			out_weights[out_idx++] = (1.0 - frac) * startw + frac * endw;
-		}
-	}
+	Events::PublishCloudDataEvent ev;
+	ev.CloudA = 0;
+	ev.CloudALen = 0;
+	ev.CloudB = 0;
+	ev.CloudBLen = 0;
+	m_ctx->GetEventSystem()->Send(&ev);
+}
 
-	// compute 1/(sum of all weights) for use later
-	double sum = 0.0;
-	for(int i = 0; i < numWeights; ++i)
-		sum += out_weights[i];
+void mogedMotionGraphEditor::OnCloudSampled(int clip_idx)
+{
+	(void)clip_idx;
+	PublishCloudData(false, Vec3(), 0);
+}
 
-	m_working.inv_sum_weights = float(1.0 / sum);
+void mogedMotionGraphEditor::OnCloudMatch(int from_offset, int to_offset, int len, 
+										  Vec3_arg align_translation, float align_rotation)
+{
+	PublishCloudData(true, align_translation, align_rotation, 
+					 from_offset, len, to_offset, len);
 }
 
 void mogedMotionGraphEditor::RestoreSavedSettings()
@@ -1139,259 +788,3 @@ void mogedMotionGraphEditor::SaveSettings()
 	cfg->Write(_("MotionGraphEditor/NumOMPThreads"), atoi(m_num_threads->GetValue().char_str()));	
 	cfg->Write(_("MotionGraphEditor/MaxPointCloudSize"), atoi(m_max_point_cloud_size->GetValue().char_str()));
 }
-
-void mogedMotionGraphEditor::ExtractTransitionCandidates()
-{
-	bool self_processing = m_transition_finding.to_idx == m_transition_finding.from_idx;
-	const int num_minima = m_transition_finding.minima_indices.size();
-	const float minDist = m_settings.num_samples;
-
-	for(int i = 0; i <num_minima; ++i)
-	{
-		int index = m_transition_finding.minima_indices[i];
-
-		float threshold = m_transition_finding.current_error_threshold;
-		if(m_transition_finding.error_function_values[index] < threshold)
-		{
-			int from_frame = index / m_transition_finding.to_max;
-			int to_frame = index % m_transition_finding.to_max;
-
-			// if processing self, ignore any minima within num_samples from the center line (our transition length in frames).
-
-            static const float kInvRootTwo = 1.f/sqrt(2.f);
-			float dist = fabs( kInvRootTwo * (to_frame - from_frame) ); // corresponds to perpendicular distance to center line through error map
-
-			if(!self_processing || dist > minDist)
-			{
-				ClipHandle from_clip = m_working.working_set[ m_transition_finding.from_idx ];
-				ClipHandle to_clip = m_working.working_set[ m_transition_finding.to_idx];
-				
-				TransitionCandidate c;
-				c.from_clip = from_clip;				
-				c.from_frame = from_frame ;
-				c.from_time = (from_frame) * m_settings.sample_interval;
-				c.from_insert_point = int(c.from_time * from_clip->GetClipFPS()) ;
-				
-				// this transition sends us to to_clip @ to_time + sample_interval * (m_settings.num_samples-1),
-				// since we FINISH the transition on that frame.
-				c.to_clip = to_clip;
-				c.to_frame = to_frame ;
-				c.to_time = (to_frame) * m_settings.sample_interval;
-				c.to_insert_point = int( (c.to_time + m_settings.sample_interval * (m_settings.num_samples-1)) * to_clip->GetClipFPS() ) ;
-
-				c.align_translation = m_transition_finding.alignment_translations[index];
-				c.align_rotation = m_transition_finding.alignment_angles[index];
-				m_working.transition_candidates.push_back(c);
-
-                // Queue edge splits for the given clips at the transition
-                // frames. Splits happen in order because it's easy to keep
-                // track of new edge ids (and which edges to split,
-                // subsequently)
-				m_working.split_list[ m_transition_finding.from_idx ].push_back(c.from_insert_point);
-				m_working.split_list[ m_transition_finding.to_idx].push_back(c.to_insert_point);
-			}
-		}
-	}	
-}
-
-bool mogedMotionGraphEditor::ProcessSplits()
-{
-    // Check to see if we are finished
-	if(m_working.cur_split >= (int)m_working.working_set.size()) {
-		return false;
-	}
-
-    // Process each split, subdividing the existing edge for an original clip at the list of frames
-    // in the split_list for that clip. 
-	std::vector< int >& splits = m_working.split_list[ m_working.cur_split ];
-	sqlite3_int64 curEdgeId = m_working.initial_edges[m_working.cur_split];
-	const int num_frames = m_working.working_set[ m_working.cur_split ]->GetNumFrames();
-	++m_working.cur_split;
-
-	MotionGraph* graph = m_ctx->GetEntity()->GetMotionGraph();
-
-	// must be in order to make sure edges are connected properly.
-	std::sort(splits.begin(), splits.end());
-	
-	SavePoint(m_ctx->GetEntity()->GetDB(), "processSplits");
-	int lastSplit = -1;
-	const int count = splits.size();
-	for(int i = 0; i < count; ++i) {
-		if(lastSplit != splits[i]) { 
-			if(splits[i] > 0 && splits[i] < num_frames-1) { // these nodes already exist, so don't bother
-			    sqlite3_int64 new_id = 0;
-				if(0 != graph->SplitEdge( curEdgeId, splits[i], 0, &new_id)) {
-					curEdgeId = new_id;
-				}
-			}
-			lastSplit = splits[i];
-		}
-	}
-
-	m_progress->SetValue( m_progress->GetValue() + 1);
-	return true;
-}
-
-void mogedMotionGraphEditor::CreateBlendFromCandidate(ostream& out)
-{
-	TransitionCandidate candidate = m_working.transition_candidates.front();
-	m_working.transition_candidates.pop_front();
-	m_progress->SetValue( m_progress->GetValue() + 1 ); 
-
-	SavePoint save( m_ctx->GetEntity()->GetDB(), "addTransitionEdge");
-
-	MotionGraph* graph = m_ctx->GetEntity()->GetMotionGraph();
-
-	int original_clip_frame_from = candidate.from_insert_point;
-	int original_clip_frame_to = candidate.to_insert_point;
-
-	if(original_clip_frame_to >= candidate.to_clip->GetNumFrames()) {
-		int old = original_clip_frame_to ;
-		original_clip_frame_to = Clamp(original_clip_frame_to, 0, candidate.to_clip->GetNumFrames() - 1);
-		fprintf(stderr, "Warning: transition to clip is beyond the to clip frame count. Clamping %d to %d...\n",
-				old, original_clip_frame_to);
-	}
-
-    // Find the already split nodes. This should have taken place in ProcessSplits
-	sqlite3_int64 transition_from_node = graph->FindNode(candidate.from_clip->GetID(), original_clip_frame_from);
-	if(transition_from_node == 0) { 
-			out << "Failed to find from node." << endl;
-			save.Rollback(); 
-            return; 
-	}
-		
-	sqlite3_int64 transition_to_node = graph->FindNode(candidate.to_clip->GetID(), original_clip_frame_to);
-	if(transition_to_node == 0) {
-			out << "Failed to find to node." << endl;
-			save.Rollback(); 
-            return; 
-	}
-
-    // TODO: this is kind of lame - are these variables being used elsewhere in
-    // a way that might conflict? should just be m-settings.blendTime
-    float blendTime = m_settings.num_samples * m_settings.sample_interval;
-
-	Quaternion align_rotation = make_rotation(candidate.align_rotation, Vec3(0,1,0));
-	sqlite3_int64 transition_edge_id = graph->AddTransitionEdge(transition_from_node,
-																transition_to_node,
-                                                                blendTime,
-																candidate.align_translation,
-																align_rotation);
-	if(transition_edge_id == 0) {  
-		out << "Failed to add transition edge." << endl;
-		save.Rollback(); return; 
-	}
-}
-
-std::vector<int>* GetLargestSCC( AlgorithmMotionGraph::SCCList& sccs )
-{
-	std::vector<int>* largest_scc = 0;
-	int best_size = 0;
-	AlgorithmMotionGraph::SCCList::iterator cur = sccs.begin(), end = sccs.end();
-	while(cur != end) {
-		if((int)cur->size() > best_size) {
-			best_size = cur->size();
-			largest_scc = &(*cur);
-		}
-		++cur;
-	}	
-	return largest_scc;
-}
-
-bool mogedMotionGraphEditor::PruneStep(ostream& out)
-{
-	if(m_working.cur_prune_item >= (int)m_working.graph_pruning_queue.size()) return false;
-	PruneWorkItem &workItem = m_working.graph_pruning_queue[m_working.cur_prune_item];
-	int set_num = m_working.cur_prune_item++;
-
-	AlgorithmMotionGraph::SCCList sccs;	
-	m_working.algo_graph->ComputeStronglyConnectedComponents( sccs, m_working.keepFlags, workItem.anno );
-
-	if(sccs.empty()) {
-		m_prune_progress->SetValue( m_prune_progress->GetValue() + 1 );
-		return true;
-	}
-
-	std::vector<int>* largest_scc = GetLargestSCC( sccs );
-	out << (workItem.anno == 0 ? "Graph " : "Subgraph ") 
-		<< workItem.name << ": Largest SCC has " << largest_scc->size() << " nodes." << endl;
-
-	m_working.algo_graph->MarkSetNum( set_num, workItem.anno, *largest_scc, m_working.keepFlags);
-
-	m_prune_progress->SetValue( m_prune_progress->GetValue() + 1 );
-	return true;
-}
-
-void mogedMotionGraphEditor::StartVerifyGraph(std::ostream& out)
-{
-	out << "Verifying graph..." << endl;
-	// need a new read of the algo graph because we just did a commit on the last one
-	m_working.algo_graph = m_ctx->GetEntity()->GetMotionGraph()->GetAlgorithmGraph();
-
-	// re-use the pruning queue since it is basically the same thing, but needed to be finished
-	// before we can verify.
-	m_working.cur_prune_item = 0;
-
-	m_prune_progress->SetRange(m_working.graph_pruning_queue.size());
-	m_prune_progress->SetValue( 0 );
-}
-
-bool mogedMotionGraphEditor::VerifyGraphStep(std::ostream& out)
-{
-	if(m_working.cur_prune_item >= (int)m_working.graph_pruning_queue.size()) return false;
-	PruneWorkItem &workItem = m_working.graph_pruning_queue[m_working.cur_prune_item];
-	++m_working.cur_prune_item;
-
-	AlgorithmMotionGraph::Node* node = m_working.algo_graph->FindNodeWithAnno( workItem.anno );
-	if(node) {
-		float total_clip_time = m_ctx->GetEntity()->GetMotionGraph()->CountClipTimeWithAnno( workItem.anno );
-		out << "Subgraph " << workItem.name << " has " << total_clip_time << "s of clip time." << endl;
-
-		const int num_sets = m_working.cur_prune_item;
-		for(int i = 0; i < num_sets; ++i) {
-			if(i != m_working.cur_prune_item) {
-				PruneWorkItem& otherItem = m_working.graph_pruning_queue[i];
-				if(!m_working.algo_graph->CanReachNodeWithAnno( node, otherItem.anno)) {
-					out << "Warning: no way to get from subgraph " << workItem.name << " to subgraph " << 
-						otherItem.name << endl;
-				}
-			}
-		}
-	} else {
-		out << "Subgraph " << workItem.name << " seems to have no nodes!" << endl;
-	}
-
-	m_prune_progress->SetValue( m_prune_progress->GetValue() + 1 );
-	return true;
-}
-
-void mogedMotionGraphEditor::PopulateInitialMotionGraph(MotionGraph* graph, 
-	const ClipDB* clips,
-	std::ostream& out)
-{
-    // Load all clips into the working set
-    std::vector<sqlite3_int64> clipIds;
-    clips->GetClipIDs(clipIds);
-
-    const int numClips = (int)clipIds.size();
-    m_working.working_set.clear();
-	m_working.working_set.resize(numClips);
-    for(int i = 0; i < numClips; ++i) {
-        m_working.working_set[i] = clips->GetClip( clipIds[i] );
-    }
-
-    m_working.initial_edges.clear();
-    m_working.initial_edges.resize(numClips, 0);
-	for(int i = 0; i < numClips; ++i)
-	{
-        ClipHandle clip = m_working.working_set[i];
-		sqlite3_int64 start = graph->AddNode(clip->GetID() , 0 );
-		sqlite3_int64 end = graph->AddNode( clip->GetID(), clip->GetNumFrames() - 1);
-		m_working.initial_edges[i] = graph->AddEdge( start, end );
-	}
-	
-	out << "Using " << numClips << " clips." << endl <<
-		"Created graph with " << graph->GetNumEdges() << " edges and " << graph->GetNumNodes() << " nodes." << endl;
-}
-
-
@@ -0,0 +1,102 @@
+#include <algorithm>
+#include "kdtree.hh"
+
+namespace {
+	// orders point indices by one coordinate, for nth_element.
+	struct CompareCoordinate {
+		const float* points;
+		int dims;
+		int dim;
+		bool operator()(int a, int b) const {
+			return points[a * dims + dim] < points[b * dims + dim];
+		}
+	};
+}
+
+KDTree::KDTree()
+	: m_dims(0)
+{
+}
+
+void KDTree::Build(const float* points, int num_points, int dims)
+{
+	m_dims = dims;
+	m_points.assign(points, points + num_points * dims);
+	m_indices.resize(num_points);
+	for(int i = 0; i < num_points; ++i)
+		m_indices[i] = i;
+	m_nodes.clear();
+	if(num_points > 0)
+		BuildNode(0, num_points);
+}
+
+// Split on the dimension with the widest spread, at the median, so the tree stays balanced
+// however the points are clustered.
+int KDTree::BuildNode(int first, int last)
+{
+	const int node_idx = m_nodes.size();
+	Node node = { -1, 0.f, { -1, -1 }, first, last };
+	m_nodes.push_back(node);
+	if(last - first <= kMaxLeafSize)
+		return node_idx;
+
+	int split_dim = 0;
+	float widest = -1.f;
+	for(int dim = 0; dim < m_dims; ++dim) {
+		float lo = m_points[m_indices[first] * m_dims + dim];
+		float hi = lo;
+		for(int i = first + 1; i < last; ++i) {
+			const float v = m_points[m_indices[i] * m_dims + dim];
+			lo = std::min(lo, v);
+			hi = std::max(hi, v);
+		}
+		if(hi - lo > widest) {
+			widest = hi - lo;
+			split_dim = dim;
+		}
+	}
+	if(widest <= 0.f)
+		return node_idx; // all the same point
+
+	const int mid = first + (last - first) / 2;
+	CompareCoordinate compare = { &m_points[0], m_dims, split_dim };
+	std::nth_element(m_indices.begin() + first, m_indices.begin() + mid, m_indices.begin() + last, compare);
+
+	m_nodes[node_idx].split_dim = split_dim;
+	m_nodes[node_idx].split = m_points[m_indices[mid] * m_dims + split_dim];
+	const int left = BuildNode(first, mid);
+	const int right = BuildNode(mid, last);
+	m_nodes[node_idx].children[0] = left;
+	m_nodes[node_idx].children[1] = right;
+	return node_idx;
+}
+
+void KDTree::FindInRadius(const float* query, float radius, std::vector<int>& out) const
+{
+	if(!m_nodes.empty())
+		FindInRadius(0, query, radius * radius, out);
+}
+
+void KDTree::FindInRadius(int node_idx, const float* query, float radius_sq, std::vector<int>& out) const
+{
+	const Node& node = m_nodes[node_idx];
+	if(node.split_dim < 0) {
+		for(int i = node.first; i < node.last; ++i) {
+			const float* point = &m_points[m_indices[i] * m_dims];
+			float dist_sq = 0.f;
+			for(int dim = 0; dim < m_dims && dist_sq <= radius_sq; ++dim) {
+				const float d = query[dim] - point[dim];
+				dist_sq += d * d;
+			}
+			if(dist_sq <= radius_sq)
+				out.push_back(m_indices[i]);
+		}
+		return;
+	}
+
+	const float d = query[node.split_dim] - node.split;
+	const int near = d <= 0.f ? 0 : 1;
+	FindInRadius(node.children[near], query, radius_sq, out);
+	if(d * d <= radius_sq)
+		FindInRadius(node.children[1 - near], query, radius_sq, out);
+}
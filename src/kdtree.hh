@@ -0,0 +1,40 @@
+#ifndef INCLUDED_moged_kdtree_HH
+#define INCLUDED_moged_kdtree_HH
+
+#include <vector>
+#include "NonCopyable.hh"
+
+// Static k-d tree over points with a fixed number of dimensions, for finding every point within
+// a distance of a query point. Built once, then safe to query from several threads.
+class KDTree : non_copyable
+{
+	struct Node {
+		int split_dim;                  // -1 for leaves
+		float split;
+		int children[2];                // nodes with coordinates <= split and >= split
+		int first, last;                // range of m_indices for leaves
+	};
+
+	enum { kMaxLeafSize = 8 };
+
+	int m_dims;
+	std::vector<float> m_points;        // copy of the points, num_points * m_dims
+	std::vector<int> m_indices;         // point indices, leaves own contiguous ranges
+	std::vector<Node> m_nodes;
+
+	int BuildNode(int first, int last);
+	void FindInRadius(int node, const float* query, float radius_sq, std::vector<int>& out) const;
+public:
+	KDTree();
+
+	// points is num_points * dims floats.
+	void Build(const float* points, int num_points, int dims);
+
+	// Appends the indices of the points no further than radius from query to out.
+	void FindInRadius(const float* query, float radius, std::vector<int>& out) const;
+
+	int GetNumPoints() const { return m_indices.size(); }
+	int GetDims() const { return m_dims; }
+};
+
+#endif
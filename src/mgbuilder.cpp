@@ -0,0 +1,2640 @@
+#include <cstdio>
+#include <cstring>
+#include <ostream>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <omp.h>
+#include "mgbuilder.hh"
+#include "kdtree.hh"
+#include "sql/sqlite3.h"
+#include "MathUtil.hh"
+#include "assert.hh"
+#include "clipdb.hh"
+#include "clip.hh"
+#include "mesh.hh"
+#include "skeleton.hh"
+#include "samplers/mesh_sampler.hh"
+#include "samplers/skeleton_sampler.hh"
+
+using namespace std;
+
+const float MotionGraphBuilder::kCoarseBoundMargin = 1.001f;
+const float MotionGraphBuilder::kUncomputedError = 9999.f;
+
+namespace {
+	struct HeavierSample {
+		const float* weights;
+		bool operator()(int a, int b) const { return weights[a] > weights[b]; }
+	};
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void MotionGraphBuilder::Settings::clear()
+{
+	num_threads = 0;
+	error_threshold = 0.f;
+	point_cloud_rate = 0.f;
+	max_point_cloud_size = 0;
+	sample_seed = 0;
+	transition_length = 0.f;
+	sample_rate = 0.f;
+	weight_falloff = 0.f;
+	coarse_factor = 1;
+	tile_rows = 0;
+	cache_clouds = false;
+	save_error_functions = false;
+	checkpoint_interval = 0.f;
+	shard_index = 0;
+	num_shards = 1;
+	index_windows = false;
+	cull_pairs = false;
+	early_exit = false;
+	pack_clouds = false;
+	split_separation = 0;
+	soa_clouds = false;
+	cloud_kernel = kCloudKernelAuto;
+	num_samples = 0;
+	sample_interval = 0.f;
+}
+
+void MotionGraphBuilder::Settings::ComputeSampling()
+{
+	num_samples = int(transition_length * sample_rate);
+	sample_interval = 0.f;
+	if(sample_rate > 0.f)
+		sample_interval = 1.f/sample_rate;
+}
+
+void MotionGraphBuilder::Stats::clear()
+{
+	num_pairs = 0;
+	num_pairs_discarded = 0;
+	num_pairs_unmatched = 0;
+	num_pairs_culled = 0;
+	num_clouds = 0;
+	num_clouds_cached = 0;
+	max_packing_error = 0.f;
+	num_cells = 0;
+	num_cells_skipped = 0;
+	num_candidates = 0;
+	num_candidates_suppressed = 0;
+	num_splits_merged = 0;
+	num_candidates_unsnapped = 0;
+	num_splits = 0;
+	num_blends = 0;
+	sampling_time = 0.0;
+	index_time = 0.0;
+	search_time = 0.0;
+	split_time = 0.0;
+	blend_time = 0.0;
+	prune_time = 0.0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+MotionGraphBuilder::TransitionWorkingData::TransitionWorkingData()
+	: sampler(0), num_clouds(0), clouds(0), cloud_lengths(0), packed_clouds(0), soa_clouds(0), joint_weights(0)
+	, coarse_clouds(0), coarse_weights(0), self_distances(0)
+{
+	clear();
+}
+
+void MotionGraphBuilder::TransitionWorkingData::clear()
+{
+	delete sampler; sampler = 0;
+	sampler_signature.clear();
+	search_signature.clear();
+	clearSearch();
+}
+
+void MotionGraphBuilder::TransitionWorkingData::clearSearch()
+{
+	for(int i = 0; i < num_clouds; ++i) {
+		delete[] clouds[i];
+		if(packed_clouds) delete packed_clouds[i];
+		if(soa_clouds) delete soa_clouds[i];
+		if(coarse_clouds) delete[] coarse_clouds[i];
+		if(self_distances) delete[] self_distances[i];
+	}
+	delete[] clouds; clouds = 0;
+	delete[] packed_clouds; packed_clouds = 0;
+	delete[] soa_clouds; soa_clouds = 0;
+	delete[] coarse_clouds; coarse_clouds = 0;
+	delete[] self_distances; self_distances = 0;
+	delete[] cloud_lengths; cloud_lengths = 0;
+	num_clouds = 0;
+
+	delete[] joint_weights; joint_weights = 0;
+	sample_order.clear();
+	inv_sum_weights = 0.f;
+
+	delete[] coarse_weights; coarse_weights = 0;
+	coarse_samples_per_frame = 0;
+	coarse_inv_sum_weights = 0.f;
+
+	clips = 0;
+	transition_candidates.clear();
+	split_list.clear();
+	cur_split = 0;
+	finished_pairs.clear();
+	window_matches.clear();
+	descriptor_ranges.clear();
+	num_checkpoint_candidates = 0;
+	last_checkpoint_time = 0.0;
+
+	working_set.clear();
+    initial_edges.clear();
+
+	algo_graph = AlgorithmMotionGraphHandle();
+
+    keepFlags.clear();
+
+	graph_pruning_queue.clear();
+	cur_prune_item = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+MotionGraphBuilder::TransitionFindingData::TransitionFindingData()
+	: error_function_values(0), alignment_translations(0), alignment_angles(0), coarse_values(0)
+{
+	clear() ;
+}
+
+void MotionGraphBuilder::TransitionFindingData::clear()
+{
+	from_idx = 0;
+	to_idx = 0;
+	fromClip = ClipHandle();
+	toClip = ClipHandle();
+	search_step = 0;
+	from_max = 0;
+	to_max = 0;
+	tile_rows = 0;
+	num_tile_slots = 0;
+
+	current_error_threshold = 0.f;
+	delete[] error_function_values; error_function_values = 0;
+	minima_indices.clear();
+
+	delete[] alignment_translations; alignment_translations = 0;
+	delete[] alignment_angles; alignment_angles = 0;
+	delete[] coarse_values; coarse_values = 0;
+	stored_id = 0;
+	bound_threshold = -1.f;
+	use_window_matches = false;
+	window_matches.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+MotionGraphBuilder::MotionGraphBuilder(sqlite3* db, const Skeleton* skel, const Mesh* mesh)
+	: m_db(db)
+	, m_skel(skel)
+	, m_mesh(mesh)
+	, m_graph(0)
+	, m_listener(0)
+	, m_total_work(0)
+{
+}
+
+MotionGraphBuilder::~MotionGraphBuilder()
+{
+}
+
+int MotionGraphBuilder::GetNumPointsRequested() const
+{
+	if(m_mesh)
+		return Min(m_settings.max_point_cloud_size, int(m_mesh->GetNumVerts() * m_settings.point_cloud_rate));
+	return m_settings.max_point_cloud_size;
+}
+
+int MotionGraphBuilder::GetSamplesPerFrame() const
+{
+	return m_working.sampler ? m_working.sampler->GetSamplesPerFrame() : 0;
+}
+
+bool MotionGraphBuilder::Init(const Settings& settings, std::string& error)
+{
+	m_settings = settings;
+	m_working.clear();
+	m_transition_finding.clear();
+	m_clipPairs.clear();
+	m_stats.clear();
+	m_total_work = 0;
+	m_graph = 0;
+
+	if(m_skel == 0) {
+		error = "No skeleton to build a graph for.";
+		return false;
+	}
+
+	if(m_settings.transition_length <= 0.f) {
+		error = "Must have a positive transition length.";
+		return false;
+	}
+
+	if(m_settings.sample_rate <= 0.f) {
+		error = "Must have a positive fps sample rate.";
+		return false;
+	}
+
+	m_settings.num_threads = Max(1, m_settings.num_threads);
+	m_settings.coarse_factor = Max(1, m_settings.coarse_factor);
+	m_settings.num_shards = Max(1, m_settings.num_shards);
+
+	if(m_settings.shard_index < 0 || m_settings.shard_index >= m_settings.num_shards) {
+		error = "Shard index is out of range.";
+		return false;
+	}
+
+	if(m_settings.index_windows && IsCoarse()) {
+		error = "The window index and the coarse search can't be used together.";
+		return false;
+	}
+
+	if(m_settings.pack_clouds && m_settings.soa_clouds) {
+		error = "Clouds can't be both packed and SoA.";
+		return false;
+	}
+	if(m_settings.soa_clouds)
+		m_settings.cloud_kernel = selectCloudKernel(m_settings.cloud_kernel);
+
+	if(m_settings.num_shards > 1 && m_settings.checkpoint_interval <= 0.f) {
+		error = "A shard only saves what it finds in checkpoints, so it needs a checkpoint interval.";
+		return false;
+	}
+
+	const int num_points_in_cloud = GetNumPointsRequested();
+	if(m_mesh)
+	{
+		// Use a Mesh cloud sampler
+		if(int(m_mesh->GetNumVerts() * m_settings.point_cloud_rate) <= 0) {
+			error = "Empty point cloud. Try increasing cloud sample percentage.";
+			return false;
+		}
+
+		MeshCloudSampler *meshSampler = new MeshCloudSampler;
+		m_working.sampler = meshSampler;
+		meshSampler->Init(num_points_in_cloud, m_skel, m_mesh, m_settings.num_threads, m_settings.sample_interval,
+						  m_settings.sample_seed);
+	}
+	else
+	{
+		// We have no mesh, so sample points on the skeleton.
+        SkeletonCloudSampler *skeletonSampler = new SkeletonCloudSampler;
+        m_working.sampler = skeletonSampler;
+        skeletonSampler->Init(num_points_in_cloud, m_skel, m_settings.num_threads, m_settings.sample_interval);
+	}
+	m_working.sampler->GetSignature(m_working.sampler_signature);
+
+	std::vector<char>& signature = m_working.search_signature;
+	signature = m_working.sampler_signature;
+	const float search_settings[] = { m_settings.sample_rate, float(m_settings.num_samples), m_settings.weight_falloff };
+	signature.insert(signature.end(), (const char*)search_settings, (const char*)(search_settings + 3));
+	if(m_settings.pack_clouds) {
+		// packing moves the points, so error functions of packed clouds aren't interchangeable.
+		const char packed[] = "packed";
+		signature.insert(signature.end(), packed, packed + sizeof(packed));
+	}
+	return true;
+}
+
+void MotionGraphBuilder::Start(MotionGraph* graph, const ClipDB* clips, std::ostream& out)
+{
+	StartSearch(graph, clips, kNewGraph, out);
+}
+
+void MotionGraphBuilder::StartAddClips(MotionGraph* graph, const ClipDB* clips, std::ostream& out)
+{
+	StartSearch(graph, clips, kAddClips, out);
+}
+
+bool MotionGraphBuilder::StartResume(MotionGraph* graph, const ClipDB* clips, std::ostream& out)
+{
+	return StartSearch(graph, clips, kResume, out);
+}
+
+bool MotionGraphBuilder::StartSearch(MotionGraph* graph, const ClipDB* clips, StartMode mode, std::ostream& out)
+{
+	ASSERT(m_working.sampler);
+	m_graph = graph;
+	m_working.clearSearch();
+	m_transition_finding.clear();
+	m_clipPairs.clear();
+	m_working.clips = clips;
+
+	if(mode == kResume) {
+		if(!PopulateResumedMotionGraph(clips, out))
+			return false;
+	} else
+		PopulateInitialMotionGraph(clips, mode == kAddClips, out);
+
+	// one cloud array per clip
+	m_working.num_clouds = m_working.working_set.size();
+	m_working.clouds = new Vec3*[ m_working.num_clouds ];
+	m_working.cloud_lengths = new int[ m_working.num_clouds ];
+	memset(m_working.clouds, 0, sizeof(Vec3*)*m_working.num_clouds);
+	memset(m_working.cloud_lengths, 0, sizeof(int)*m_working.num_clouds);
+	if(m_settings.pack_clouds) {
+		m_working.packed_clouds = new PackedCloud*[ m_working.num_clouds ];
+		memset(m_working.packed_clouds, 0, sizeof(PackedCloud*)*m_working.num_clouds);
+	}
+	if(m_settings.soa_clouds) {
+		m_working.soa_clouds = new SoACloud*[ m_working.num_clouds ];
+		memset(m_working.soa_clouds, 0, sizeof(SoACloud*)*m_working.num_clouds);
+	}
+	if(IsCoarse()) {
+		m_working.coarse_clouds = new Vec3*[ m_working.num_clouds ];
+		m_working.self_distances = new float*[ m_working.num_clouds ];
+		memset(m_working.coarse_clouds, 0, sizeof(Vec3*)*m_working.num_clouds);
+		memset(m_working.self_distances, 0, sizeof(float*)*m_working.num_clouds);
+	}
+
+	omp_set_num_threads(m_settings.num_threads);
+
+	InitJointWeights();
+	out << "Inverse sum of weights is " << m_working.inv_sum_weights << endl;
+
+	CreateWorkList();
+
+	if(mode == kResume)
+		LoadCheckpoint(out);
+	else if(m_settings.checkpoint_interval > 0.f)
+		BeginCheckpoints();
+	m_working.last_checkpoint_time = omp_get_wtime();
+	return true;
+}
+
+void MotionGraphBuilder::PopulateInitialMotionGraph(const ClipDB* clips, bool add_clips, std::ostream& out)
+{
+    // Load all clips into the working set
+    std::vector<sqlite3_int64> clipIds;
+    clips->GetClipIDs(clipIds);
+
+    const int numClips = (int)clipIds.size();
+    m_working.working_set.clear();
+	m_working.working_set.resize(numClips);
+    for(int i = 0; i < numClips; ++i) {
+        m_working.working_set[i] = clips->GetClip( clipIds[i] );
+    }
+
+    std::vector<sqlite3_int64> graphClipIds;
+    if(add_clips) {
+        m_graph->GetClipIDs(graphClipIds);
+        std::sort(graphClipIds.begin(), graphClipIds.end());
+    }
+
+    m_working.initial_edges.clear();
+    m_working.initial_edges.resize(numClips, 0);
+    m_working.new_clips.clear();
+    m_working.new_clips.resize(numClips, true);
+    int numNewClips = 0;
+	for(int i = 0; i < numClips; ++i)
+	{
+        ClipHandle clip = m_working.working_set[i];
+        if(std::binary_search(graphClipIds.begin(), graphClipIds.end(), clip->GetID())) {
+            m_working.new_clips[i] = false;
+            continue;
+        }
+        ++numNewClips;
+		sqlite3_int64 start = m_graph->AddNode(clip->GetID() , 0 );
+		sqlite3_int64 end = m_graph->AddNode( clip->GetID(), clip->GetNumFrames() - 1);
+		m_working.initial_edges[i] = m_graph->AddEdge( start, end );
+	}
+
+	if(add_clips)
+		out << "Adding " << numNewClips << " new clips." << endl;
+	out << "Using " << numClips << " clips." << endl <<
+		"Created graph with " << m_graph->GetNumEdges() << " edges and " << m_graph->GetNumNodes() << " nodes." << endl;
+}
+
+// The clips of a resumed search are the clips in the graph. Splits haven't happened yet, but
+// clips that were in the graph before an add may have been split, so all of them look up the
+// edges to split.
+bool MotionGraphBuilder::PopulateResumedMotionGraph(const ClipDB* clips, std::ostream& out)
+{
+	Query get_checkpoint(m_db, "SELECT settings, length(settings), new_clips, length(new_clips) "
+						 "FROM build_checkpoints WHERE motion_graph_id = ?");
+	get_checkpoint.BindInt64(1, m_graph->GetID());
+	if(!get_checkpoint.Step()) {
+		out << "Graph \"" << m_graph->GetName() << "\" has no search to resume." << endl;
+		return false;
+	}
+
+	std::vector<char> signature;
+	GetCheckpointSignature(signature);
+	if(get_checkpoint.ColInt(1) != (int)signature.size() ||
+	   memcmp(get_checkpoint.ColBlob(0), &signature[0], signature.size()) != 0) {
+		out << "The search in graph \"" << m_graph->GetName() << "\" was started with different settings." << endl;
+		return false;
+	}
+
+	const int num_new = get_checkpoint.ColInt(3) / sizeof(sqlite3_int64);
+	const sqlite3_int64* new_ids = (const sqlite3_int64*)get_checkpoint.ColBlob(2);
+	std::vector<sqlite3_int64> newClipIds(new_ids, new_ids + (new_ids ? num_new : 0));
+	std::sort(newClipIds.begin(), newClipIds.end());
+
+	std::vector<sqlite3_int64> graphClipIds;
+	m_graph->GetClipIDs(graphClipIds);
+	std::sort(graphClipIds.begin(), graphClipIds.end());
+
+	std::vector<sqlite3_int64> clipIds;
+	clips->GetClipIDs(clipIds);
+
+	m_working.working_set.clear();
+	m_working.new_clips.clear();
+	const int count = clipIds.size();
+	for(int i = 0; i < count; ++i) {
+		if(std::binary_search(graphClipIds.begin(), graphClipIds.end(), clipIds[i])) {
+			m_working.working_set.push_back( clips->GetClip( clipIds[i] ) );
+			m_working.new_clips.push_back( std::binary_search(newClipIds.begin(), newClipIds.end(), clipIds[i]) );
+		}
+	}
+	m_working.initial_edges.clear();
+	m_working.initial_edges.resize(m_working.working_set.size(), 0);
+
+	out << "Resuming search over " << m_working.working_set.size() << " clips." << endl;
+	return true;
+}
+
+void MotionGraphBuilder::CreateWorkList()
+{
+	m_clipPairs.clear();
+    const int numClips = m_working.working_set.size();
+
+	// now generate pairs from this list - as a side effect this will pre-cache all of the clips.
+	// The error function is symmetric, so each unordered pair is compared once and FinishPair
+	// extracts the candidates for both directions.
+	std::vector<int> pair_sizes;
+	for(int from = 0; from < numClips; ++from)
+	{
+		ClipHandle fromClip = m_working.working_set[from];
+		const int from_size = Max(0,int(fromClip->GetClipTime() * m_settings.sample_rate) - m_settings.num_samples);
+		for(int to = from; to < numClips; ++to) {
+			if(!m_working.new_clips[from] && !m_working.new_clips[to])
+				continue;
+			ClipHandle toClip = m_working.working_set[to];
+			const int to_size = Max(0,int(toClip->GetClipTime() * m_settings.sample_rate) - m_settings.num_samples);
+			pair_sizes.push_back(from_size * to_size);
+			m_clipPairs.push_back( make_pair(from,to) );
+		}
+	}
+
+	// Every shard makes the same assignment from the same work list, so between them the shards
+	// cover every pair once. The biggest pairs are dealt out first, each to the shard with the
+	// least work so far, which keeps the shards close to the same size.
+	if(m_settings.num_shards > 1) {
+		const int num_pairs = pair_sizes.size();
+		std::vector< std::pair<int,int> > order; // (-size, pair) so the sort puts big pairs first
+		order.reserve(num_pairs);
+		for(int i = 0; i < num_pairs; ++i)
+			order.push_back( make_pair(-pair_sizes[i], i) );
+		std::sort(order.begin(), order.end());
+
+		std::vector<long long> shard_work(m_settings.num_shards, 0);
+		std::vector<bool> keep(num_pairs, false);
+		for(int i = 0; i < num_pairs; ++i) {
+			const int shard = std::min_element(shard_work.begin(), shard_work.end()) - shard_work.begin();
+			shard_work[shard] += -order[i].first;
+			keep[ order[i].second ] = (shard == m_settings.shard_index);
+		}
+
+		std::vector<int> kept_sizes;
+		std::list< ClipPair >::iterator pair = m_clipPairs.begin();
+		for(int i = 0; i < num_pairs; ++i) {
+			if(keep[i]) {
+				kept_sizes.push_back(pair_sizes[i]);
+				++pair;
+			} else
+				pair = m_clipPairs.erase(pair);
+		}
+		pair_sizes.swap(kept_sizes);
+	}
+
+	int work_size = 0;
+	const int num_pairs = pair_sizes.size();
+	for(int i = 0; i < num_pairs; ++i)
+		work_size += pair_sizes[i]; // for progress bar - work size inc for each comparison
+
+	// create empty buckets for splitting later
+	m_working.split_list.clear();
+	m_working.split_list.resize(numClips);
+
+	work_size += numClips; // increase work size by one per clip (for splitting?)
+	m_total_work = work_size;
+}
+
+void MotionGraphBuilder::InitJointWeights()
+{
+	const int num_frames = m_settings.num_samples;
+	const int samples_per_frame = m_working.sampler->GetSamplesPerFrame();
+	const int numWeights = num_frames * samples_per_frame;
+
+	// allocate a sample for every point in the cloud.
+	m_working.joint_weights = new float[numWeights];
+	if(numWeights == 0) return;
+	memset(m_working.joint_weights, 0, sizeof(float)*numWeights);
+
+	float *out_weights = m_working.joint_weights;
+
+	// Get the weights for the first frame so we can compute falloff weights.
+	// these weights are related to the user set weights for importance of joints.
+	m_working.sampler->GetSampleWeights(out_weights);
+
+	// the early exit compares the heaviest samples first, they're the most likely to rule out a frame.
+	m_working.sample_order.resize(samples_per_frame);
+	for(int i = 0; i < samples_per_frame; ++i)
+		m_working.sample_order[i] = i;
+	HeavierSample heavier = { out_weights };
+	std::stable_sort(m_working.sample_order.begin(), m_working.sample_order.end(), heavier);
+
+	int out_idx = samples_per_frame;
+	for(int frame = 1; frame < num_frames; ++frame)
+	{
+		float frac = float(frame) / float(num_frames);
+		for(int i = 0; i < samples_per_frame; ++i) {
+			// compute falloff start and end weights
+			float startw = out_weights[i];
+			float endw = startw * m_settings.weight_falloff;
+
+			// use frac to determine how much of the fall off we use and taper off as we near the
+			// end of the comparison window
+			out_weights[out_idx++] = (1.0 - frac) * startw + frac * endw;
+		}
+	}
+
+	// compute 1/(sum of all weights) for use later
+	double sum = 0.0;
+	for(int i = 0; i < numWeights; ++i)
+		sum += out_weights[i];
+
+	m_working.inv_sum_weights = float(1.0 / sum);
+
+	if(IsCoarse())
+	{
+		// coarse clouds keep every coarse_factor'th point of each frame with the same weights
+		const int factor = m_settings.coarse_factor;
+		const int coarse_samples = (samples_per_frame + factor - 1) / factor;
+		m_working.coarse_samples_per_frame = coarse_samples;
+		m_working.coarse_weights = new float[coarse_samples];
+		double frame_sum = 0.0;
+		for(int i = 0; i < coarse_samples; ++i) {
+			m_working.coarse_weights[i] = out_weights[i * factor];
+			frame_sum += out_weights[i * factor];
+		}
+
+		// same falloff as computeErrorFunctionDiagonal uses.
+		const double falloff_step = (1.0 - m_settings.weight_falloff) / double(num_frames);
+		double coarse_sum = 0.0;
+		for(int frame = 0; frame < num_frames; ++frame)
+			coarse_sum += frame_sum * (1.0 - falloff_step * frame);
+		m_working.coarse_inv_sum_weights = float(1.0 / coarse_sum);
+	}
+}
+
+bool MotionGraphBuilder::StartNextPair(const ClipDB * clips, ostream& out)
+{
+	ClipPair pair = m_clipPairs.front();
+	m_clipPairs.pop_front();
+	if(!SetupPair(pair, clips, out, m_settings.cull_pairs, m_transition_finding))
+		return false;
+	AllocatePair(m_transition_finding, 0);
+	if(m_settings.save_error_functions)
+		CreateStoredErrorFunction(m_transition_finding, true);
+	return true;
+}
+
+// Error threshold for transitions between two clips, the lowest fidelity of their annotations.
+float MotionGraphBuilder::GetPairErrorThreshold(const ClipDB* clips, const Clip* from_clip, const Clip* to_clip) const
+{
+	std::vector< Annotation > from_clip_annotations, to_clip_annotations;
+	clips->GetAnnotations(from_clip_annotations, from_clip->GetID());
+	clips->GetAnnotations(to_clip_annotations, to_clip->GetID());
+	float threshold = m_settings.error_threshold;
+	int count = from_clip_annotations.size();
+	for(int i = 0; i < count; ++i)
+		threshold = Min(threshold, from_clip_annotations[i].GetFidelity());
+	count = to_clip_annotations.size();
+	for(int i = 0; i < count; ++i)
+		threshold = Min(threshold, to_clip_annotations[i].GetFidelity());
+	return threshold;
+}
+
+// Set up the search for a pair: its clips, sizes and threshold. Returns false for pairs that
+// can't have any transitions, which need no error function. Pairs are only culled when cull is
+// set, since culling needs the clouds.
+bool MotionGraphBuilder::SetupPair(const ClipPair& pair, const ClipDB * clips, ostream& out,
+								   bool cull, TransitionFindingData& finding)
+{
+	ClipHandle fromClip = m_working.working_set[pair.first];
+	ClipHandle toClip = m_working.working_set[pair.second];
+
+	out << "Finding transitions between \"" << fromClip->GetName() << "\" and \"" <<
+		toClip->GetName() << "\". " << endl;
+
+	finding.clear();
+	finding.from_idx = pair.first;
+	finding.to_idx = pair.second;
+	finding.fromClip = fromClip;
+	finding.toClip = toClip;
+	finding.search_step = 0;
+
+	finding.from_max = Max(0,int(fromClip->GetClipTime() * m_settings.sample_rate) - m_settings.num_samples);
+	finding.to_max = Max(0,int(toClip->GetClipTime() * m_settings.sample_rate) - m_settings.num_samples);
+
+	if(finding.from_max == 0)
+	{
+		out << "Discarding pair, \"" << fromClip->GetName() << "\" isn't long enough to have a transition of length " << m_settings.transition_length << endl;
+		finding.clear();
+		++m_stats.num_pairs_discarded;
+		return false;
+	}
+	else if(finding.to_max == 0)
+	{
+		out << "Discarding pair, \"" << toClip->GetName() << "\" isn't long enough to have a transition of length " << m_settings.transition_length << endl;
+		finding.clear();
+		++m_stats.num_pairs_discarded;
+		return false;
+	}
+
+	finding.current_error_threshold = GetPairErrorThreshold(clips, fromClip.RawPtr(), toClip.RawPtr());
+
+	if(cull) {
+		const float bound = PairBound(pair.first, pair.second);
+		if(bound > finding.current_error_threshold * kCoarseBoundMargin * kCoarseBoundMargin) {
+			out << "Culling pair, no windows can be closer than " << bound << "." << endl;
+			if(m_settings.save_error_functions)
+				CreateStoredErrorFunction(finding, false);
+			finding.clear();
+			++m_stats.num_pairs_culled;
+			return false;
+		}
+	}
+
+	// Finalizing a tile needs the rows in the minima window from the tiles on either side, and the
+	// coarse bound needs coarse rows up to coarse_factor-1 away, so tiles must be at least that big.
+	// coarse search leaves bounds instead of values that can't be under this pair's threshold.
+	finding.bound_threshold = (IsCoarse() || m_settings.early_exit) ? finding.current_error_threshold : -1.f;
+	return true;
+}
+
+// Allocate the error function of a pair set up by SetupPair. With tile_rows > 0, it is kept a few
+// tiles of that many rows at a time instead of all at once.
+void MotionGraphBuilder::AllocatePair(TransitionFindingData& finding, int tile_rows)
+{
+	if(tile_rows > 0)
+		tile_rows = Max(tile_rows, Max(kMinimaWindowSize, m_settings.coarse_factor));
+	// Keeping three tiles only saves memory if there are more than that.
+	if(tile_rows > 0 && 3 * tile_rows < finding.from_max) {
+		finding.tile_rows = tile_rows;
+		finding.num_tile_slots = 3;
+	} else {
+		finding.tile_rows = finding.from_max;
+		finding.num_tile_slots = 1;
+	}
+
+	const int num_error_vals = finding.num_tile_slots * finding.tile_rows * finding.to_max;
+	if(IsCoarse()) {
+		finding.coarse_values = new float[num_error_vals];
+		for(int i = 0; i < num_error_vals; ++i) finding.coarse_values[i] = 0.f;
+	}
+	finding.error_function_values = new float[num_error_vals];
+	for(int i = 0; i < num_error_vals; ++i) finding.error_function_values[i] = kUncomputedError;
+	finding.alignment_translations = new Vec3[num_error_vals];
+	memset(finding.alignment_translations, 0, sizeof(Vec3)*num_error_vals);
+	finding.alignment_angles = new float[num_error_vals];
+	memset(finding.alignment_angles, 0, sizeof(float)*num_error_vals);
+
+	++m_stats.num_pairs;
+}
+
+void MotionGraphBuilder::SampleCloud(int clip_idx)
+{
+	SampleClouds(std::vector<int>(1, clip_idx));
+}
+
+// Sample the clips that aren't sampled yet with one call to the sampler, so it can spread all of
+// their frames over the threads. Clouds in the cache are loaded instead.
+void MotionGraphBuilder::SampleClouds(const std::vector<int>& clip_indices)
+{
+	double start_time = omp_get_wtime();
+	const int samplesPerFrame = m_working.sampler->GetSamplesPerFrame();
+
+	std::vector<int> new_clouds;
+	std::vector<bool> cached;
+	std::vector<Vec3*> outs;
+	std::vector<const Clip*> sample_clips;
+	std::vector<int> sample_frames;
+	const int count = clip_indices.size();
+	for(int i = 0; i < count; ++i) {
+		const int clip_idx = clip_indices[i];
+		if(IsSampled(clip_idx))
+			continue;
+		ClipHandle clip = m_working.working_set[clip_idx];
+
+		int num_frames = Max(1, int(clip->GetClipTime() * m_settings.sample_rate));
+		int len = samplesPerFrame * num_frames;
+		m_working.clouds[clip_idx] = new Vec3[ len ];
+		m_working.cloud_lengths[clip_idx] = num_frames;
+
+		new_clouds.push_back(clip_idx);
+		cached.push_back(m_settings.cache_clouds && LoadCachedCloud(clip_idx));
+		if(cached.back())
+			++m_stats.num_clouds_cached;
+		else {
+			outs.push_back(m_working.clouds[clip_idx]);
+			sample_clips.push_back(clip.RawPtr());
+			sample_frames.push_back(num_frames);
+		}
+	}
+	if(!outs.empty())
+		m_working.sampler->GetSamplesForClips(&outs[0], &sample_clips[0], &sample_frames[0], outs.size());
+
+	const int num_new = new_clouds.size();
+	for(int i = 0; i < num_new; ++i) {
+		const int clip_idx = new_clouds[i];
+		if(m_settings.cache_clouds && !cached[i])
+			SaveCachedCloud(clip_idx);
+		if(m_settings.pack_clouds)
+			PackCloud(clip_idx);
+		else if(m_settings.soa_clouds)
+			SplitCloud(clip_idx);
+		if(IsCoarse())
+			InitCoarseCloud(clip_idx);
+		if(m_settings.pack_clouds || m_settings.soa_clouds) {
+			delete[] m_working.clouds[clip_idx];
+			m_working.clouds[clip_idx] = 0;
+		}
+
+		++m_stats.num_clouds;
+		if(m_listener)
+			m_listener->OnCloudSampled(clip_idx);
+	}
+
+	m_stats.sampling_time += omp_get_wtime() - start_time;
+}
+
+// The cache keeps the last cloud sampled for each clip. Anything that changes the points is
+// part of the key, so a cloud sampled with other settings is never loaded, just replaced.
+bool MotionGraphBuilder::LoadCachedCloud(int clip_idx)
+{
+	const int samplesPerFrame = m_working.sampler->GetSamplesPerFrame();
+	const int num_frames = m_working.cloud_lengths[clip_idx];
+	const int num_bytes = sizeof(Vec3) * samplesPerFrame * num_frames;
+	const std::vector<char>& signature = m_working.sampler_signature;
+
+	Query get_cloud(m_db, "SELECT points FROM cloud_cache WHERE clip_id = ? AND skel_id = ? AND mesh_id = ? "
+					"AND sampler = ? AND num_frames = ? AND samples_per_frame = ? AND length(points) = ?");
+	get_cloud.BindInt64(1, m_working.working_set[clip_idx]->GetID())
+		.BindInt64(2, m_skel->GetID())
+		.BindInt64(3, m_mesh ? m_mesh->GetID() : 0)
+		.BindBlob(4, signature.empty() ? 0 : &signature[0], signature.size())
+		.BindInt(5, num_frames)
+		.BindInt(6, samplesPerFrame)
+		.BindInt(7, num_bytes);
+	if(!get_cloud.Step())
+		return false;
+
+	const void* points = get_cloud.ColBlob(0);
+	if(points == 0)
+		return false;
+	memcpy(m_working.clouds[clip_idx], points, num_bytes);
+	return true;
+}
+
+void MotionGraphBuilder::SaveCachedCloud(int clip_idx)
+{
+	const int samplesPerFrame = m_working.sampler->GetSamplesPerFrame();
+	const int num_frames = m_working.cloud_lengths[clip_idx];
+	const std::vector<char>& signature = m_working.sampler_signature;
+
+	Query save_cloud(m_db, "INSERT OR REPLACE INTO cloud_cache (clip_id, skel_id, mesh_id, sampler, "
+					 "num_frames, samples_per_frame, points) VALUES (?, ?, ?, ?, ?, ?, ?)");
+	save_cloud.BindInt64(1, m_working.working_set[clip_idx]->GetID())
+		.BindInt64(2, m_skel->GetID())
+		.BindInt64(3, m_mesh ? m_mesh->GetID() : 0)
+		.BindBlob(4, signature.empty() ? 0 : &signature[0], signature.size())
+		.BindInt(5, num_frames)
+		.BindInt(6, samplesPerFrame)
+		.BindBlob(7, m_working.clouds[clip_idx], sizeof(Vec3) * samplesPerFrame * num_frames);
+	save_cloud.Step();
+}
+
+// Replace the points of a clip's cloud with the packed points, so the coarse cloud and window
+// descriptors are computed from the same points as the error function.
+void MotionGraphBuilder::PackCloud(int clip_idx)
+{
+	const int len = m_working.sampler->GetSamplesPerFrame() * m_working.cloud_lengths[clip_idx];
+	PackedCloud* packed = new PackedCloud;
+	packed->Pack(m_working.clouds[clip_idx], len);
+	packed->Unpack(0, len, m_working.clouds[clip_idx]);
+	m_working.packed_clouds[clip_idx] = packed;
+	m_stats.max_packing_error = Max(m_stats.max_packing_error, packed->GetMaxError());
+}
+
+void MotionGraphBuilder::SplitCloud(int clip_idx)
+{
+	SoACloud* split = new SoACloud;
+	split->Split(m_working.clouds[clip_idx], m_working.sampler->GetSamplesPerFrame(), m_working.cloud_lengths[clip_idx]);
+	m_working.soa_clouds[clip_idx] = split;
+}
+
+bool MotionGraphBuilder::IsSampled(int clip_idx) const
+{
+	return m_working.clouds[clip_idx] ||
+		(m_working.packed_clouds && m_working.packed_clouds[clip_idx]) ||
+		(m_working.soa_clouds && m_working.soa_clouds[clip_idx]);
+}
+
+// The first num_frames frames of a clip's cloud as Vec3s, however it's stored.
+void MotionGraphBuilder::CopyCloud(int clip_idx, int num_frames, Vec3* out) const
+{
+	const int samples_per_frame = m_working.sampler->GetSamplesPerFrame();
+	if(m_working.clouds[clip_idx])
+		std::copy(m_working.clouds[clip_idx], m_working.clouds[clip_idx] + num_frames * samples_per_frame, out);
+	else if(m_working.packed_clouds && m_working.packed_clouds[clip_idx])
+		m_working.packed_clouds[clip_idx]->Unpack(0, num_frames * samples_per_frame, out);
+	else
+		m_working.soa_clouds[clip_idx]->Join(0, num_frames, out);
+}
+
+// Pick the points of the coarse cloud and compute the distances between nearby windows of the
+// clip, which CoarseBound uses to bound the error of cells between the coarse diagonals.
+void MotionGraphBuilder::InitCoarseCloud(int clip_idx)
+{
+	const int factor = m_settings.coarse_factor;
+	const int samples_per_frame = m_working.sampler->GetSamplesPerFrame();
+	const int coarse_samples = m_working.coarse_samples_per_frame;
+	const int num_frames = m_working.cloud_lengths[clip_idx];
+	const Vec3* cloud = m_working.clouds[clip_idx];
+
+	Vec3* coarse = new Vec3[ coarse_samples * num_frames ];
+	for(int frame = 0; frame < num_frames; ++frame)
+		for(int i = 0; i < coarse_samples; ++i)
+			coarse[frame * coarse_samples + i] = cloud[frame * samples_per_frame + i * factor];
+	m_working.coarse_clouds[clip_idx] = coarse;
+
+	// self_distances[frame * (factor-1) + d - 1] is the distance between the windows starting at
+	// frame and frame + d. Distance is the square root of the error function, which is a metric.
+	const int num_windows = Max(0, num_frames - m_settings.num_samples + 1);
+	const int stride = factor - 1;
+	float* distances = new float[ Max(1, num_windows * stride) ];
+	for(int i = 0; i < num_windows * stride; ++i) distances[i] = 0.f;
+	for(int d = 1; d <= stride && d < num_windows; ++d) {
+		computeErrorFunctionDiagonal(coarse, num_frames, coarse, num_frames,
+									 coarse_samples,
+									 m_settings.num_samples,
+									 m_working.coarse_weights,
+									 m_settings.weight_falloff,
+									 m_working.coarse_inv_sum_weights,
+									 0, d, num_windows - d,
+									 &distances[d - 1], 0, 0,
+									 stride);
+	}
+	for(int i = 0; i < num_windows * stride; ++i)
+		distances[i] = sqrt(distances[i]);
+	m_working.self_distances[clip_idx] = distances;
+}
+
+int MotionGraphBuilder::GetDescriptorSize() const
+{
+	const int frame_groups = Min(int(kDescriptorFrameGroups), m_settings.num_samples);
+	const int sample_groups = Min(int(kDescriptorSampleGroups), m_working.sampler->GetSamplesPerFrame());
+	return 2 * frame_groups * sample_groups;
+}
+
+// Descriptors of the first num_windows windows of a clip, for the window index. The points of a
+// window are split into groups by frame and by sample, and each group has its mean height and
+// mean horizontal distance from the window's centroid, times the square root of its weight.
+// Alignment is a rotation about y plus the translation that puts the centroids together, so it
+// changes neither, and each point's error is at least the difference in height and distance. By
+// Jensen's inequality the same goes for the group means, so the squared distance between two
+// descriptors is a lower bound on the error between their windows.
+void MotionGraphBuilder::ComputeWindowDescriptors(int clip_idx, int num_windows, float* out) const
+{
+	const int samples_per_frame = m_working.sampler->GetSamplesPerFrame();
+	const int num_frames = m_settings.num_samples;
+	const int num_points = num_frames * samples_per_frame;
+	const int frame_groups = Min(int(kDescriptorFrameGroups), num_frames);
+	const int sample_groups = Min(int(kDescriptorSampleGroups), samples_per_frame);
+	const int num_groups = frame_groups * sample_groups;
+	const float* weights = m_working.joint_weights;
+
+	const Vec3* cloud = m_working.clouds[clip_idx];
+	std::vector<Vec3> unpacked;
+	if(cloud == 0 && num_windows > 0) {
+		unpacked.resize((num_windows - 1 + num_frames) * samples_per_frame);
+		CopyCloud(clip_idx, num_windows - 1 + num_frames, &unpacked[0]);
+		cloud = &unpacked[0];
+	}
+
+	std::vector<double> group_weights(num_groups), group_heights(num_groups), group_distances(num_groups);
+	for(int window = 0; window < num_windows; ++window) {
+		const Vec3* points = &cloud[window * samples_per_frame];
+
+		double sum_w = 0.0, sum_x = 0.0, sum_z = 0.0;
+		for(int i = 0; i < num_points; ++i) {
+			sum_w += weights[i];
+			sum_x += weights[i] * points[i].x;
+			sum_z += weights[i] * points[i].z;
+		}
+		const double center_x = sum_w > 0.0 ? sum_x / sum_w : 0.0;
+		const double center_z = sum_w > 0.0 ? sum_z / sum_w : 0.0;
+
+		std::fill(group_weights.begin(), group_weights.end(), 0.0);
+		std::fill(group_heights.begin(), group_heights.end(), 0.0);
+		std::fill(group_distances.begin(), group_distances.end(), 0.0);
+		for(int frame = 0; frame < num_frames; ++frame) {
+			const int frame_group = frame * frame_groups / num_frames;
+			for(int sample = 0; sample < samples_per_frame; ++sample) {
+				const int group = frame_group * sample_groups + sample * sample_groups / samples_per_frame;
+				const int i = frame * samples_per_frame + sample;
+				const double dx = points[i].x - center_x;
+				const double dz = points[i].z - center_z;
+				group_weights[group] += weights[i];
+				group_heights[group] += weights[i] * points[i].y;
+				group_distances[group] += weights[i] * sqrt(dx * dx + dz * dz);
+			}
+		}
+
+		float* descriptor = &out[window * 2 * num_groups];
+		for(int group = 0; group < num_groups; ++group) {
+			const double scale = group_weights[group] > 0.0 ? 1.0 / sqrt(group_weights[group]) : 0.0;
+			descriptor[2 * group] = float(group_heights[group] * scale);
+			descriptor[2 * group + 1] = float(group_distances[group] * scale);
+		}
+	}
+}
+
+// Lower bound on the error of every cell of a pair, from the range of each window descriptor
+// component over each clip. Every descriptor of a clip is in the box of its ranges, so the
+// squared distance between the boxes is at most the squared distance between any two of their
+// descriptors, which is at most the error between the windows.
+float MotionGraphBuilder::PairBound(int from_idx, int to_idx)
+{
+	const int dims = GetDescriptorSize();
+	const int clips[2] = { from_idx, to_idx };
+	m_working.descriptor_ranges.resize(m_working.working_set.size());
+	for(int c = 0; c < 2; ++c) {
+		const int clip = clips[c];
+		std::vector<float>& ranges = m_working.descriptor_ranges[clip];
+		if(!ranges.empty())
+			continue;
+		const int num_windows = Max(0, int(m_working.working_set[clip]->GetClipTime() * m_settings.sample_rate) - m_settings.num_samples);
+		if(num_windows == 0)
+			return 0.f;
+		if(!IsSampled(clip))
+			SampleCloud(clip);
+
+		std::vector<float> descriptors(num_windows * dims);
+		ComputeWindowDescriptors(clip, num_windows, &descriptors[0]);
+		ranges.assign(descriptors.begin(), descriptors.begin() + dims);
+		ranges.insert(ranges.end(), descriptors.begin(), descriptors.begin() + dims);
+		for(int window = 1; window < num_windows; ++window) {
+			for(int i = 0; i < dims; ++i) {
+				ranges[i] = Min(ranges[i], descriptors[window * dims + i]);
+				ranges[dims + i] = Max(ranges[dims + i], descriptors[window * dims + i]);
+			}
+		}
+	}
+
+	const std::vector<float>& from_ranges = m_working.descriptor_ranges[from_idx];
+	const std::vector<float>& to_ranges = m_working.descriptor_ranges[to_idx];
+	float bound = 0.f;
+	for(int i = 0; i < dims; ++i) {
+		const float gap = Max(0.f, Max(to_ranges[i] - from_ranges[dims + i], from_ranges[i] - to_ranges[dims + i]));
+		bound += gap * gap;
+	}
+	return bound;
+}
+
+// Put the descriptors of every window of the clips in the pending pairs in a k-d tree, and find
+// the cells of each pair whose windows are close enough that the cell could be under the
+// threshold. A pair's threshold is never more than the settings' threshold, so its cells outside
+// of window_matches can't be transitions. Pairs without any matches don't need searching at all.
+void MotionGraphBuilder::IndexWindows(std::ostream& out)
+{
+	const int numClips = m_working.working_set.size();
+	std::set< ClipPair > pending(m_clipPairs.begin(), m_clipPairs.end());
+	std::vector<bool> used(numClips, false);
+	for(std::set< ClipPair >::const_iterator pair = pending.begin(); pair != pending.end(); ++pair)
+		used[pair->first] = used[pair->second] = true;
+
+	std::vector<int> first_window(numClips + 1, 0);
+	for(int i = 0; i < numClips; ++i) {
+		int num_windows = 0;
+		if(used[i]) {
+			if(!IsSampled(i))
+				SampleCloud(i);
+			num_windows = Max(0, int(m_working.working_set[i]->GetClipTime() * m_settings.sample_rate) - m_settings.num_samples);
+		}
+		first_window[i + 1] = first_window[i] + num_windows;
+	}
+
+	double start_time = omp_get_wtime();
+	const int dims = GetDescriptorSize();
+	const int num_windows = first_window[numClips];
+	std::vector<float> descriptors(Max(1, num_windows * dims));
+	std::vector<int> window_clips(num_windows);
+	int clip = 0;
+#pragma omp parallel for private(clip) shared(descriptors, window_clips) schedule(dynamic, 1)
+	for(clip = 0; clip < numClips; ++clip) {
+		ComputeWindowDescriptors(clip, first_window[clip + 1] - first_window[clip], &descriptors[first_window[clip] * dims]);
+		for(int window = first_window[clip]; window < first_window[clip + 1]; ++window)
+			window_clips[window] = clip;
+	}
+
+	KDTree tree;
+	tree.Build(&descriptors[0], num_windows, dims);
+
+	const float radius = sqrt(m_settings.error_threshold) * kCoarseBoundMargin;
+	std::vector< std::vector<int> > found(num_windows);
+	int window = 0;
+#pragma omp parallel for private(window) shared(tree, descriptors, found) schedule(dynamic, 64)
+	for(window = 0; window < num_windows; ++window)
+		tree.FindInRadius(&descriptors[window * dims], radius, found[window]);
+
+	// every match is found from both of its windows, so each pair only takes the matches found
+	// from its from clip. Cells are (to - from, from) so a diagonal's matches are together.
+	m_working.window_matches.clear();
+	long long num_matches = 0;
+	for(window = 0; window < num_windows; ++window) {
+		const int from_clip = window_clips[window];
+		const int from_frame = window - first_window[from_clip];
+		const int num_found = found[window].size();
+		for(int i = 0; i < num_found; ++i) {
+			const int to_clip = window_clips[ found[window][i] ];
+			if(to_clip < from_clip || !pending.count( make_pair(from_clip, to_clip) ))
+				continue;
+			const int to_frame = found[window][i] - first_window[to_clip];
+			m_working.window_matches[ make_pair(from_clip, to_clip) ].push_back( make_pair(to_frame - from_frame, from_frame) );
+			++num_matches;
+		}
+		std::vector<int>().swap(found[window]);
+	}
+
+	std::map< ClipPair, std::vector< std::pair<int,int> > >::iterator matches;
+	for(matches = m_working.window_matches.begin(); matches != m_working.window_matches.end(); ++matches)
+		std::sort(matches->second.begin(), matches->second.end());
+
+	m_stats.index_time += omp_get_wtime() - start_time;
+	out << "Window index of " << num_windows << " windows found " << num_matches << " cells to compute in "
+		<< m_working.window_matches.size() << " of " << pending.size() << " clip pairs." << endl;
+}
+
+// Compute the error function for the current pair. With max_time > 0, returns after roughly
+// that many seconds so the caller can stay responsive. max_time <= 0 runs the whole pair.
+bool MotionGraphBuilder::ProcessNextTransition(double max_time, int* out_num_processed)
+{
+	const bool limit_time = max_time > 0.0;
+
+	ASSERT(m_working.clouds && m_working.num_clouds > 0 && m_working.cloud_lengths);
+
+	int num_processed = 0;
+	double start_time = omp_get_wtime();
+
+	// always do at least one thing every time this function is called,
+	// and don't take longer than max_time. This is enforced through the time_so_far && num_processed checks.
+
+	// Allocate missing point clouds lazily to avoid resampling.
+	if(!IsSampled(m_transition_finding.from_idx))
+	{
+		SampleCloud(m_transition_finding.from_idx);
+		++num_processed;
+	}
+
+	double time_so_far = omp_get_wtime() - start_time;
+	if( (!limit_time || time_so_far < max_time || num_processed == 0) &&
+		!IsSampled(m_transition_finding.to_idx))
+	{
+		SampleCloud(m_transition_finding.to_idx);
+		++num_processed;
+	}
+
+	// Compute difference points a batch of diagonals at a time. Consecutive windows on a diagonal
+	// share frames, and diagonals are independent so they can be spread over threads.
+	// the editor keeps the whole error function, so everything is in tile 0.
+	const int num_coarse = GetNumCoarseSegments(m_transition_finding, 0);
+	const int num_steps = num_coarse + GetNumSegments(m_transition_finding, 0);
+	const int batch_size = kDiagonalsPerTask * m_settings.num_threads;
+	int step = m_transition_finding.search_step;
+	const int num_cloud_samples = num_processed;
+	bool did_work = num_processed > 0;
+	double search_start = omp_get_wtime();
+
+	time_so_far = search_start - start_time;
+	while(step < num_steps && (!limit_time || time_so_far < max_time || !did_work)) {
+		if(IsSampled(m_transition_finding.from_idx) &&
+		   IsSampled(m_transition_finding.to_idx))
+		{
+			// the whole coarse search has to be done before any cells are refined.
+			if(step < num_coarse) {
+				const int last = Min(num_coarse, step + batch_size);
+				ComputeSegments(m_transition_finding, 0, true, step, last);
+				step = last;
+			} else {
+				const int last = Min(num_steps, step + batch_size);
+				m_stats.num_cells_skipped += ComputeSegments(m_transition_finding, 0, false,
+															 step - num_coarse, last - num_coarse);
+				for(; step < last; ++step)
+					num_processed += NotifySegment(m_transition_finding, 0, step - num_coarse);
+			}
+			did_work = true;
+		} else {
+			break;
+		}
+		if(limit_time)
+			time_so_far = omp_get_wtime() - start_time;
+	}
+
+	m_stats.num_cells += num_processed - num_cloud_samples;
+	m_stats.search_time += omp_get_wtime() - search_start;
+
+	m_transition_finding.search_step = step;
+
+	if(out_num_processed) *out_num_processed = num_processed;
+	return step < num_steps;
+}
+
+// The error function is computed a tile of rows at a time, in segments of its diagonals.
+// Consecutive windows on a diagonal share frames, and segments are independent so they can be
+// spread over threads. Segment i of a tile is on the diagonal with (to - from) equal to
+// i - (last row of the tile).
+void MotionGraphBuilder::GetTileRows(const TransitionFindingData& finding, int tile, int& first, int& last) const
+{
+	first = tile * finding.tile_rows;
+	last = Min(finding.from_max, first + finding.tile_rows);
+}
+
+int MotionGraphBuilder::GetNumSegments(const TransitionFindingData& finding, int tile) const
+{
+	int first_row, last_row;
+	GetTileRows(finding, tile, first_row, last_row);
+	return finding.to_max - first_row + last_row - 1;
+}
+
+// Coarse segments are on the diagonals with (to - from) a multiple of coarse_factor.
+int MotionGraphBuilder::GetNumCoarseSegments(const TransitionFindingData& finding, int tile) const
+{
+	if(!IsCoarse()) return 0;
+	const int factor = m_settings.coarse_factor;
+	int first_row, last_row;
+	GetTileRows(finding, tile, first_row, last_row);
+	const int first_offset = -((last_row - 1) / factor) * factor;
+	const int last_offset = finding.to_max - first_row - 1;
+	if(last_offset < first_offset) return 0;
+	return (last_offset - first_offset) / factor + 1;
+}
+
+// Returns the number of cells skipped.
+long long MotionGraphBuilder::ComputeSegments(TransitionFindingData& finding, int tile, bool coarse,
+											  int first, int last) const
+{
+	int idx = 0;
+	long long num_skipped = 0;
+#pragma omp parallel for private(idx) shared(finding) reduction(+:num_skipped) schedule(dynamic, kDiagonalsPerTask)
+	for(idx = first; idx < last; ++idx) {
+		if(coarse)
+			ComputeCoarseSegment(finding, tile, idx);
+		else
+			num_skipped += ComputeSegment(finding, tile, idx);
+	}
+	return num_skipped;
+}
+
+void MotionGraphBuilder::ComputeCoarseSegment(TransitionFindingData& finding, int tile, int idx) const
+{
+	const int factor = m_settings.coarse_factor;
+	int first_row, last_row;
+	GetTileRows(finding, tile, first_row, last_row);
+
+	const int offset = -((last_row - 1) / factor) * factor + idx * factor;
+	const int from = Max(first_row, -offset);
+	const int to = from + offset;
+	const int count = Min(last_row - from, finding.to_max - to);
+
+	computeErrorFunctionDiagonal(m_working.coarse_clouds[finding.from_idx], m_working.cloud_lengths[finding.from_idx],
+								 m_working.coarse_clouds[finding.to_idx], m_working.cloud_lengths[finding.to_idx],
+								 m_working.coarse_samples_per_frame,
+								 m_settings.num_samples,
+								 m_working.coarse_weights,
+								 m_settings.weight_falloff,
+								 m_working.coarse_inv_sum_weights,
+								 from, to, count,
+								 &finding.coarse_values[finding.CellIndex(from, to)], 0, 0,
+								 finding.to_max + 1);
+}
+
+// Lower bound on the distance (square root of the error) for a cell, from the nearest coarse
+// diagonals on either side. The coarse cloud is a subset of the points, so its distance is a
+// lower bound on the full distance, and by the triangle inequality
+//   dist(A_from, B_to) >= dist(A_anchor, B_to) - dist(A_from, A_anchor)
+// where A_anchor is the from window that puts the cell on a coarse diagonal. Likewise for the to
+// clip. This relies on the alignment being the exact minimum, so windows must not be shortened.
+float MotionGraphBuilder::CoarseBound(const TransitionFindingData& finding, int from, int to) const
+{
+	const int factor = m_settings.coarse_factor;
+	const int num_from = finding.from_max;
+	const int num_to = finding.to_max;
+	const int offset = to - from;
+	const int rem = ((offset % factor) + factor) % factor;
+	if(rem == 0)
+		return sqrt(finding.coarse_values[finding.CellIndex(from, to)]);
+
+	const float* from_distances = m_working.self_distances[finding.from_idx];
+	const float* to_distances = m_working.self_distances[finding.to_idx];
+	const int stride = factor - 1;
+
+	float bound = 0.f;
+	const int shifts[2] = { rem, rem - factor };
+	for(int i = 0; i < 2; ++i) {
+		const int shift = shifts[i];
+		const int d = Abs(shift);
+
+		// same to frame, shifted from frame
+		int anchor = from + shift;
+		if(anchor >= 0 && anchor < num_from) {
+			float b = sqrt(finding.coarse_values[finding.CellIndex(anchor, to)]) -
+				from_distances[Min(from, anchor) * stride + d - 1];
+			bound = Max(bound, b);
+		}
+
+		// same from frame, shifted to frame
+		anchor = to - shift;
+		if(anchor >= 0 && anchor < num_to) {
+			float b = sqrt(finding.coarse_values[finding.CellIndex(from, anchor)]) -
+				to_distances[Min(to, anchor) * stride + d - 1];
+			bound = Max(bound, b);
+		}
+	}
+	return bound;
+}
+
+// Compute a segment of the error function. In coarse mode, cells that are bounded above the
+// error threshold get the bound instead, which is enough for findErrorFunctionMinima and
+// ExtractTransitionCandidates to give the same results. With window matches, cells the window
+// index didn't find get kUncomputedError, and with the early exit cells that are bounded by a
+// frame pair in their window get that bound, for the same reason. Returns the number of cells skipped.
+int MotionGraphBuilder::ComputeSegment(TransitionFindingData& finding, int tile, int idx) const
+{
+	int first_row, last_row;
+	GetTileRows(finding, tile, first_row, last_row);
+
+	const int num_to = finding.to_max;
+	const int offset = idx - (last_row - 1);
+	const int from = Max(first_row, -offset);
+	const int to = from + offset;
+	const int count = Min(last_row - from, num_to - to);
+
+	const float cutoff = m_settings.early_exit ?
+		finding.current_error_threshold * kCoarseBoundMargin * kCoarseBoundMargin : -1.f;
+
+	// don't go past the end of what we've allocated - windows are shortened near the ends.
+	ASSERT(from + count <= m_working.cloud_lengths[finding.from_idx] &&
+		   to + count <= m_working.cloud_lengths[finding.to_idx]);
+
+	// runs of cells to compute. Gaps shorter than a window are cheaper to compute than to restart
+	// the sliding window after.
+	std::vector< std::pair<int,int> > runs;
+	std::vector<float> bounds;
+	if(IsCoarse())
+	{
+		const float max_bound = sqrt(finding.current_error_threshold) * kCoarseBoundMargin;
+		bounds.resize(count);
+		int run_start = -1, run_end = -1;
+		for(int i = 0; i < count; ++i) {
+			bounds[i] = CoarseBound(finding, from + i, to + i);
+			if(bounds[i] <= max_bound) {
+				if(run_start >= 0 && i - run_end > m_settings.num_samples) {
+					runs.push_back(std::make_pair(run_start, run_end + 1));
+					run_start = -1;
+				}
+				if(run_start < 0) run_start = i;
+				run_end = i;
+			}
+		}
+		if(run_start >= 0)
+			runs.push_back(std::make_pair(run_start, run_end + 1));
+	}
+	else if(finding.use_window_matches)
+		FindWindowMatchRuns(finding, from, to, count, runs);
+	else
+		runs.push_back(std::make_pair(0, count));
+
+	// everything outside of the runs can't be under the threshold.
+	int num_skipped = 0;
+	int next_run = 0;
+	for(int i = 0; i < count; ++i) {
+		if(next_run < (int)runs.size() && i >= runs[next_run].first) {
+			i = runs[next_run++].second - 1;
+			continue;
+		}
+		const int cell = finding.CellIndex(from + i, to + i);
+		finding.error_function_values[cell] = bounds.empty() ? kUncomputedError : bounds[i] * bounds[i];
+		finding.alignment_translations[cell].set(0,0,0);
+		finding.alignment_angles[cell] = 0.f;
+		++num_skipped;
+	}
+
+	const int num_runs = runs.size();
+	for(int i = 0; i < num_runs; ++i) {
+		const int first = runs[i].first;
+		const int num_cells = runs[i].second - first;
+		if(m_working.packed_clouds)
+			num_skipped += ComputeDiagonal(*m_working.packed_clouds[finding.from_idx], *m_working.packed_clouds[finding.to_idx],
+										   finding, from + first, to + first, num_cells, cutoff);
+		else if(m_working.soa_clouds)
+			num_skipped += ComputeDiagonal(*m_working.soa_clouds[finding.from_idx], *m_working.soa_clouds[finding.to_idx],
+										   finding, from + first, to + first, num_cells, cutoff);
+		else
+			num_skipped += ComputeDiagonal(m_working.clouds[finding.from_idx], m_working.clouds[finding.to_idx],
+										   finding, from + first, to + first, num_cells, cutoff);
+	}
+	return num_skipped;
+}
+
+// The cells of one run of a segment, whichever way the clouds are stored.
+template< class Cloud >
+int MotionGraphBuilder::ComputeDiagonal(const Cloud& from_cloud, const Cloud& to_cloud, TransitionFindingData& finding,
+										int from, int to, int num_cells, float cutoff) const
+{
+	const int cell = finding.CellIndex(from, to);
+	return computeBoundedErrorFunctionDiagonal(from_cloud, m_working.cloud_lengths[finding.from_idx],
+											   to_cloud, m_working.cloud_lengths[finding.to_idx],
+											   m_working.sampler->GetSamplesPerFrame(),
+											   m_settings.num_samples,
+											   m_working.joint_weights,
+											   m_settings.weight_falloff,
+											   m_working.inv_sum_weights,
+											   from, to, num_cells,
+											   &finding.error_function_values[cell],
+											   &finding.alignment_translations[cell],
+											   &finding.alignment_angles[cell],
+											   finding.to_max + 1,
+											   &m_working.sample_order[0], cutoff);
+}
+
+// Runs of cells on a segment that the window index found. Like the coarse runs, gaps shorter
+// than a window are computed rather than restarting the sliding window after them.
+void MotionGraphBuilder::FindWindowMatchRuns(const TransitionFindingData& finding, int from, int to, int count,
+											 std::vector< std::pair<int,int> >& runs) const
+{
+	const int offset = to - from;
+	std::vector< std::pair<int,int> >::const_iterator match =
+		std::lower_bound(finding.window_matches.begin(), finding.window_matches.end(), std::make_pair(offset, from));
+	int run_start = -1, run_end = -1;
+	for(; match != finding.window_matches.end() && match->first == offset && match->second < from + count; ++match) {
+		const int i = match->second - from;
+		if(run_start >= 0 && i - run_end > m_settings.num_samples) {
+			runs.push_back(std::make_pair(run_start, run_end + 1));
+			run_start = -1;
+		}
+		if(run_start < 0) run_start = i;
+		run_end = i;
+	}
+	if(run_start >= 0)
+		runs.push_back(std::make_pair(run_start, run_end + 1));
+}
+
+// Tell the listener about matches on a computed segment. Returns the number of cells on it.
+int MotionGraphBuilder::NotifySegment(const TransitionFindingData& finding, int tile, int idx) const
+{
+	int first_row, last_row;
+	GetTileRows(finding, tile, first_row, last_row);
+
+	const int num_to = finding.to_max;
+	const int offset = idx - (last_row - 1);
+	const int from = Max(first_row, -offset);
+	const int to = from + offset;
+	const int count = Min(last_row - from, num_to - to);
+
+	if(m_listener) {
+		const int samplesPerFrame = m_working.sampler->GetSamplesPerFrame();
+		const int from_cloud_len = m_working.cloud_lengths[finding.from_idx];
+		const int to_cloud_len =  m_working.cloud_lengths[finding.to_idx];
+		for(int i = 0; i < count; ++i) {
+			const int cell = finding.CellIndex(from + i, to + i);
+			if(finding.error_function_values[cell] < finding.current_error_threshold) {
+				int len = Min(m_settings.num_samples, Min(from_cloud_len - from - i, to_cloud_len - to - i));
+				m_listener->OnCloudMatch((from + i) * samplesPerFrame, (to + i) * samplesPerFrame, len,
+										 finding.alignment_translations[cell],
+										 finding.alignment_angles[cell]);
+			}
+		}
+	}
+	return count;
+}
+
+void MotionGraphBuilder::FinishPair()
+{
+	double start_time = omp_get_wtime();
+
+	// Compute minima
+	findErrorFunctionMinima( m_transition_finding.error_function_values,
+							 m_transition_finding.to_max,
+							 m_transition_finding.from_max,
+							 m_transition_finding.minima_indices );
+
+	ExtractTransitionCandidates(m_transition_finding, m_transition_finding.minima_indices);
+	if(m_transition_finding.stored_id)
+		SaveErrorFunctionTile(m_transition_finding, 0);
+
+	FinishedPair(m_transition_finding.from_idx, m_transition_finding.to_idx);
+	CheckpointIfDue();
+
+	m_stats.search_time += omp_get_wtime() - start_time;
+}
+
+// Find the minima on the rows of a tile and extract their candidates. The tiles on either
+// side must still be in memory.
+void MotionGraphBuilder::FinishTile(const TransitionFindingData& finding, int tile)
+{
+	int first_row, last_row;
+	GetTileRows(finding, tile, first_row, last_row);
+
+	const int first_window_row = Max(0, first_row - kMinimaWindowSize);
+	const int last_window_row = Min(finding.from_max, last_row + kMinimaWindowSize);
+	std::vector<const float*> rows(finding.from_max, (const float*)0);
+	for(int row = first_window_row; row < last_window_row; ++row)
+		rows[row] = &finding.error_function_values[finding.CellIndex(row, 0)];
+
+	std::vector<int> minima;
+	findErrorFunctionMinimaInRows(&rows[0], finding.to_max, finding.from_max, first_row, last_row, minima);
+	ExtractTransitionCandidates(finding, minima);
+
+	if(finding.stored_id)
+		SaveErrorFunctionTile(finding, tile);
+}
+
+// Error functions are saved a tile at a time into blobs sized for the whole function, so
+// streaming doesn't need the whole function in memory to save it. Without values, the row only
+// records that no value of the pair is under its threshold, for pairs that weren't searched.
+void MotionGraphBuilder::CreateStoredErrorFunction(TransitionFindingData& finding, bool with_values)
+{
+	const std::vector<char>& signature = m_working.search_signature;
+	const int num_values = finding.from_max * finding.to_max;
+
+	Query insert(m_db, "INSERT OR REPLACE INTO error_functions (motion_graph_id, from_clip_id, to_clip_id, settings, "
+				 "from_max, to_max, bound_threshold, error_values, translations, angles) "
+				 "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+	insert.BindInt64(1, m_graph->GetID())
+		.BindInt64(2, finding.fromClip->GetID())
+		.BindInt64(3, finding.toClip->GetID())
+		.BindBlob(4, &signature[0], signature.size())
+		.BindInt(5, finding.from_max)
+		.BindInt(6, finding.to_max);
+	if(!with_values) {
+		insert.BindDouble(7, finding.current_error_threshold);
+		insert.Step();
+		finding.stored_id = 0;
+		return;
+	}
+	if(finding.bound_threshold >= 0.f)
+		insert.BindDouble(7, finding.bound_threshold);
+	insert.BindBlob(8, sizeof(float) * num_values)
+		.BindBlob(9, sizeof(Vec3) * num_values)
+		.BindBlob(10, sizeof(float) * num_values);
+	insert.Step();
+	finding.stored_id = insert.IsError() ? 0 : insert.LastRowID();
+}
+
+void MotionGraphBuilder::SaveErrorFunctionTile(const TransitionFindingData& finding, int tile)
+{
+	int first_row, last_row;
+	GetTileRows(finding, tile, first_row, last_row);
+	const int cell = finding.CellIndex(first_row, 0);
+	const int offset = first_row * finding.to_max;
+	const int count = (last_row - first_row) * finding.to_max;
+
+	Blob values(m_db, "error_functions", "error_values", finding.stored_id, true);
+	values.Write(&finding.error_function_values[cell], sizeof(float) * count, sizeof(float) * offset);
+	Blob translations(m_db, "error_functions", "translations", finding.stored_id, true);
+	translations.Write(&finding.alignment_translations[cell], sizeof(Vec3) * count, sizeof(Vec3) * offset);
+	Blob angles(m_db, "error_functions", "angles", finding.stored_id, true);
+	angles.Write(&finding.alignment_angles[cell], sizeof(float) * count, sizeof(float) * offset);
+}
+
+bool MotionGraphBuilder::LoadErrorFunctionTile(TransitionFindingData& finding, sqlite3_int64 stored_id, int tile)
+{
+	int first_row, last_row;
+	GetTileRows(finding, tile, first_row, last_row);
+	const int cell = finding.CellIndex(first_row, 0);
+	const int offset = first_row * finding.to_max;
+	const int count = (last_row - first_row) * finding.to_max;
+
+	Blob values(m_db, "error_functions", "error_values", stored_id, false);
+	Blob translations(m_db, "error_functions", "translations", stored_id, false);
+	Blob angles(m_db, "error_functions", "angles", stored_id, false);
+	return values.Read(&finding.error_function_values[cell], sizeof(float) * count, sizeof(float) * offset) &&
+		translations.Read(&finding.alignment_translations[cell], sizeof(Vec3) * count, sizeof(Vec3) * offset) &&
+		angles.Read(&finding.alignment_angles[cell], sizeof(float) * count, sizeof(float) * offset);
+}
+
+// Window i of A against window j of B has the same error as window j of B against window i
+// of A, with the inverse alignment. So the error function for B to A is the transpose, and so
+// are its minima since findErrorFunctionMinima uses the same window in both directions. Each
+// minimum gives a candidate in both directions.
+void MotionGraphBuilder::ExtractTransitionCandidates(const TransitionFindingData& finding,
+													 const std::vector<int>& minima)
+{
+	bool self_processing = finding.to_idx == finding.from_idx;
+	const int num_minima = minima.size();
+	const float minDist = m_settings.num_samples;
+
+	for(int reverse = 0; reverse < (self_processing ? 1 : 2); ++reverse)
+	{
+		for(int i = 0; i <num_minima; ++i)
+		{
+			int index = minima[i];
+			int from_frame = index / finding.to_max;
+			int to_frame = index % finding.to_max;
+			int cell = finding.CellIndex(from_frame, to_frame);
+
+			float threshold = finding.current_error_threshold;
+			if(finding.error_function_values[cell] < threshold)
+			{
+				// if processing self, ignore any minima within num_samples from the center line (our transition length in frames).
+
+	            static const float kInvRootTwo = 1.f/sqrt(2.f);
+				float dist = fabs( kInvRootTwo * (to_frame - from_frame) ); // corresponds to perpendicular distance to center line through error map
+
+				if(!self_processing || dist > minDist)
+				{
+					int from_idx = finding.from_idx;
+					int to_idx = finding.to_idx;
+					Vec3 align_translation = finding.alignment_translations[cell];
+					float align_rotation = finding.alignment_angles[cell];
+					if(reverse) {
+						std::swap(from_idx, to_idx);
+						std::swap(from_frame, to_frame);
+
+						// to = R(-angle) * (from - translation)
+						const float c = cos(align_rotation), s = sin(align_rotation);
+						const Vec3 t = align_translation;
+						align_translation.set( -(c * t.x - s * t.z), 0.f, -(s * t.x + c * t.z) );
+						align_rotation = -align_rotation;
+					}
+
+					AddTransitionCandidate(from_idx, from_frame, to_idx, to_frame, finding.error_function_values[cell],
+										   align_translation, align_rotation);
+				}
+			}
+		}
+	}
+}
+
+// A checkpoint is the settings and new clips of a search, the pairs it has finished and the
+// candidates they found. Candidates and pairs are saved together, so a resumed search never
+// repeats a pair whose candidates it already has.
+void MotionGraphBuilder::GetCheckpointSignature(std::vector<char>& out) const
+{
+	out = m_working.search_signature;
+	const float threshold = m_settings.error_threshold;
+	out.insert(out.end(), (const char*)&threshold, (const char*)(&threshold + 1));
+}
+
+void MotionGraphBuilder::BeginCheckpoints()
+{
+	ClearCheckpoint();
+
+	std::vector<char> signature;
+	GetCheckpointSignature(signature);
+	std::vector<sqlite3_int64> newClipIds;
+	const int numClips = m_working.working_set.size();
+	for(int i = 0; i < numClips; ++i)
+		if(m_working.new_clips[i])
+			newClipIds.push_back(m_working.working_set[i]->GetID());
+
+	Query insert(m_db, "INSERT INTO build_checkpoints (motion_graph_id, settings, new_clips) VALUES (?, ?, ?)");
+	insert.BindInt64(1, m_graph->GetID())
+		.BindBlob(2, &signature[0], signature.size());
+	if(!newClipIds.empty())
+		insert.BindBlob(3, &newClipIds[0], sizeof(sqlite3_int64) * newClipIds.size());
+	insert.Step();
+
+	m_working.finished_pairs.clear();
+	m_working.num_checkpoint_candidates = 0;
+}
+
+void MotionGraphBuilder::LoadCheckpoint(std::ostream& out)
+{
+	std::map<sqlite3_int64, int> clipIndices;
+	const int numClips = m_working.working_set.size();
+	for(int i = 0; i < numClips; ++i)
+		clipIndices[ m_working.working_set[i]->GetID() ] = i;
+
+	std::set< ClipPair > finished;
+	Query get_pairs(m_db, "SELECT from_clip_id, to_clip_id FROM build_pairs WHERE motion_graph_id = ?");
+	get_pairs.BindInt64(1, m_graph->GetID());
+	while(get_pairs.Step()) {
+		std::map<sqlite3_int64, int>::const_iterator from = clipIndices.find(get_pairs.ColInt64(0));
+		std::map<sqlite3_int64, int>::const_iterator to = clipIndices.find(get_pairs.ColInt64(1));
+		if(from != clipIndices.end() && to != clipIndices.end())
+			finished.insert( make_pair(from->second, to->second) );
+	}
+
+	std::list< ClipPair >::iterator pair = m_clipPairs.begin();
+	while(pair != m_clipPairs.end()) {
+		if(finished.count(*pair))
+			pair = m_clipPairs.erase(pair);
+		else
+			++pair;
+	}
+
+	Query get_candidates(m_db, "SELECT from_clip_id, from_frame, to_clip_id, to_frame, align_translation, align_rotation, "
+						 "error FROM build_candidates WHERE motion_graph_id = ? ORDER BY id");
+	get_candidates.BindInt64(1, m_graph->GetID());
+	while(get_candidates.Step()) {
+		std::map<sqlite3_int64, int>::const_iterator from = clipIndices.find(get_candidates.ColInt64(0));
+		std::map<sqlite3_int64, int>::const_iterator to = clipIndices.find(get_candidates.ColInt64(2));
+		if(from != clipIndices.end() && to != clipIndices.end())
+			AddTransitionCandidate(from->second, get_candidates.ColInt(1), to->second, get_candidates.ColInt(3),
+								   get_candidates.ColDouble(6), get_candidates.ColVec3FromBlob(4), get_candidates.ColDouble(5));
+	}
+
+	m_working.finished_pairs.clear();
+	m_working.num_checkpoint_candidates = m_working.transition_candidates.size();
+	out << "Resumed with " << finished.size() << " clip pairs already searched and "
+		<< m_working.transition_candidates.size() << " transition candidates." << endl;
+}
+
+void MotionGraphBuilder::FinishedPair(int from_idx, int to_idx)
+{
+	if(m_settings.checkpoint_interval > 0.f)
+		m_working.finished_pairs.push_back( make_pair(from_idx, to_idx) );
+}
+
+// Save the checkpoint if it's been long enough, or if there's nothing left to search.
+void MotionGraphBuilder::CheckpointIfDue()
+{
+	if(m_settings.checkpoint_interval <= 0.f || m_working.finished_pairs.empty())
+		return;
+	if(HasPendingPairs() && omp_get_wtime() - m_working.last_checkpoint_time < m_settings.checkpoint_interval)
+		return;
+	SaveCheckpoint();
+}
+
+void MotionGraphBuilder::SaveCheckpoint()
+{
+	const sqlite3_int64 graph_id = m_graph->GetID();
+	Transaction t(m_db);
+
+	Query insert_pair(m_db, "INSERT OR IGNORE INTO build_pairs (motion_graph_id, from_clip_id, to_clip_id) VALUES (?, ?, ?)");
+	const int num_pairs = m_working.finished_pairs.size();
+	for(int i = 0; i < num_pairs; ++i) {
+		insert_pair.Reset();
+		insert_pair.BindInt64(1, graph_id)
+			.BindInt64(2, m_working.working_set[ m_working.finished_pairs[i].first ]->GetID())
+			.BindInt64(3, m_working.working_set[ m_working.finished_pairs[i].second ]->GetID());
+		insert_pair.Step();
+	}
+
+	Query insert_candidate(m_db, "INSERT INTO build_candidates (motion_graph_id, from_clip_id, from_frame, "
+						   "to_clip_id, to_frame, align_translation, align_rotation, error) VALUES (?, ?, ?, ?, ?, ?, ?, ?)");
+	std::list< TransitionCandidate >::const_iterator candidate = m_working.transition_candidates.begin();
+	std::advance(candidate, m_working.num_checkpoint_candidates);
+	for(; candidate != m_working.transition_candidates.end(); ++candidate) {
+		insert_candidate.Reset();
+		insert_candidate.BindInt64(1, graph_id)
+			.BindInt64(2, candidate->from_clip->GetID())
+			.BindInt(3, candidate->from_frame)
+			.BindInt64(4, candidate->to_clip->GetID())
+			.BindInt(5, candidate->to_frame)
+			.BindBlob(6, &candidate->align_translation, sizeof(candidate->align_translation))
+			.BindDouble(7, candidate->align_rotation)
+			.BindDouble(8, candidate->error);
+		insert_candidate.Step();
+	}
+
+	m_working.finished_pairs.clear();
+	m_working.num_checkpoint_candidates = m_working.transition_candidates.size();
+	m_working.last_checkpoint_time = omp_get_wtime();
+}
+
+void MotionGraphBuilder::ClearCheckpoint()
+{
+	static const char* deletes[] = {
+		"DELETE FROM build_checkpoints WHERE motion_graph_id = ?",
+		"DELETE FROM build_pairs WHERE motion_graph_id = ?",
+		"DELETE FROM build_candidates WHERE motion_graph_id = ?",
+	};
+	Transaction t(m_db);
+	for(int i = 0; i < 3; ++i) {
+		Query del(m_db, deletes[i]);
+		del.BindInt64(1, m_graph->GetID());
+		del.Step();
+	}
+	m_working.finished_pairs.clear();
+	m_working.num_checkpoint_candidates = 0;
+}
+
+static bool SameBlobs(Query& a, Query& b, int blob_col, int length_col)
+{
+	const int length = a.ColInt(length_col);
+	return length == b.ColInt(length_col) &&
+		(length == 0 || memcmp(a.ColBlob(blob_col), b.ColBlob(blob_col), length) == 0);
+}
+
+// The copy's pairs that aren't in the checkpoint yet are added with their candidates, so merging
+// the same copy twice, or copies that overlap, never duplicates a candidate. The copy is read with
+// its own connection rather than attached, so statements left open on m_db can't keep it locked.
+bool MotionGraphBuilder::MergeCheckpoint(const MotionGraph* graph, const char* filename, std::ostream& out)
+{
+	sqlite3* shard = 0;
+	if(sqlite3_open_v2(filename, &shard, SQLITE_OPEN_READONLY, 0) != SQLITE_OK) {
+		out << "Could not open " << filename << "." << endl;
+		sqlite3_close(shard);
+		return false;
+	}
+
+	bool merged = MergeCheckpoint(graph, shard, filename, out);
+	sqlite3_close(shard);
+	return merged;
+}
+
+bool MotionGraphBuilder::MergeCheckpoint(const MotionGraph* graph, sqlite3* shard, const char* filename,
+										 std::ostream& out)
+{
+	const sqlite3_int64 graph_id = graph->GetID();
+	Query get_checkpoint(m_db, "SELECT settings, length(settings), new_clips, length(new_clips) "
+						 "FROM build_checkpoints WHERE motion_graph_id = ?");
+	get_checkpoint.BindInt64(1, graph_id);
+	Query get_shard_checkpoint(shard, "SELECT settings, length(settings), new_clips, length(new_clips) "
+							   "FROM build_checkpoints WHERE motion_graph_id = ?");
+	get_shard_checkpoint.BindInt64(1, graph_id);
+	if(!get_checkpoint.Step() || !get_shard_checkpoint.Step() ||
+	   !SameBlobs(get_checkpoint, get_shard_checkpoint, 0, 1) ||
+	   !SameBlobs(get_checkpoint, get_shard_checkpoint, 2, 3)) {
+		out << filename << " doesn't have the same search of graph \"" << graph->GetName() << "\"." << endl;
+		return false;
+	}
+
+	typedef std::pair<sqlite3_int64, sqlite3_int64> ClipIDPair;
+	std::set< ClipIDPair > finished;
+	Query get_pairs(m_db, "SELECT from_clip_id, to_clip_id FROM build_pairs WHERE motion_graph_id = ?");
+	get_pairs.BindInt64(1, graph_id);
+	while(get_pairs.Step())
+		finished.insert( make_pair(get_pairs.ColInt64(0), get_pairs.ColInt64(1)) );
+
+	std::set< ClipIDPair > merging;
+	Query get_shard_pairs(shard, "SELECT from_clip_id, to_clip_id FROM build_pairs WHERE motion_graph_id = ?");
+	get_shard_pairs.BindInt64(1, graph_id);
+	while(get_shard_pairs.Step()) {
+		ClipIDPair pair = make_pair(get_shard_pairs.ColInt64(0), get_shard_pairs.ColInt64(1));
+		if(!finished.count(pair))
+			merging.insert(pair);
+	}
+
+	Transaction t(m_db);
+	int num_candidates = 0;
+	Query get_candidates(shard, "SELECT from_clip_id, from_frame, to_clip_id, to_frame, align_translation, "
+						 "length(align_translation), align_rotation, error FROM build_candidates WHERE motion_graph_id = ? ORDER BY id");
+	get_candidates.BindInt64(1, graph_id);
+	Query insert_candidate(m_db, "INSERT INTO build_candidates (motion_graph_id, from_clip_id, from_frame, "
+						   "to_clip_id, to_frame, align_translation, align_rotation, error) VALUES (?, ?, ?, ?, ?, ?, ?, ?)");
+	while(get_candidates.Step()) {
+		// a pair's candidates go either way between its clips
+		const sqlite3_int64 from_id = get_candidates.ColInt64(0);
+		const sqlite3_int64 to_id = get_candidates.ColInt64(2);
+		if(!merging.count( make_pair(from_id, to_id) ) && !merging.count( make_pair(to_id, from_id) ))
+			continue;
+		insert_candidate.Reset();
+		insert_candidate.BindInt64(1, graph_id)
+			.BindInt64(2, from_id)
+			.BindInt(3, get_candidates.ColInt(1))
+			.BindInt64(4, to_id)
+			.BindInt(5, get_candidates.ColInt(3))
+			.BindBlob(6, get_candidates.ColBlob(4), get_candidates.ColInt(5))
+			.BindDouble(7, get_candidates.ColDouble(6))
+			.BindDouble(8, get_candidates.ColDouble(7));
+		insert_candidate.Step();
+		++num_candidates;
+	}
+
+	Query insert_pair(m_db, "INSERT INTO build_pairs (motion_graph_id, from_clip_id, to_clip_id) VALUES (?, ?, ?)");
+	for(std::set< ClipIDPair >::const_iterator pair = merging.begin(); pair != merging.end(); ++pair) {
+		insert_pair.Reset();
+		insert_pair.BindInt64(1, graph_id)
+			.BindInt64(2, pair->first)
+			.BindInt64(3, pair->second);
+		insert_pair.Step();
+	}
+
+	out << "Merged " << merging.size() << " clip pairs and " << num_candidates
+		<< " transition candidates from " << filename << "." << endl;
+	return true;
+}
+
+void MotionGraphBuilder::AddTransitionCandidate(int from_idx, int from_frame, int to_idx, int to_frame, float error,
+												Vec3_arg align_translation, float align_rotation)
+{
+	ClipHandle from_clip = m_working.working_set[ from_idx ];
+	ClipHandle to_clip = m_working.working_set[ to_idx];
+
+	TransitionCandidate c;
+	c.from_clip = from_clip;
+	c.from_frame = from_frame ;
+	c.from_time = (from_frame) * m_settings.sample_interval;
+	c.from_insert_point = GetInsertPoint(from_clip.RawPtr(), from_frame, false);
+
+	c.to_clip = to_clip;
+	c.to_frame = to_frame ;
+	c.to_time = (to_frame) * m_settings.sample_interval;
+	c.to_insert_point = GetInsertPoint(to_clip.RawPtr(), to_frame, true);
+
+	c.align_translation = align_translation;
+	c.align_rotation = align_rotation;
+	c.error = error;
+	m_working.transition_candidates.push_back(c);
+	++m_stats.num_candidates;
+
+	// Queue edge splits for the given clips at the transition
+	// frames. Splits happen in order because it's easy to keep
+	// track of new edge ids (and which edges to split,
+	// subsequently)
+	m_working.split_list[ from_idx ].push_back(c.from_insert_point);
+	m_working.split_list[ to_idx].push_back(c.to_insert_point);
+}
+
+// Clip frame where a transition starting (or with end set, finishing) in the window at sample frame
+// frame splits the clip. A transition sends us to to_clip @ to_time + sample_interval * (num_samples-1),
+// since we FINISH the transition on that frame.
+int MotionGraphBuilder::GetInsertPoint(const Clip* clip, int frame, bool end) const
+{
+	const float time = frame * m_settings.sample_interval;
+	if(end)
+		return int( (time + m_settings.sample_interval * (m_settings.num_samples-1)) * clip->GetClipFPS() );
+	return int(time * clip->GetClipFPS());
+}
+
+// The window of a clip whose transitions split it at insert_point, or -1 if there is none.
+int MotionGraphBuilder::FindWindow(int clip_idx, int insert_point, bool end) const
+{
+	const Clip* clip = m_working.working_set[clip_idx].RawPtr();
+	const int num_windows = Max(0, int(clip->GetClipTime() * m_settings.sample_rate) - m_settings.num_samples);
+	const float frames_per_window = m_settings.sample_interval * clip->GetClipFPS();
+	int frame = Max(0, int(insert_point / frames_per_window) - (end ? m_settings.num_samples - 1 : 0) - 2);
+	while(frame < num_windows && GetInsertPoint(clip, frame, end) < insert_point)
+		++frame;
+	return (frame < num_windows && GetInsertPoint(clip, frame, end) == insert_point) ? frame : -1;
+}
+
+// Error and alignment of one window of a clip against one of another, the same way the search computes them.
+float MotionGraphBuilder::ComputeWindowError(int from_idx, int from_frame, int to_idx, int to_frame,
+											 Vec3& align_translation, float& align_rotation) const
+{
+	float error = 0.f;
+	if(m_working.packed_clouds)
+		computeBoundedErrorFunctionDiagonal(*m_working.packed_clouds[from_idx], m_working.cloud_lengths[from_idx],
+											*m_working.packed_clouds[to_idx], m_working.cloud_lengths[to_idx],
+											m_working.sampler->GetSamplesPerFrame(), m_settings.num_samples,
+											m_working.joint_weights, m_settings.weight_falloff, m_working.inv_sum_weights,
+											from_frame, to_frame, 1, &error, &align_translation, &align_rotation, 1,
+											&m_working.sample_order[0], -1.f);
+	else if(m_working.soa_clouds)
+		computeBoundedErrorFunctionDiagonal(*m_working.soa_clouds[from_idx], m_working.cloud_lengths[from_idx],
+											*m_working.soa_clouds[to_idx], m_working.cloud_lengths[to_idx],
+											m_working.sampler->GetSamplesPerFrame(), m_settings.num_samples,
+											m_working.joint_weights, m_settings.weight_falloff, m_working.inv_sum_weights,
+											from_frame, to_frame, 1, &error, &align_translation, &align_rotation, 1,
+											&m_working.sample_order[0], -1.f);
+	else
+		computeBoundedErrorFunctionDiagonal(m_working.clouds[from_idx], m_working.cloud_lengths[from_idx],
+											m_working.clouds[to_idx], m_working.cloud_lengths[to_idx],
+											m_working.sampler->GetSamplesPerFrame(), m_settings.num_samples,
+											m_working.joint_weights, m_settings.weight_falloff, m_working.inv_sum_weights,
+											from_frame, to_frame, 1, &error, &align_translation, &align_rotation, 1,
+											&m_working.sample_order[0], -1.f);
+	return error;
+}
+
+namespace {
+	struct LowerError {
+		const std::vector<const MotionGraphBuilder::TransitionCandidate*>* candidates;
+		bool operator()(int a, int b) const { return (*candidates)[a]->error < (*candidates)[b]->error; }
+	};
+}
+
+// Minima of the error function are often only a few frames apart, and each one splits its clips.
+// First a greedy non-maximum suppression: going from the lowest error up, a candidate is dropped if
+// one already kept goes between the same clips and both its ends are within split_separation
+// frames. Then the split points left on each clip are grouped, starting a group at the first point
+// more than split_separation past the start of the last one, and each group is moved to its
+// median point so its candidates share a node. A moved candidate is aligned again for the windows at
+// its new points, and keeps its own points if those windows aren't under its threshold.
+void MotionGraphBuilder::ClusterCandidates()
+{
+	const int separation = m_settings.split_separation;
+	std::list< TransitionCandidate >& candidates = m_working.transition_candidates;
+	const int numClips = m_working.working_set.size();
+	std::map<sqlite3_int64, int> clipIndices;
+	for(int i = 0; i < numClips; ++i)
+		clipIndices[ m_working.working_set[i]->GetID() ] = i;
+
+	std::vector<const TransitionCandidate*> sorted;
+	for(std::list< TransitionCandidate >::const_iterator c = candidates.begin(); c != candidates.end(); ++c)
+		sorted.push_back(&*c);
+	std::vector<int> order(sorted.size());
+	for(int i = 0; i < (int)order.size(); ++i)
+		order[i] = i;
+	LowerError lower = { &sorted };
+	std::stable_sort(order.begin(), order.end(), lower);
+
+	std::map< std::pair<int,int>, std::vector<int> > kept_by_pair;
+	std::vector<bool> suppressed(sorted.size(), false);
+	for(int i = 0; i < (int)order.size(); ++i) {
+		const TransitionCandidate* c = sorted[ order[i] ];
+		std::vector<int>& kept = kept_by_pair[ std::make_pair(clipIndices[c->from_clip->GetID()], clipIndices[c->to_clip->GetID()]) ];
+		for(int k = 0; k < (int)kept.size() && !suppressed[ order[i] ]; ++k) {
+			const TransitionCandidate* other = sorted[ kept[k] ];
+			if(abs(other->from_insert_point - c->from_insert_point) <= separation &&
+			   abs(other->to_insert_point - c->to_insert_point) <= separation)
+				suppressed[ order[i] ] = true;
+		}
+		if(!suppressed[ order[i] ])
+			kept.push_back(order[i]);
+	}
+
+	int index = 0;
+	for(std::list< TransitionCandidate >::iterator c = candidates.begin(); c != candidates.end(); ++index) {
+		if(suppressed[index]) {
+			c = candidates.erase(c);
+			++m_stats.num_candidates_suppressed;
+		} else
+			++c;
+	}
+
+	// split points of each clip, then where each one moves to.
+	std::vector< std::vector<int> > points(numClips);
+	for(std::list< TransitionCandidate >::const_iterator c = candidates.begin(); c != candidates.end(); ++c) {
+		points[ clipIndices[c->from_clip->GetID()] ].push_back(c->from_insert_point);
+		points[ clipIndices[c->to_clip->GetID()] ].push_back(c->to_insert_point);
+	}
+	std::vector< std::map<int,int> > moves(numClips);
+	for(int clip = 0; clip < numClips; ++clip) {
+		std::vector<int>& clip_points = points[clip];
+		std::sort(clip_points.begin(), clip_points.end());
+		clip_points.erase(std::unique(clip_points.begin(), clip_points.end()), clip_points.end());
+		m_working.split_list[clip].clear();
+		const int count = clip_points.size();
+		for(int first = 0, last = 0; first < count; first = last) {
+			while(last < count && clip_points[last] - clip_points[first] <= separation)
+				++last;
+			const int median = clip_points[ first + (last - first - 1) / 2 ];
+			for(int i = first; i < last; ++i)
+				moves[clip][ clip_points[i] ] = median;
+			m_working.split_list[clip].push_back(median);
+			m_stats.num_splits_merged += last - first - 1;
+		}
+	}
+
+	// the windows at a moved candidate's new points need their own alignment, and may not be under
+	// the threshold. Those candidates keep their own points instead.
+	std::vector<int> moved_clips;
+	for(std::list< TransitionCandidate >::const_iterator c = candidates.begin(); c != candidates.end(); ++c) {
+		const int from_idx = clipIndices[c->from_clip->GetID()];
+		const int to_idx = clipIndices[c->to_clip->GetID()];
+		if(moves[from_idx][c->from_insert_point] != c->from_insert_point ||
+		   moves[to_idx][c->to_insert_point] != c->to_insert_point) {
+			moved_clips.push_back(from_idx);
+			moved_clips.push_back(to_idx);
+		}
+	}
+	std::sort(moved_clips.begin(), moved_clips.end());
+	moved_clips.erase(std::unique(moved_clips.begin(), moved_clips.end()), moved_clips.end());
+	SampleClouds(moved_clips);
+
+	static const float kInvRootTwo = 1.f/sqrt(2.f);
+	for(std::list< TransitionCandidate >::iterator c = candidates.begin(); c != candidates.end(); ++c) {
+		const int from_idx = clipIndices[c->from_clip->GetID()];
+		const int to_idx = clipIndices[c->to_clip->GetID()];
+		const int from_point = moves[from_idx][c->from_insert_point];
+		const int to_point = moves[to_idx][c->to_insert_point];
+		if(from_point == c->from_insert_point && to_point == c->to_insert_point)
+			continue;
+
+		// same windows ExtractTransitionCandidates would accept, under the pair's threshold.
+		const int from_frame = FindWindow(from_idx, from_point, false);
+		const int to_frame = FindWindow(to_idx, to_point, true);
+		bool keep = from_frame >= 0 && to_frame >= 0 &&
+			(from_idx != to_idx || fabs( kInvRootTwo * (to_frame - from_frame) ) > m_settings.num_samples);
+		Vec3 align_translation;
+		float align_rotation = 0.f, error = 0.f;
+		if(keep) {
+			error = ComputeWindowError(from_idx, from_frame, to_idx, to_frame, align_translation, align_rotation);
+			keep = error < GetPairErrorThreshold(m_working.clips, c->from_clip.RawPtr(), c->to_clip.RawPtr());
+		}
+
+		if(keep) {
+			c->from_frame = from_frame;
+			c->from_time = from_frame * m_settings.sample_interval;
+			c->from_insert_point = from_point;
+			c->to_frame = to_frame;
+			c->to_time = to_frame * m_settings.sample_interval;
+			c->to_insert_point = to_point;
+			c->align_translation = align_translation;
+			c->align_rotation = align_rotation;
+			c->error = error;
+		} else {
+			m_working.split_list[from_idx].push_back(c->from_insert_point);
+			m_working.split_list[to_idx].push_back(c->to_insert_point);
+			++m_stats.num_candidates_unsnapped;
+		}
+	}
+	for(int clip = 0; clip < numClips; ++clip) {
+		std::vector<int>& splits = m_working.split_list[clip];
+		std::sort(splits.begin(), splits.end());
+		splits.erase(std::unique(splits.begin(), splits.end()), splits.end());
+	}
+}
+
+// the graph changes from here on, so the search can't be resumed.
+void MotionGraphBuilder::StartSplits()
+{
+	ClearCheckpoint();
+	if(m_settings.split_separation > 0)
+		ClusterCandidates();
+}
+
+bool MotionGraphBuilder::IsNewClip(sqlite3_int64 clip_id) const
+{
+	const int numClips = m_working.working_set.size();
+	for(int i = 0; i < numClips; ++i)
+		if(m_working.working_set[i]->GetID() == clip_id)
+			return m_working.new_clips[i];
+	return false;
+}
+
+bool MotionGraphBuilder::ProcessSplits()
+{
+    // Check to see if we are finished
+	if(m_working.cur_split >= (int)m_working.working_set.size()) {
+		return false;
+	}
+
+	double start_time = omp_get_wtime();
+
+	if(m_working.cur_split == 0)
+		StartSplits();
+
+    // Process each split, subdividing the existing edge for an original clip at the list of frames
+    // in the split_list for that clip.
+	std::vector< int >& splits = m_working.split_list[ m_working.cur_split ];
+	sqlite3_int64 curEdgeId = m_working.initial_edges[m_working.cur_split];
+	const sqlite3_int64 clip_id = m_working.working_set[ m_working.cur_split ]->GetID();
+	const int num_frames = m_working.working_set[ m_working.cur_split ]->GetNumFrames();
+	++m_working.cur_split;
+
+	// must be in order to make sure edges are connected properly.
+	std::sort(splits.begin(), splits.end());
+
+	SavePoint(m_db, "processSplits");
+	int lastSplit = -1;
+	const int count = splits.size();
+	for(int i = 0; i < count; ++i) {
+		if(lastSplit != splits[i]) {
+			if(splits[i] > 0 && splits[i] < num_frames-1) { // these nodes already exist, so don't bother
+				// clips that were already in the graph have been split and pruned before, so find
+				// the edge over this frame. There is none if the frame is already a node, or was pruned.
+				sqlite3_int64 splitEdgeId = curEdgeId ? curEdgeId : m_graph->FindClipEdge(clip_id, splits[i]);
+			    sqlite3_int64 new_id = 0;
+				if(splitEdgeId != 0 && 0 != m_graph->SplitEdge( splitEdgeId, splits[i], 0, &new_id)) {
+					if(curEdgeId) curEdgeId = new_id;
+					++m_stats.num_splits;
+				}
+			}
+			lastSplit = splits[i];
+		}
+	}
+
+	m_stats.split_time += omp_get_wtime() - start_time;
+	return true;
+}
+
+void MotionGraphBuilder::CreateBlendFromCandidate(ostream& out)
+{
+	double start_time = omp_get_wtime();
+
+	TransitionCandidate candidate = m_working.transition_candidates.front();
+	m_working.transition_candidates.pop_front();
+
+	SavePoint save( m_db, "addTransitionEdge");
+	if(!AddTransitionEdge(candidate, 0, out)) {
+		save.Rollback();
+		return;
+	}
+	m_stats.blend_time += omp_get_wtime() - start_time;
+}
+
+// Nodes are looked up in nodes, or in the graph if it's null. Candidates whose nodes were pruned
+// are skipped, only failing to add the edge returns false.
+bool MotionGraphBuilder::AddTransitionEdge(const TransitionCandidate& candidate, const NodeMap* nodes, ostream& out)
+{
+	int original_clip_frame_from = candidate.from_insert_point;
+	int original_clip_frame_to = candidate.to_insert_point;
+
+	if(original_clip_frame_to >= candidate.to_clip->GetNumFrames()) {
+		int old = original_clip_frame_to ;
+		original_clip_frame_to = Clamp(original_clip_frame_to, 0, candidate.to_clip->GetNumFrames() - 1);
+		fprintf(stderr, "Warning: transition to clip is beyond the to clip frame count. Clamping %d to %d...\n",
+				old, original_clip_frame_to);
+	}
+
+    // Find the already split nodes. This should have taken place in ProcessSplits
+    // When adding clips, parts of the old clips may have been pruned and can't be split.
+	sqlite3_int64 transition_from_node = FindNode(nodes, candidate.from_clip->GetID(), original_clip_frame_from);
+	if(transition_from_node == 0) {
+			if(IsNewClip(candidate.from_clip->GetID()))
+				out << "Failed to find from node." << endl;
+			else
+				out << "Skipping transition from a pruned part of \"" << candidate.from_clip->GetName() << "\"." << endl;
+            return true;
+	}
+
+	sqlite3_int64 transition_to_node = FindNode(nodes, candidate.to_clip->GetID(), original_clip_frame_to);
+	if(transition_to_node == 0) {
+			if(IsNewClip(candidate.to_clip->GetID()))
+				out << "Failed to find to node." << endl;
+			else
+				out << "Skipping transition to a pruned part of \"" << candidate.to_clip->GetName() << "\"." << endl;
+            return true;
+	}
+
+    // TODO: this is kind of lame - are these variables being used elsewhere in
+    // a way that might conflict? should just be m-settings.blendTime
+    float blendTime = m_settings.num_samples * m_settings.sample_interval;
+
+	Quaternion align_rotation = make_rotation(candidate.align_rotation, Vec3(0,1,0));
+	sqlite3_int64 transition_edge_id = m_graph->AddTransitionEdge(transition_from_node,
+																transition_to_node,
+                                                                blendTime,
+																candidate.align_translation,
+																align_rotation);
+	if(transition_edge_id == 0) {
+		out << "Failed to add transition edge." << endl;
+		return false;
+	}
+
+	++m_stats.num_blends;
+	return true;
+}
+
+sqlite3_int64 MotionGraphBuilder::FindNode(const NodeMap* nodes, sqlite3_int64 clip_id, int frame_num) const
+{
+	if(nodes == 0)
+		return m_graph->FindNode(clip_id, frame_num);
+	NodeMap::const_iterator found = nodes->find( std::make_pair(clip_id, frame_num) );
+	return found == nodes->end() ? 0 : found->second;
+}
+
+bool MotionGraphBuilder::AssembleGraph(ostream& out)
+{
+	StartSplits();
+	double start_time = omp_get_wtime();
+	Transaction t(m_db);
+
+	NodeMap nodes;
+	std::vector<MGNodeInfo> node_infos;
+	m_graph->GetNodeInfos(node_infos);
+	const int num_nodes = node_infos.size();
+	for(int i = 0; i < num_nodes; ++i)
+		nodes[ std::make_pair(node_infos[i].clip_id, node_infos[i].frame_num) ] = node_infos[i].id;
+
+	// the edges that play each clip, in order. Clips that were in the graph before an add may have
+	// been split and pruned already.
+	std::map< sqlite3_int64, std::vector<ClipEdge> > clip_edges;
+	Query get_edges(m_db, "SELECT e.id, a.clip_id, a.id, a.frame_num, b.id, b.frame_num FROM motion_graph_edges e "
+					"JOIN motion_graph_nodes a ON e.start_id = a.id "
+					"JOIN motion_graph_nodes b ON e.finish_id = b.id "
+					"WHERE e.motion_graph_id = ? AND e.blended = 0 AND a.clip_id = b.clip_id "
+					"ORDER BY a.clip_id, a.frame_num");
+	get_edges.BindInt64(1, m_graph->GetID());
+	while(get_edges.Step()) {
+		ClipEdge edge = { get_edges.ColInt64(0), get_edges.ColInt64(2), get_edges.ColInt64(4),
+						  get_edges.ColInt(3), get_edges.ColInt(5) };
+		clip_edges[ get_edges.ColInt64(1) ].push_back(edge);
+	}
+
+	// replace each edge with a chain through the splits that fall on it.
+	const int numClips = m_working.working_set.size();
+	for(int clip = 0; clip < numClips; ++clip) {
+		std::vector<int>& splits = m_working.split_list[clip];
+		std::sort(splits.begin(), splits.end());
+		splits.erase(std::unique(splits.begin(), splits.end()), splits.end());
+
+		const sqlite3_int64 clip_id = m_working.working_set[clip]->GetID();
+		const std::vector<ClipEdge>& edges = clip_edges[clip_id];
+		const int num_splits = splits.size();
+		int split = 0;
+		for(int e = 0; e < (int)edges.size() && split < num_splits; ++e) {
+			const ClipEdge& edge = edges[e];
+			while(split < num_splits && splits[split] <= edge.start_frame)
+				++split;
+			if(split == num_splits || splits[split] >= edge.end_frame)
+				continue;
+
+			sqlite3_int64 prev = edge.start_id;
+			for(; split < num_splits && splits[split] < edge.end_frame; ++split) {
+				const sqlite3_int64 node = m_graph->AddNode(clip_id, splits[split]);
+				if(node == 0 || m_graph->AddEdge(prev, node) == 0) {
+					out << "Failed to split an edge of \"" << m_working.working_set[clip]->GetName() << "\"." << endl;
+					t.Rollback();
+					return false;
+				}
+				nodes[ std::make_pair(clip_id, splits[split]) ] = node;
+				prev = node;
+				++m_stats.num_splits;
+			}
+			if(m_graph->AddEdge(prev, edge.end_id) == 0 || !m_graph->DeleteEdge(edge.id)) {
+				out << "Failed to split an edge of \"" << m_working.working_set[clip]->GetName() << "\"." << endl;
+				t.Rollback();
+				return false;
+			}
+		}
+	}
+	m_working.cur_split = numClips;
+	double split_end = omp_get_wtime();
+	m_stats.split_time += split_end - start_time;
+
+	std::list< TransitionCandidate >& candidates = m_working.transition_candidates;
+	for(std::list< TransitionCandidate >::const_iterator c = candidates.begin(); c != candidates.end(); ++c) {
+		if(!AddTransitionEdge(*c, &nodes, out)) {
+			t.Rollback();
+			return false;
+		}
+	}
+	candidates.clear();
+	m_stats.blend_time += omp_get_wtime() - split_end;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void MotionGraphBuilder::StartPruning(MotionGraph* graph)
+{
+	m_graph = graph;
+	m_working.algo_graph = graph->GetAlgorithmGraph();
+	m_working.algo_graph->InitializePruning(m_working.keepFlags);
+
+	m_working.cur_prune_item = 0;
+	m_working.graph_pruning_queue.clear();
+	m_working.graph_pruning_queue.push_back(PruneWorkItem(0, "Main"));
+
+	Query get_annos(m_db, "SELECT id,name FROM annotations");
+	// TODO: add a work item for each unique set of annotations
+	while(get_annos.Step()) {
+		m_working.graph_pruning_queue.push_back(PruneWorkItem(get_annos.ColInt64(0),
+															  get_annos.ColText(1)));
+	}
+}
+
+static std::vector<int>* GetLargestSCC( AlgorithmMotionGraph::SCCList& sccs )
+{
+	std::vector<int>* largest_scc = 0;
+	int best_size = 0;
+	AlgorithmMotionGraph::SCCList::iterator cur = sccs.begin(), end = sccs.end();
+	while(cur != end) {
+		if((int)cur->size() > best_size) {
+			best_size = cur->size();
+			largest_scc = &(*cur);
+		}
+		++cur;
+	}
+	return largest_scc;
+}
+
+bool MotionGraphBuilder::PruneStep(ostream& out)
+{
+	if(m_working.cur_prune_item >= (int)m_working.graph_pruning_queue.size()) return false;
+	double start_time = omp_get_wtime();
+
+	PruneWorkItem &workItem = m_working.graph_pruning_queue[m_working.cur_prune_item];
+	int set_num = m_working.cur_prune_item++;
+
+	AlgorithmMotionGraph::SCCList sccs;
+	m_working.algo_graph->ComputeStronglyConnectedComponents( sccs, m_working.keepFlags, workItem.anno );
+
+	if(!sccs.empty()) {
+		std::vector<int>* largest_scc = GetLargestSCC( sccs );
+		out << (workItem.anno == 0 ? "Graph " : "Subgraph ")
+			<< workItem.name << ": Largest SCC has " << largest_scc->size() << " nodes." << endl;
+
+		m_working.algo_graph->MarkSetNum( set_num, workItem.anno, *largest_scc, m_working.keepFlags);
+	}
+
+	m_stats.prune_time += omp_get_wtime() - start_time;
+	return true;
+}
+
+bool MotionGraphBuilder::FinishPruning(ostream& out)
+{
+	double start_time = omp_get_wtime();
+	bool result = true;
+
+	int numEdgesDeleted = 0;
+    int numNodesDeleted = 0;
+	if( m_working.algo_graph->Commit(&numEdgesDeleted, &numNodesDeleted, m_working.keepFlags) ) {
+		out << "Graph pruning saved, " << numEdgesDeleted << " edges removed and "
+            << numNodesDeleted << " nodes removed." << endl;
+	} else {
+		out << "Failed to save graph pruning." << endl;
+		result = false;
+	}
+
+	int redundantNodesDeleted = 0;
+    m_graph->RemoveRedundantNodes(&redundantNodesDeleted);
+	out << "Removed " << redundantNodesDeleted << " redundant nodes." << endl;
+
+	m_stats.prune_time += omp_get_wtime() - start_time;
+	return result;
+}
+
+void MotionGraphBuilder::StartVerifyGraph(std::ostream& out)
+{
+	out << "Verifying graph..." << endl;
+	// need a new read of the algo graph because we just did a commit on the last one
+	m_working.algo_graph = m_graph->GetAlgorithmGraph();
+
+	// re-use the pruning queue since it is basically the same thing, but needed to be finished
+	// before we can verify.
+	m_working.cur_prune_item = 0;
+}
+
+bool MotionGraphBuilder::VerifyGraphStep(std::ostream& out)
+{
+	if(m_working.cur_prune_item >= (int)m_working.graph_pruning_queue.size()) return false;
+	PruneWorkItem &workItem = m_working.graph_pruning_queue[m_working.cur_prune_item];
+	++m_working.cur_prune_item;
+
+	AlgorithmMotionGraph::Node* node = m_working.algo_graph->FindNodeWithAnno( workItem.anno );
+	if(node) {
+		float total_clip_time = m_graph->CountClipTimeWithAnno( workItem.anno );
+		out << "Subgraph " << workItem.name << " has " << total_clip_time << "s of clip time." << endl;
+
+		const int num_sets = m_working.cur_prune_item;
+		for(int i = 0; i < num_sets; ++i) {
+			if(i != m_working.cur_prune_item) {
+				PruneWorkItem& otherItem = m_working.graph_pruning_queue[i];
+				if(!m_working.algo_graph->CanReachNodeWithAnno( node, otherItem.anno)) {
+					out << "Warning: no way to get from subgraph " << workItem.name << " to subgraph " <<
+						otherItem.name << endl;
+				}
+			}
+		}
+	} else {
+		out << "Subgraph " << workItem.name << " seems to have no nodes!" << endl;
+	}
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void MotionGraphBuilder::RunTransitionSearch(const ClipDB* clips, std::ostream& out)
+{
+	// Work on up to one clip pair per thread at once, so small pairs don't leave threads idle.
+	// Each pair's error function is computed a tile of rows at a time; every tile is split into
+	// tasks of a few diagonal segments and the threads take tasks as they finish. With tile_rows
+	// set, a tile's candidates are extracted as soon as the next tile is done and only three
+	// tiles are kept, otherwise a pair is a single tile. Pairs are finished in work list order.
+	const int max_pairs = Max(1, m_settings.num_threads);
+	std::vector< TransitionFindingData* > pairs;
+	std::vector< SegmentTask > tasks;
+
+	// sample every clip in the work list up front, with all the threads.
+	std::vector<int> used_clips;
+	for(std::list< ClipPair >::const_iterator pair = m_clipPairs.begin(); pair != m_clipPairs.end(); ++pair) {
+		used_clips.push_back(pair->first);
+		used_clips.push_back(pair->second);
+	}
+	std::sort(used_clips.begin(), used_clips.end());
+	used_clips.erase(std::unique(used_clips.begin(), used_clips.end()), used_clips.end());
+	SampleClouds(used_clips);
+
+	if(m_settings.index_windows)
+		IndexWindows(out);
+	while(HasPendingPairs()) {
+		pairs.clear();
+		while(HasPendingPairs() && (int)pairs.size() < max_pairs) {
+			ClipPair pair = m_clipPairs.front();
+			m_clipPairs.pop_front();
+
+			// discarded, culled and unmatched pairs are searched, they just have no candidates.
+			TransitionFindingData* finding = new TransitionFindingData;
+			if(!SetupPair(pair, clips, out, m_settings.cull_pairs, *finding)) {
+				FinishedPair(pair.first, pair.second);
+				delete finding;
+				continue;
+			}
+
+			if(m_settings.index_windows) {
+				std::map< ClipPair, std::vector< std::pair<int,int> > >::iterator matches = m_working.window_matches.find(pair);
+				if(matches == m_working.window_matches.end()) {
+					++m_stats.num_pairs_unmatched;
+					if(m_settings.save_error_functions)
+						CreateStoredErrorFunction(*finding, false);
+					FinishedPair(pair.first, pair.second);
+					delete finding;
+					continue;
+				}
+				finding->use_window_matches = true;
+				finding->window_matches.swap(matches->second);
+				if(finding->bound_threshold < 0.f)
+					finding->bound_threshold = m_settings.error_threshold;
+				m_working.window_matches.erase(matches);
+			}
+
+			AllocatePair(*finding, m_settings.tile_rows);
+			if(m_settings.save_error_functions)
+				CreateStoredErrorFunction(*finding, true);
+			pairs.push_back(finding);
+		}
+
+		const int num_pairs = pairs.size();
+		int num_tiles = 0;
+		for(int i = 0; i < num_pairs; ++i) {
+			if(!IsSampled(pairs[i]->from_idx))
+				SampleCloud(pairs[i]->from_idx);
+			if(!IsSampled(pairs[i]->to_idx))
+				SampleCloud(pairs[i]->to_idx);
+			num_tiles = Max(num_tiles, pairs[i]->GetNumTiles());
+		}
+
+		// Round k does the coarse search for tile k+1, which refining tile k needs for its bounds,
+		// then refines tile k, then finishes tile k-1 which needs the rows of tile k for its minima.
+		for(int round = -1; round <= num_tiles; ++round) {
+			double search_start = omp_get_wtime();
+			for(int coarse = IsCoarse() ? 1 : 0; coarse >= 0; --coarse) {
+				const int tile = coarse ? round + 1 : round;
+				tasks.clear();
+				for(int i = 0; i < num_pairs; ++i) {
+					if(tile < 0 || tile >= pairs[i]->GetNumTiles())
+						continue;
+					const int count = coarse ? GetNumCoarseSegments(*pairs[i], tile) : GetNumSegments(*pairs[i], tile);
+					for(int first = 0; first < count; first += kDiagonalsPerTask) {
+						SegmentTask task = { i, tile, first, Min(count, first + kDiagonalsPerTask) };
+						tasks.push_back(task);
+					}
+				}
+
+				const int num_tasks = tasks.size();
+				int task = 0;
+				long long num_skipped = 0;
+#pragma omp parallel for private(task) shared(tasks, pairs) reduction(+:num_skipped) schedule(dynamic, 1)
+				for(task = 0; task < num_tasks; ++task) {
+					TransitionFindingData& finding = *pairs[tasks[task].pair];
+					for(int idx = tasks[task].first; idx < tasks[task].last; ++idx) {
+						if(coarse)
+							ComputeCoarseSegment(finding, tasks[task].tile, idx);
+						else
+							num_skipped += ComputeSegment(finding, tasks[task].tile, idx);
+					}
+				}
+				m_stats.num_cells_skipped += num_skipped;
+			}
+
+			for(int i = 0; i < num_pairs; ++i) {
+				if(round >= 0 && round < pairs[i]->GetNumTiles()) {
+					const int num_segments = GetNumSegments(*pairs[i], round);
+					for(int idx = 0; idx < num_segments; ++idx)
+						m_stats.num_cells += NotifySegment(*pairs[i], round, idx);
+				}
+				if(round >= 1 && round - 1 < pairs[i]->GetNumTiles())
+					FinishTile(*pairs[i], round - 1);
+			}
+			m_stats.search_time += omp_get_wtime() - search_start;
+		}
+
+		for(int i = 0; i < num_pairs; ++i) {
+			FinishedPair(pairs[i]->from_idx, pairs[i]->to_idx);
+			delete pairs[i];
+		}
+		CheckpointIfDue();
+	}
+	out << "Found a total of " << m_working.transition_candidates.size() << " suitable transition candidates." << endl;
+}
+
+bool MotionGraphBuilder::RunStoredTransitionSearch(const ClipDB* clips, sqlite3_int64 graph_id, std::ostream& out)
+{
+	const std::vector<char>& signature = m_working.search_signature;
+	Query find_stored(m_db, "SELECT id, from_max, to_max, bound_threshold IS NULL, bound_threshold, error_values IS NULL "
+					  "FROM error_functions "
+					  "WHERE motion_graph_id = ? AND from_clip_id = ? AND to_clip_id = ? AND settings = ?");
+
+	TransitionFindingData finding;
+	while(HasPendingPairs()) {
+		ClipPair pair = m_clipPairs.front();
+		m_clipPairs.pop_front();
+		// stored pairs aren't culled, culled ones have a row without values like unmatched ones.
+		if(!SetupPair(pair, clips, out, false, finding)) {
+			FinishedPair(pair.first, pair.second);
+			continue;
+		}
+
+		double start_time = omp_get_wtime();
+		find_stored.Reset();
+		find_stored.BindInt64(1, graph_id)
+			.BindInt64(2, finding.fromClip->GetID())
+			.BindInt64(3, finding.toClip->GetID())
+			.BindBlob(4, &signature[0], signature.size());
+		if(!find_stored.Step() || find_stored.ColInt(1) != finding.from_max || find_stored.ColInt(2) != finding.to_max) {
+			out << "Graph " << graph_id << " has no error function for this pair with the current sampling settings." << endl;
+			return false;
+		}
+
+		// values that were bounded by the coarse search or skipped by the window index are only
+		// known to be over its threshold. A row without values is a pair that wasn't searched
+		// because none of them were under it.
+		const sqlite3_int64 stored_id = find_stored.ColInt64(0);
+		const bool has_values = find_stored.ColInt(5) == 0;
+		if(find_stored.ColInt(3) == 0) {
+			finding.bound_threshold = find_stored.ColDouble(4);
+			if(finding.current_error_threshold > finding.bound_threshold) {
+				out << "The error function was only computed under a threshold of " << finding.bound_threshold
+					<< ", which is under the threshold of " << finding.current_error_threshold << "." << endl;
+				return false;
+			}
+		} else
+			finding.bound_threshold = -1.f;
+
+		if(!has_values) {
+			if(m_settings.save_error_functions)
+				CreateStoredErrorFunction(finding, false);
+			FinishedPair(finding.from_idx, finding.to_idx);
+			CheckpointIfDue();
+			m_stats.search_time += omp_get_wtime() - start_time;
+			continue;
+		}
+
+		AllocatePair(finding, m_settings.tile_rows);
+		if(m_settings.save_error_functions)
+			CreateStoredErrorFunction(finding, true);
+
+		const int num_tiles = finding.GetNumTiles();
+		for(int tile = 0; tile <= num_tiles; ++tile) {
+			if(tile < num_tiles && !LoadErrorFunctionTile(finding, stored_id, tile)) {
+				out << "Failed to load the stored error function." << endl;
+				return false;
+			}
+			if(tile > 0)
+				FinishTile(finding, tile - 1);
+		}
+		FinishedPair(finding.from_idx, finding.to_idx);
+		CheckpointIfDue();
+		m_stats.search_time += omp_get_wtime() - start_time;
+	}
+	out << "Found a total of " << m_working.transition_candidates.size() << " suitable transition candidates." << endl;
+	return true;
+}
+
+void MotionGraphBuilder::RunGraphAssembly(std::ostream& out)
+{
+	out << "Subdividing graph edges and creating transition edges..." << endl;
+	if(AssembleGraph(out))
+		out << "Finished creating transition edges. " << endl;
+}
+
+void MotionGraphBuilder::RunPruning(MotionGraph* graph, std::ostream& out)
+{
+	out << "Pruning graph ... " << endl;
+	StartPruning(graph);
+	while(PruneStep(out))
+		;
+	FinishPruning(out);
+
+	StartVerifyGraph(out);
+	while(VerifyGraphStep(out))
+		;
+}
+
+static double PerSecond(double count, double seconds)
+{
+	return seconds > 0.0 ? count / seconds : 0.0;
+}
+
+void MotionGraphBuilder::PrintStats(std::ostream& out) const
+{
+	const double total_time = m_stats.sampling_time + m_stats.index_time + m_stats.search_time +
+		m_stats.split_time + m_stats.blend_time + m_stats.prune_time;
+	out << "Clip pairs compared: " << m_stats.num_pairs
+		<< " (" << m_stats.num_pairs_discarded << " discarded, " << m_stats.num_pairs_culled << " culled)" << endl
+		<< "Clouds sampled: " << m_stats.num_clouds << " in " << m_stats.sampling_time << "s ("
+		<< PerSecond(m_stats.num_clouds, m_stats.sampling_time) << " clouds/s, "
+		<< m_stats.num_clouds_cached << " from cache)" << endl;
+	if(m_settings.pack_clouds && m_working.inv_sum_weights > 0.f) {
+		// see PackedCloud, cells this close to the threshold might have changed sides.
+		const double shift = 2.0 * m_stats.max_packing_error / sqrt(double(m_working.inv_sum_weights));
+		out << "Packed clouds: points moved up to " << m_stats.max_packing_error
+			<< ", square roots of errors up to " << shift << endl;
+	}
+	out << "Error function values: " << m_stats.num_cells << " in " << m_stats.search_time << "s ("
+		<< PerSecond(double(m_stats.num_cells), m_stats.search_time) << " values/s)" << endl
+		<< "Window index: " << m_stats.index_time << "s, " << m_stats.num_pairs_unmatched << " clip pairs without matches" << endl
+		<< "Error function values skipped by coarse search, window index or early exit: " << m_stats.num_cells_skipped << endl
+		<< "Transition candidates: " << m_stats.num_candidates << " (" << m_stats.num_candidates_suppressed << " suppressed)" << endl
+		<< "Edge splits: " << m_stats.num_splits << " in " << m_stats.split_time << "s ("
+		<< PerSecond(m_stats.num_splits, m_stats.split_time) << " splits/s, "
+		<< m_stats.num_splits_merged << " split points merged, " << m_stats.num_candidates_unsnapped
+		<< " candidates kept their own)" << endl
+		<< "Transition edges: " << m_stats.num_blends << " in " << m_stats.blend_time << "s ("
+		<< PerSecond(m_stats.num_blends, m_stats.blend_time) << " edges/s)" << endl
+		<< "Pruning: " << m_stats.prune_time << "s" << endl
+		<< "Total: " << total_time << "s" << endl;
+}
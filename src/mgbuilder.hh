@@ -0,0 +1,410 @@
+#ifndef INCLUDED_moged_mgbuilder_HH
+#define INCLUDED_moged_mgbuilder_HH
+
+#include <list>
+#include <map>
+#include <vector>
+#include <string>
+#include <ostream>
+#include "NonCopyable.hh"
+#include "Vector.hh"
+#include "clip.hh"
+#include "clipdb.hh"
+#include "motiongraph.hh"
+
+class Skeleton;
+class Mesh;
+class CloudSampler;
+
+// Receives notifications from a MotionGraphBuilder. Used by the editor to show what
+// the builder is working on, headless builds just don't register one.
+class MotionGraphBuilderListener
+{
+public:
+	virtual ~MotionGraphBuilderListener() {}
+
+	// called after the point cloud for a clip in the working set has been sampled.
+	virtual void OnCloudSampled(int clip_idx) = 0;
+
+	// called when a comparison window of the current pair is under the error threshold.
+	virtual void OnCloudMatch(int from_offset, int to_offset, int len,
+							  Vec3_arg align_translation, float align_rotation) = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Motion graph construction, independent of any UI. Each stage is split into
+// steps so the editor can interleave the work with its event loop. The Run*
+// functions do a stage to completion for batch use.
+class MotionGraphBuilder : non_copyable
+{
+public:
+	struct Settings {
+		int num_threads;
+		float error_threshold;
+		float point_cloud_rate;
+		int max_point_cloud_size;
+		unsigned int sample_seed; // picks which mesh vertices are sampled, the same seed picks the same ones
+		float transition_length; // in seconds
+		float sample_rate; // fps to sample at
+		float weight_falloff;
+		int coarse_factor; // > 1 bounds the error function with a search that skips this many frames
+		                   //  and points first, and only computes cells that can be under the threshold
+		int tile_rows;     // > 0 streams the error function in tiles of this many rows in RunTransitionSearch,
+		                   //  keeping three tiles in memory instead of the whole error function
+		bool cache_clouds; // keep sampled clouds in the cloud_cache table, and reuse them while the clip,
+		                   //  skeleton, mesh, sampler and sample rate are unchanged
+		bool save_error_functions; // store each pair's error function with the graph, so
+		                           //  RunStoredTransitionSearch can extract transitions from it later
+		float checkpoint_interval; // > 0 saves the search progress with the graph this often (in seconds),
+		                           //  so StartResume can continue the search if it is interrupted
+		int shard_index;   // with num_shards > 1, only search the clip pairs assigned to this shard, so
+		int num_shards;    //  separate processes can each search a shard of a checkpointed graph
+		bool index_windows; // find the cells that can be under the threshold with a k-d tree of window
+		                    //  descriptors in RunTransitionSearch, and only compute those. Can't be coarse.
+		bool cull_pairs;   // skip pairs whose clips' ranges of window descriptors are too far apart for
+		                   //  any cell to be under the pair's threshold
+		bool early_exit;   // stop comparing a pair of frames once its heaviest samples are too far apart
+		                   //  for any window that contains it to be under the pair's threshold
+		bool pack_clouds;  // keep clouds as PackedClouds, half the memory, moving each point slightly.
+		                   //  The editor can't show packed clouds.
+		int split_separation; // > 0 thins out the candidates before splitting: of candidates between the
+		                      //  same clips that start and end this many clip frames apart or less, only
+		                      //  the lowest error one is kept, and split points that close share a node
+		                      //  when the candidates are still under their threshold there
+		bool soa_clouds;   // keep clouds as SoAClouds and compare them with cloud_kernel, which is
+		CloudKernel cloud_kernel; //  replaced by the kernel selectCloudKernel picked. Can't be packed.
+
+		int num_samples; // number of samples to gather given the above
+		float sample_interval; // time per sample.
+		Settings() { clear(); }
+		void clear();
+		void ComputeSampling(); // fills in num_samples and sample_interval
+	};
+
+    // Stores a potential transition found from comparing point clouds.
+	struct TransitionCandidate {
+		ClipHandle from_clip;           // ...
+		int from_frame;                 // frame in sample time
+		float from_time;                // ??
+		int from_insert_point;          // frame in clip time
+
+		ClipHandle to_clip;             // ...
+		int to_frame;                   // START of transition in sample time
+		float to_time;                  // ??
+		int to_insert_point;            // END of transition in clip time.
+
+		Vec3 align_translation;         // translation required to align the to clip to the from clip
+		float align_rotation;           // rotation required to align the to clip to the from clip
+		float error;                    // error function value of the transition
+	};
+
+	struct PruneWorkItem {
+    	PruneWorkItem(sqlite3_int64 anno, const char* name) :
+    		anno(anno), name(name) {}
+
+		sqlite3_int64 anno;
+		std::string name;
+	};
+
+	// Counters and timings, for reporting throughput.
+	struct Stats {
+		int num_pairs;                              // clip pairs compared
+		int num_pairs_discarded;                    // clip pairs too short to compare
+		int num_pairs_unmatched;                    // clip pairs the window index found no close windows for
+		int num_pairs_culled;                       // clip pairs bounded above the threshold by their clips' descriptor ranges
+		int num_clouds;                             // point clouds sampled
+		int num_clouds_cached;                      // ...of which were loaded from the cloud cache
+		float max_packing_error;                    // furthest a point of a packed cloud was moved
+		long long num_cells;                        // error function values computed
+		long long num_cells_skipped;                // ...of which were bounded above the threshold by the coarse search,
+		                                            //  the window index or the early exit
+		int num_candidates;                         // transition candidates found
+		int num_candidates_suppressed;              // ...of which a better candidate nearby replaced
+		int num_splits_merged;                      // split points moved onto a nearby split's node
+		int num_candidates_unsnapped;               // candidates that kept their own split points because they
+		                                            //  weren't under their threshold at the nearby ones
+		int num_splits;                             // edge splits requested
+		int num_blends;                             // transition edges added
+		double sampling_time;                       // seconds spent sampling clouds
+		double index_time;                          // seconds spent building and querying the window index
+		double search_time;                         // seconds spent computing the error function
+		double split_time;                          // seconds spent subdividing edges
+		double blend_time;                          // seconds spent adding transition edges
+		double prune_time;                          // seconds spent pruning the graph
+		Stats() { clear(); }
+		void clear();
+	};
+
+    // state data needed for finding transitions
+	struct TransitionWorkingData
+	{
+		CloudSampler *sampler;                      // Sampler used to create point clouds for comparison.
+		std::vector<char> sampler_signature;        // sampler->GetSignature(), for the cloud cache
+		std::vector<char> search_signature;         // sampler signature and settings that change the error
+		                                            //  function, for matching stored error functions
+		int num_clouds;                             // Total number of clouds.
+		Vec3 **clouds;                              // Array of clouds, one cloud for each frame to compare
+                                                    //  Clouds buffers contain #frames * #samples worth of positions.
+		int *cloud_lengths;                         // Number of frames for each cloud.
+		PackedCloud **packed_clouds;                // with pack_clouds, the clouds instead of clouds
+		SoACloud **soa_clouds;                      // with soa_clouds, the clouds instead of clouds
+
+		std::vector<int> sample_order;              // samples of a frame by decreasing weight, for the early exit
+		float *joint_weights;                       // Weights for each sample. TODO: consider computing this in the difference. Right now anything shorter than requested num_samples will have weird weighting
+
+                                                    //   len = #Frames * #SamplesPerFrame
+		float inv_sum_weights;                      // used for normalizing weights
+
+		Vec3 **coarse_clouds;                       // every coarse_factor'th point of each cloud, for the coarse search
+		float *coarse_weights;                      // weights for the first frame of coarse clouds
+		int coarse_samples_per_frame;
+		float coarse_inv_sum_weights;
+		float **self_distances;                     // for each clip, #frames * (coarse_factor-1) distances between coarse
+		                                            //  windows 1 to coarse_factor-1 frames apart, for bounding the error
+
+		const ClipDB* clips;                        // clip database the search was started with, for annotations
+		std::list< TransitionCandidate > transition_candidates; // potential edges in the motion graph
+		std::vector< ClipHandle > working_set;      // clips we are considering
+        std::vector< sqlite3_int64 > initial_edges; // The initial edges corresponding to the set of clips in working_set,
+                                                    //  0 for clips that were already in the graph
+        std::vector< bool > new_clips;              // clips in working_set that weren't in the graph yet
+		std::vector< std::pair<int,int> > finished_pairs; // pairs searched since the last checkpoint
+		std::map< std::pair<int,int>, std::vector< std::pair<int,int> > > window_matches; // cells the window index
+		                                            //  found for each pending pair, as (to - from, from)
+		std::vector< std::vector<float> > descriptor_ranges; // minimum and maximum of each window descriptor
+		                                            //  component for each clip, empty until a pair needs it
+		int num_checkpoint_candidates;              // transition_candidates already saved in the checkpoint
+		double last_checkpoint_time;
+		std::vector< std::vector<int> > split_list; // split list holds the frame numbers where nodes will be
+                                                    //  inserted into the original edge created for a clip. Indexed
+                                                    //  in the same order as working_set
+		int cur_split;
+
+		std::vector< PruneWorkItem > graph_pruning_queue;   // one item for the whole graph, one for each annotation
+		int cur_prune_item;                         // next item in graph_pruning_queue
+
+		AlgorithmMotionGraphHandle algo_graph;      // algorithm-supporting graph, used for pruning and building
+                                                    //  the final graph
+        std::vector<bool> keepFlags;                // Flags for whether or not to keep a particular edge
+                                                    //  (used by motion graph algorithms
+
+		TransitionWorkingData();
+		~TransitionWorkingData() { clear(); }
+		void clear();
+		void clearSearch(); // everything but the sampler
+	};
+
+	struct TransitionFindingData
+	{
+		int from_idx;                               // idx of clip we're comparing from (into m_working.working_set
+		int to_idx;                                 // same as above, but to
+		ClipHandle fromClip;                        // cached clips for comparison
+		ClipHandle toClip;                          // ...
+		int search_step;                            // next step of the search. In coarse mode the first steps are the
+		                                            //  coarse segments, then one step per segment of the error function
+		int from_max;                               // max number of sample frames as src
+		int to_max;                                 // max number of sample frmas as dest
+		int tile_rows;                              // rows of the error function in a tile
+		int num_tile_slots;                         // tiles kept in memory, 1 when the whole error function is kept
+
+		float current_error_threshold;              // error threshold from settings & annotations (fidelity)
+		float* error_function_values;               // error funtion - from_max * to_max floats with
+                                                    //  comparison values for each, or num_tile_slots tiles of
+                                                    //  tile_rows rows. Use CellIndex to find a value.
+		Vec3* alignment_translations;               // corresponding alignments for minimum error
+		float* alignment_angles;                    // ...
+		float* coarse_values;                       // coarse error function, only on every coarse_factor'th diagonal
+		sqlite3_int64 stored_id;                    // error_functions row this is saved to, 0 if not saved
+		float bound_threshold;                      // values over this may be bounds, < 0 if all are exact
+		bool use_window_matches;                    // only compute the cells in window_matches
+		std::vector< std::pair<int,int> > window_matches; // sorted (to - from, from) of the cells the window
+		                                            //  index found could be under the threshold
+		std::vector<int> minima_indices;            // the indices of the local minima
+
+		TransitionFindingData();
+		~TransitionFindingData() { clear(); }
+		void clear();
+
+		int GetNumTiles() const { return tile_rows > 0 ? (from_max + tile_rows - 1) / tile_rows : 0; }
+		int CellIndex(int from, int to) const {
+			return (((from / tile_rows) % num_tile_slots) * tile_rows + from % tile_rows) * to_max + to;
+		}
+	};
+
+private:
+	sqlite3* m_db;
+	const Skeleton* m_skel;
+	const Mesh* m_mesh;
+	MotionGraph* m_graph;                           // graph being built
+	MotionGraphBuilderListener* m_listener;
+
+	typedef std::pair<int,int> ClipPair;            // index pairs for Clips we are going to compare
+	typedef std::map< std::pair<sqlite3_int64,int>, sqlite3_int64 > NodeMap; // (clip id, frame) to node id
+	struct ClipEdge {                               // an unblended edge playing part of a clip
+		sqlite3_int64 id, start_id, end_id;
+		int start_frame, end_frame;
+	};
+
+	// A range of diagonal segments in a tile of one pair's error function, the unit of work for the
+	// search threads.
+	enum { kDiagonalsPerTask = 8 };
+
+	// relative slack on the coarse bound, so rounding can't skip a cell that is just under the threshold.
+	static const float kCoarseBoundMargin;
+	// error function value of cells that haven't been computed and can't be under any threshold.
+	static const float kUncomputedError;
+	// window descriptors split the frames and the samples of a window into this many groups each.
+	enum { kDescriptorFrameGroups = 4, kDescriptorSampleGroups = 4 };
+	struct SegmentTask {
+		int pair;                                   // index into the pairs being searched
+		int tile;                                   // tile of the pair's error function
+		int first;                                  // first segment
+		int last;                                   // one past the last segment
+	};
+	std::list< ClipPair > m_clipPairs;              // work list of clip comparisons
+	int m_total_work;                               // number of comparisons + splits, for progress
+
+	Settings m_settings;
+	TransitionWorkingData m_working;
+	TransitionFindingData m_transition_finding;
+	Stats m_stats;
+
+public:
+	MotionGraphBuilder(sqlite3* db, const Skeleton* skel, const Mesh* mesh);
+	~MotionGraphBuilder();
+
+	void SetListener(MotionGraphBuilderListener* listener) { m_listener = listener; }
+
+	// Create the cloud sampler. Returns false and fills in error if the settings can't be used.
+	bool Init(const Settings& settings, std::string& error);
+	int GetNumPointsRequested() const;
+
+	// Add the clips to graph as unconnected edges and queue all clip pairs for comparison.
+	void Start(MotionGraph* graph, const ClipDB* clips, std::ostream& out);
+
+	// Add the clips that aren't in graph yet as unconnected edges and queue only the clip pairs
+	// that involve one of them. Splits then subdivide whichever edges of the old clips cover the
+	// new transitions, and pruning can be run on the whole graph again.
+	void StartAddClips(MotionGraph* graph, const ClipDB* clips, std::ostream& out);
+
+	// Continue a search that was checkpointed with graph (see Settings::checkpoint_interval) from
+	// the pairs that weren't finished. The checkpoint is dropped when the graph starts to change in
+	// ProcessSplits. Returns false and explains why in out if there's no search to resume.
+	bool StartResume(MotionGraph* graph, const ClipDB* clips, std::ostream& out);
+
+	// Add the pairs and candidates checkpointed with graph in another copy of the entity file,
+	// usually by a process that searched one shard of it, to graph's checkpoint here. Call before
+	// StartResume. Returns false and explains why in out if the copy's search doesn't match.
+	bool MergeCheckpoint(const MotionGraph* graph, const char* filename, std::ostream& out);
+
+	// Transition search
+	bool HasPendingPairs() const { return !m_clipPairs.empty(); }
+	bool StartNextPair(const ClipDB* clips, std::ostream& out); // false if the pair was discarded
+	bool ProcessNextTransition(double max_time, int* num_processed); // false once the pair is finished
+	void FinishPair();
+
+	// Graph assembly
+	bool ProcessSplits(); // false when there are no clips left to split
+	bool HasPendingCandidates() const { return !m_working.transition_candidates.empty(); }
+	void CreateBlendFromCandidate(std::ostream& out);
+	// All the splits and transition edges at once, in one transaction. Nodes and edges are worked
+	// out in memory instead of looked up for each split and candidate. Returns false and rolls
+	// back if the graph can't be written.
+	bool AssembleGraph(std::ostream& out);
+
+	// Pruning, works on any graph.
+	void StartPruning(MotionGraph* graph);
+	bool PruneStep(std::ostream& out);
+	bool FinishPruning(std::ostream& out);
+	void StartVerifyGraph(std::ostream& out);
+	bool VerifyGraphStep(std::ostream& out);
+
+	// Run a whole stage without pausing.
+	void RunTransitionSearch(const ClipDB* clips, std::ostream& out);
+	// Extract transitions from the error functions saved with another graph instead of comparing
+	// clips. The settings that change the error function must be the same. Returns false and
+	// explains why in out if a pair can't be extracted.
+	bool RunStoredTransitionSearch(const ClipDB* clips, sqlite3_int64 graph_id, std::ostream& out);
+	void RunGraphAssembly(std::ostream& out);
+	void RunPruning(MotionGraph* graph, std::ostream& out);
+
+	void PrintStats(std::ostream& out) const;
+
+	const Settings& GetSettings() const { return m_settings; }
+	const Stats& GetStats() const { return m_stats; }
+	const TransitionFindingData& GetTransitionFinding() const { return m_transition_finding; }
+	int GetTotalWork() const { return m_total_work; }
+	int GetNumClips() const { return m_working.working_set.size(); }
+	int GetNumCandidates() const { return m_working.transition_candidates.size(); }
+	int GetNumPruneItems() const { return m_working.graph_pruning_queue.size(); }
+	float GetInvSumWeights() const { return m_working.inv_sum_weights; }
+
+	int GetSamplesPerFrame() const;
+	const Vec3* GetCloud(int clip_idx) const { return m_working.clouds ? m_working.clouds[clip_idx] : 0; }
+	int GetCloudLength(int clip_idx) const { return m_working.cloud_lengths ? m_working.cloud_lengths[clip_idx] : 0; }
+
+private:
+	enum StartMode { kNewGraph, kAddClips, kResume };
+	bool StartSearch(MotionGraph* graph, const ClipDB* clips, StartMode mode, std::ostream& out);
+	void PopulateInitialMotionGraph(const ClipDB* clips, bool add_clips, std::ostream& out);
+	bool PopulateResumedMotionGraph(const ClipDB* clips, std::ostream& out);
+	void CreateWorkList();
+	bool IsNewClip(sqlite3_int64 clip_id) const;
+	void InitJointWeights();
+	void SampleCloud(int clip_idx);
+	void SampleClouds(const std::vector<int>& clip_indices);
+	bool LoadCachedCloud(int clip_idx);
+	void SaveCachedCloud(int clip_idx);
+	void PackCloud(int clip_idx);
+	void SplitCloud(int clip_idx);
+	bool IsSampled(int clip_idx) const;
+	void CopyCloud(int clip_idx, int num_frames, Vec3* out) const;
+	void InitCoarseCloud(int clip_idx);
+	int GetDescriptorSize() const;
+	void ComputeWindowDescriptors(int clip_idx, int num_windows, float* out) const;
+	void IndexWindows(std::ostream& out);
+	float PairBound(int from_idx, int to_idx);
+	void FindWindowMatchRuns(const TransitionFindingData& finding, int from, int to, int count,
+							 std::vector< std::pair<int,int> >& runs) const;
+	float GetPairErrorThreshold(const ClipDB* clips, const Clip* from_clip, const Clip* to_clip) const;
+	bool SetupPair(const ClipPair& pair, const ClipDB* clips, std::ostream& out, bool cull,
+				   TransitionFindingData& finding);
+	void AllocatePair(TransitionFindingData& finding, int tile_rows);
+	bool IsCoarse() const { return m_settings.coarse_factor > 1; }
+	void GetTileRows(const TransitionFindingData& finding, int tile, int& first, int& last) const;
+	int GetNumSegments(const TransitionFindingData& finding, int tile) const;
+	int GetNumCoarseSegments(const TransitionFindingData& finding, int tile) const;
+	long long ComputeSegments(TransitionFindingData& finding, int tile, bool coarse, int first, int last) const;
+	void ComputeCoarseSegment(TransitionFindingData& finding, int tile, int idx) const;
+	template< class Cloud >
+	int ComputeDiagonal(const Cloud& from_cloud, const Cloud& to_cloud, TransitionFindingData& finding,
+						int from, int to, int num_cells, float cutoff) const;
+	int ComputeSegment(TransitionFindingData& finding, int tile, int idx) const;
+	int NotifySegment(const TransitionFindingData& finding, int tile, int idx) const;
+	float CoarseBound(const TransitionFindingData& finding, int from, int to) const;
+	void FinishTile(const TransitionFindingData& finding, int tile);
+	void CreateStoredErrorFunction(TransitionFindingData& finding, bool with_values);
+	void SaveErrorFunctionTile(const TransitionFindingData& finding, int tile);
+	bool LoadErrorFunctionTile(TransitionFindingData& finding, sqlite3_int64 stored_id, int tile);
+	void ExtractTransitionCandidates(const TransitionFindingData& finding, const std::vector<int>& minima);
+	int GetInsertPoint(const Clip* clip, int frame, bool end) const;
+	int FindWindow(int clip_idx, int insert_point, bool end) const;
+	float ComputeWindowError(int from_idx, int from_frame, int to_idx, int to_frame,
+							 Vec3& align_translation, float& align_rotation) const;
+	void ClusterCandidates();
+	void StartSplits();
+	bool AddTransitionEdge(const TransitionCandidate& candidate, const NodeMap* nodes, std::ostream& out);
+	sqlite3_int64 FindNode(const NodeMap* nodes, sqlite3_int64 clip_id, int frame_num) const;
+	void AddTransitionCandidate(int from_idx, int from_frame, int to_idx, int to_frame, float error,
+								Vec3_arg align_translation, float align_rotation);
+	void GetCheckpointSignature(std::vector<char>& out) const;
+	void BeginCheckpoints();
+	void LoadCheckpoint(std::ostream& out);
+	void FinishedPair(int from_idx, int to_idx);
+	void CheckpointIfDue();
+	void SaveCheckpoint();
+	void ClearCheckpoint();
+	bool MergeCheckpoint(const MotionGraph* graph, sqlite3* shard, const char* filename, std::ostream& out);
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include <vector>
 #include <cstdio>
 #include <fstream>
+#include <limits>
 #include <omp.h>
 #include "sql/sqlite3.h"
 #include "motiongraph.hh"
@@ -52,6 +53,7 @@ MotionGraph::MotionGraph(sqlite3* db, sqlite3_int64 skel_id, sqlite3_int64 id)
     , m_stmt_get_all_node_info(db)
     , m_stmt_delete_edge(db)
     , m_stmt_add_t_edge(db)
+    , m_stmt_find_clip_edge(db)
 {
 
     Query check_id(m_db, "SELECT id,name FROM motion_graphs WHERE id = ? and skel_id = ?");
@@ -103,6 +105,13 @@ void MotionGraph::PrepareStatements()
     m_stmt_add_t_edge.Init("INSERT INTO motion_graph_edges(motion_graph_id, start_id, finish_id, blend_time, align_translation, align_rotation, blended )"
                            "VALUES (?, ?, ?, ?, ?, ?, 1)");
     m_stmt_add_t_edge.BindInt64(1, m_id);
+
+    m_stmt_find_clip_edge.Init("SELECT e.id FROM motion_graph_edges e "
+                               "JOIN motion_graph_nodes a ON e.start_id = a.id "
+                               "JOIN motion_graph_nodes b ON e.finish_id = b.id "
+                               "WHERE e.motion_graph_id = ? AND e.blended = 0 AND a.clip_id = ? AND b.clip_id = ? "
+                               "AND a.frame_num < ? AND b.frame_num > ?");
+    m_stmt_find_clip_edge.BindInt64(1, m_id);
 }
 
 MotionGraph::~MotionGraph()
@@ -262,6 +271,29 @@ bool MotionGraph::DeleteEdge(sqlite3_int64 id)
     return !m_stmt_delete_edge.IsError();
 }
 
+sqlite3_int64 MotionGraph::FindClipEdge(sqlite3_int64 clip_id, int frame_num) const
+{
+    m_stmt_find_clip_edge.Reset();
+    m_stmt_find_clip_edge.BindInt64(2, clip_id);
+    m_stmt_find_clip_edge.BindInt64(3, clip_id);
+    m_stmt_find_clip_edge.BindInt(4, frame_num);
+    m_stmt_find_clip_edge.BindInt(5, frame_num);
+    if( m_stmt_find_clip_edge.Step() ) {
+        return m_stmt_find_clip_edge.ColInt64(0);
+    }
+    return 0;
+}
+
+void MotionGraph::GetClipIDs(std::vector<sqlite3_int64>& out) const
+{
+    out.clear();
+    Query get_clips(m_db, "SELECT DISTINCT clip_id FROM motion_graph_nodes WHERE motion_graph_id = ?");
+    get_clips.BindInt64(1, m_id);
+    while(get_clips.Step()) {
+        out.push_back( get_clips.ColInt64(0) );
+    }
+}
+
 void MotionGraph::GetEdgeIDs(std::vector<sqlite3_int64>& out) const
 {
     out.clear();
@@ -589,52 +621,509 @@ float computeCloudDifference(const Vec3* from_cloud,
     return diff;
 }
 
-void findErrorFunctionMinima(const float* error_values, int width, int height, std::vector<int>& out_minima_indices)
+static inline void addPointMoments(const Vec3& from, const Vec3& to, double w, CloudMoments& out)
 {
-    out_minima_indices.clear();
+    out.w += w;
+    out.from_x += from.x * w;
+    out.from_z += from.z * w;
+    out.to_x += to.x * w;
+    out.to_z += to.z * w;
+    // products in double precision, the error depends on these cancelling exactly.
+    out.a += w * (double(from.x) * to.z - double(to.x) * from.z);
+    out.b += w * (double(from.x) * to.x + double(from.z) * to.z);
+    out.c += w * (double(from.x) * from.x + double(from.y) * from.y + double(from.z) * from.z +
+                  double(to.x) * to.x + double(to.y) * to.y + double(to.z) * to.z -
+                  2.0 * double(from.y) * to.y);
+}
 
-    const int window_size = 3;
-    const int total = width*height;
-    int i = 0;
+void accumulateCloudMoments(const Vec3* from_cloud,
+                            const Vec3* to_cloud,
+                            const float *weights,
+                            int count,
+                            CloudMoments& out)
+{
+    for(int i = 0; i < count; ++i)
+        addPointMoments(from_cloud[i], to_cloud[i], weights[i], out);
+}
 
-    int* is_minima = new int[total];
-    for(i = 0; i < total; ++i) is_minima[i] = 1;
-    
-#pragma omp parallel for private(i) shared(is_minima, width, height, error_values)
-    for(i = 0; i < total; ++i) 
-    {
-        int x = i % width;
-        int y = i / width;
+void PackedCloud::Pack(const Vec3* points, int count)
+{
+    x.resize(count); y.resize(count); z.resize(count);
+    if(count == 0) {
+        origin.set(0,0,0);
+        scale.set(0,0,0);
+        return;
+    }
 
-        float middle = error_values[i];
-        
-        int min_x = Max(0, x - window_size);
-        int max_x = Min(width, x + window_size);
-        int min_y = Max(0, y - window_size);
-        int max_y = Min(height, y + window_size);
-        
-        for(int cur_y = min_y; cur_y < max_y; ++cur_y)
-        {           
-            int offset = cur_y * width + min_x;
-            for(int cur_x = min_x; cur_x < max_x; ++cur_x)
+    Vec3 lo = points[0], hi = points[0];
+    for(int i = 1; i < count; ++i) {
+        lo.set(Min(lo.x, points[i].x), Min(lo.y, points[i].y), Min(lo.z, points[i].z));
+        hi.set(Max(hi.x, points[i].x), Max(hi.y, points[i].y), Max(hi.z, points[i].z));
+    }
+    origin = lo;
+    scale = (hi - lo) / 65535.f;
+
+    const Vec3 inv_scale(scale.x > 0.f ? 1.f / scale.x : 0.f,
+                         scale.y > 0.f ? 1.f / scale.y : 0.f,
+                         scale.z > 0.f ? 1.f / scale.z : 0.f);
+    for(int i = 0; i < count; ++i) {
+        const Vec3 offset = points[i] - origin;
+        x[i] = (unsigned short)Clamp(int(offset.x * inv_scale.x + 0.5f), 0, 65535);
+        y[i] = (unsigned short)Clamp(int(offset.y * inv_scale.y + 0.5f), 0, 65535);
+        z[i] = (unsigned short)Clamp(int(offset.z * inv_scale.z + 0.5f), 0, 65535);
+    }
+}
+
+void PackedCloud::Unpack(int first, int count, Vec3* out) const
+{
+    for(int i = 0; i < count; ++i)
+        out[i] = GetPoint(first + i);
+}
+
+// The diagonal kernel reads clouds through these, so the same code runs on Vec3, packed and
+// SoA clouds.
+static inline Vec3 cloudPoint(const Vec3* cloud, int points_per_frame, int frame, int sample)
+{
+    return cloud[frame * points_per_frame + sample];
+}
+
+static inline Vec3 cloudPoint(const PackedCloud& cloud, int points_per_frame, int frame, int sample)
+{
+    return cloud.GetPoint(frame * points_per_frame + sample);
+}
+
+static inline Vec3 cloudPoint(const SoACloud& cloud, int, int frame, int sample)
+{
+    return cloud.GetPoint(frame, sample);
+}
+
+static inline void accumulateFrameMoments(const Vec3* from_cloud, int from_frame,
+                                          const Vec3* to_cloud, int to_frame,
+                                          const float* weights, int points_per_frame, CloudMoments& out)
+{
+    accumulateCloudMoments(&from_cloud[from_frame * points_per_frame], &to_cloud[to_frame * points_per_frame],
+                           weights, points_per_frame, out);
+}
+
+static inline void accumulateFrameMoments(const PackedCloud& from_cloud, int from_frame,
+                                          const PackedCloud& to_cloud, int to_frame,
+                                          const float* weights, int points_per_frame, CloudMoments& out)
+{
+    const int from_first = from_frame * points_per_frame;
+    const int to_first = to_frame * points_per_frame;
+    for(int i = 0; i < points_per_frame; ++i)
+        addPointMoments(from_cloud.GetPoint(from_first + i), to_cloud.GetPoint(to_first + i), weights[i], out);
+}
+
+static inline void accumulateFrameMoments(const SoACloud& from_cloud, int from_frame,
+                                          const SoACloud& to_cloud, int to_frame,
+                                          const float* weights, int points_per_frame, CloudMoments& out)
+{
+    accumulateSoAMoments(from_cloud.GetX(from_frame), from_cloud.GetY(from_frame), from_cloud.GetZ(from_frame),
+                         to_cloud.GetX(to_frame), to_cloud.GetY(to_frame), to_cloud.GetZ(to_frame),
+                         weights, points_per_frame, out);
+}
+
+// Same alignment as computeCloudAlignment, but the weighted squared distance after
+// alignment is computed from the same sums instead of transforming the to_cloud:
+//   sum w|p - Rq - t|^2 = sum w(|p|^2 + |q|^2) - 2 sum w p.Rq - 2 t.sum wp + 2 t.R sum wq + |t|^2 sum w
+// R only rotates about y, so p.Rq = cos * (px qx + pz qz) + sin * (px qz - qx pz) + py qy.
+float computeAlignmentFromMoments(const CloudMoments& m,
+                                  float inv_total_weights,
+                                  Vec3& align_translation,
+                                  float& align_rotation)
+{
+    double angle = atan2( m.a - double(inv_total_weights) * (m.from_x * m.to_z - m.to_x * m.from_z),
+                          m.b - double(inv_total_weights) * (m.from_x * m.to_x + m.from_z * m.to_z) );
+
+    double cos_a = cos(angle);
+    double sin_a = sin(angle);
+
+    float x = double(inv_total_weights) * (m.from_x - m.to_x * cos_a - m.to_z * sin_a);
+    float z = double(inv_total_weights) * (m.from_z + m.to_x * sin_a - m.to_z * cos_a);
+
+    align_translation.set(x,0,z);
+    align_rotation = float(angle);
+
+    // use the same rounded values computeCloudDifference would have seen.
+    const double tx = x, tz = z;
+    cos_a = cos(double(align_rotation));
+    sin_a = sin(double(align_rotation));
+
+    double rot_to_x = m.to_x * cos_a + m.to_z * sin_a;
+    double rot_to_z = -m.to_x * sin_a + m.to_z * cos_a;
+    double diff = m.c - 2.0 * (cos_a * m.b + sin_a * m.a)
+        + m.w * (tx * tx + tz * tz)
+        - 2.0 * (tx * m.from_x + tz * m.from_z)
+        + 2.0 * (tx * rot_to_x + tz * rot_to_z);
+
+    // cancellation can leave a tiny negative value for near perfect matches
+    return float(Max(diff, 0.0));
+}
+
+void computeErrorFunctionDiagonal(const Vec3* from_cloud,
+                                  int from_cloud_len,
+                                  const Vec3* to_cloud,
+                                  int to_cloud_len,
+                                  int points_per_frame,
+                                  int window_frames,
+                                  const float *frame_weights,
+                                  float weight_falloff,
+                                  float inv_total_weights,
+                                  int from_frame,
+                                  int to_frame,
+                                  int num_cells,
+                                  float* out_errors,
+                                  Vec3* out_translations,
+                                  float* out_angles,
+                                  int out_stride)
+{
+    computeBoundedErrorFunctionDiagonal(from_cloud, from_cloud_len, to_cloud, to_cloud_len,
+                                        points_per_frame, window_frames, frame_weights,
+                                        weight_falloff, inv_total_weights,
+                                        from_frame, to_frame, num_cells,
+                                        out_errors, out_translations, out_angles, out_stride,
+                                        0, -1.f);
+}
+
+template< class Cloud >
+static int boundedErrorFunctionDiagonal(const Cloud& from_cloud,
+                                        int from_cloud_len,
+                                        const Cloud& to_cloud,
+                                        int to_cloud_len,
+                                        int points_per_frame,
+                                        int window_frames,
+                                        const float *frame_weights,
+                                        float weight_falloff,
+                                        float inv_total_weights,
+                                        int from_frame,
+                                        int to_frame,
+                                        int num_cells,
+                                        float* out_errors,
+                                        Vec3* out_translations,
+                                        float* out_angles,
+                                        int out_stride,
+                                        const int* sample_order,
+                                        float cutoff)
+{
+    if(num_cells <= 0) return 0;
+    ASSERT(window_frames > 0);
+
+    const int num_frames = Min(num_cells - 1 + window_frames,
+                               Min(from_cloud_len - from_frame, to_cloud_len - to_frame));
+    ASSERT(num_frames >= num_cells);
+
+    // Frame j of a window is weighted by 1 - falloff_step * j, so a frame pair is weighted at
+    // least min_scale in any window.
+    const double falloff_step = (1.0 - weight_falloff) / double(window_frames);
+    const double min_scale = 1.0 - falloff_step * (window_frames - 1);
+    const bool bounded = cutoff >= 0.f && sample_order && min_scale > 0.0;
+
+    // moments of each pair of frames along the diagonal, with the first frame's weights.
+    std::vector<CloudMoments> frame_moments(num_frames);
+    std::vector<int> last_bounded_frame;
+    std::vector<float> frame_bounds;
+    if(!bounded) {
+        for(int i = 0; i < num_frames; ++i)
+        {
+            accumulateFrameMoments(from_cloud, from_frame + i, to_cloud, to_frame + i,
+                                   frame_weights, points_per_frame, frame_moments[i]);
+        }
+    } else {
+        // The error of a subset of a window's points under their own best alignment is no more
+        // than the error of the window, so once the samples of a frame pair compared so far are
+        // over the cutoff, so is every window that contains it. Samples are compared in
+        // sample_order, checking after 8, 16, 32... samples, and a frame pair that goes over
+        // is left unfinished. Its moments only ever go into windows that get the bound instead.
+        last_bounded_frame.resize(num_frames, -1);
+        frame_bounds.resize(num_frames, 0.f);
+        for(int i = 0; i < num_frames; ++i)
+        {
+            CloudMoments& moments = frame_moments[i];
+            int next_check = 8;
+            for(int k = 0; k < points_per_frame; ++k)
             {
-                if(offset != i) {
-                    float val = error_values[offset];
-                    if(val < middle) {
-                        is_minima[i] = 0;
+                const int sample = sample_order[k];
+                addPointMoments(cloudPoint(from_cloud, points_per_frame, from_frame + i, sample),
+                                cloudPoint(to_cloud, points_per_frame, to_frame + i, sample),
+                                frame_weights[sample], moments);
+                if(k + 1 == next_check && k + 1 < points_per_frame) {
+                    next_check *= 2;
+                    if(moments.w <= 0.0)
+                        continue;
+                    Vec3 align_translation;
+                    float align_rotation;
+                    const float bound = float(min_scale) * computeAlignmentFromMoments(moments, float(1.0 / moments.w),
+                                                                                         align_translation, align_rotation);
+                    if(bound > cutoff) {
+                        frame_bounds[i] = bound;
+                        last_bounded_frame[i] = i;
                         break;
-                    }               
+                    }
                 }
-                ++offset;
             }
+            if(i > 0 && last_bounded_frame[i] < 0)
+                last_bounded_frame[i] = last_bounded_frame[i - 1];
         }
     }
 
-    for(i = 0; i < total; ++i) 
-        if(is_minima[i]) 
-            out_minima_indices.push_back(i);
+    // A window's moments are sum_m - falloff_step * sum_jm, where sum_m is the sum of the frame
+    // moments and sum_jm is the sum of the frame moments scaled by their index in the window.
+    CloudMoments sum_m, sum_jm, window;
+    int end = 0;
+    int num_bounded = 0;
+    for(int cell = 0; cell < num_cells; ++cell)
+    {
+        const int new_end = cell + Min(window_frames, num_frames - cell);
+        ASSERT(new_end >= end);
+
+        if(cell % window_frames == 0) {
+            // start over every so often so rounding errors from sliding don't build up.
+            sum_m.clear(); sum_jm.clear();
+            for(int j = cell; j < new_end; ++j) {
+                sum_m.add(frame_moments[j]);
+                sum_jm.add(frame_moments[j], j - cell);
+            }
+        } else {
+            // drop the first frame of the previous window, every other frame moves down one slot.
+            sum_m.sub(frame_moments[cell - 1]);
+            sum_jm.sub(sum_m);
+            for(int j = end; j < new_end; ++j) {
+                sum_m.add(frame_moments[j]);
+                sum_jm.add(frame_moments[j], j - cell);
+            }
+        }
+        end = new_end;
+
+        const int out_idx = cell * out_stride;
+        if(bounded && last_bounded_frame[new_end - 1] >= cell) {
+            out_errors[out_idx] = frame_bounds[ last_bounded_frame[new_end - 1] ];
+            if(out_translations) out_translations[out_idx].set(0,0,0);
+            if(out_angles) out_angles[out_idx] = 0.f;
+            ++num_bounded;
+            continue;
+        }
+
+        window = sum_m;
+        window.add(sum_jm, -falloff_step);
+
+        Vec3 align_translation;
+        float align_rotation;
+        out_errors[out_idx] = computeAlignmentFromMoments(window, inv_total_weights,
+                                                          align_translation, align_rotation);
+        if(out_translations) out_translations[out_idx] = align_translation;
+        if(out_angles) out_angles[out_idx] = align_rotation;
+    }
+    return num_bounded;
+}
+
+int computeBoundedErrorFunctionDiagonal(const Vec3* from_cloud,
+                                        int from_cloud_len,
+                                        const Vec3* to_cloud,
+                                        int to_cloud_len,
+                                        int points_per_frame,
+                                        int window_frames,
+                                        const float *frame_weights,
+                                        float weight_falloff,
+                                        float inv_total_weights,
+                                        int from_frame,
+                                        int to_frame,
+                                        int num_cells,
+                                        float* out_errors,
+                                        Vec3* out_translations,
+                                        float* out_angles,
+                                        int out_stride,
+                                        const int* sample_order,
+                                        float cutoff)
+{
+    return boundedErrorFunctionDiagonal(from_cloud, from_cloud_len, to_cloud, to_cloud_len,
+                                        points_per_frame, window_frames, frame_weights,
+                                        weight_falloff, inv_total_weights,
+                                        from_frame, to_frame, num_cells,
+                                        out_errors, out_translations, out_angles, out_stride,
+                                        sample_order, cutoff);
+}
+
+int computeBoundedErrorFunctionDiagonal(const PackedCloud& from_cloud,
+                                        int from_cloud_len,
+                                        const PackedCloud& to_cloud,
+                                        int to_cloud_len,
+                                        int points_per_frame,
+                                        int window_frames,
+                                        const float *frame_weights,
+                                        float weight_falloff,
+                                        float inv_total_weights,
+                                        int from_frame,
+                                        int to_frame,
+                                        int num_cells,
+                                        float* out_errors,
+                                        Vec3* out_translations,
+                                        float* out_angles,
+                                        int out_stride,
+                                        const int* sample_order,
+                                        float cutoff)
+{
+    return boundedErrorFunctionDiagonal(from_cloud, from_cloud_len, to_cloud, to_cloud_len,
+                                        points_per_frame, window_frames, frame_weights,
+                                        weight_falloff, inv_total_weights,
+                                        from_frame, to_frame, num_cells,
+                                        out_errors, out_translations, out_angles, out_stride,
+                                        sample_order, cutoff);
+}
+
+int computeBoundedErrorFunctionDiagonal(const SoACloud& from_cloud,
+                                        int from_cloud_len,
+                                        const SoACloud& to_cloud,
+                                        int to_cloud_len,
+                                        int points_per_frame,
+                                        int window_frames,
+                                        const float *frame_weights,
+                                        float weight_falloff,
+                                        float inv_total_weights,
+                                        int from_frame,
+                                        int to_frame,
+                                        int num_cells,
+                                        float* out_errors,
+                                        Vec3* out_translations,
+                                        float* out_angles,
+                                        int out_stride,
+                                        const int* sample_order,
+                                        float cutoff)
+{
+    return boundedErrorFunctionDiagonal(from_cloud, from_cloud_len, to_cloud, to_cloud_len,
+                                        points_per_frame, window_frames, frame_weights,
+                                        weight_falloff, inv_total_weights,
+                                        from_frame, to_frame, num_cells,
+                                        out_errors, out_translations, out_angles, out_stride,
+                                        sample_order, cutoff);
+}
+
+void findErrorFunctionMinima(const float* error_values, int width, int height, std::vector<int>& out_minima_indices)
+{
+    out_minima_indices.clear();
+    if(width <= 0 || height <= 0) return;
+
+    std::vector<const float*> rows(height);
+    for(int y = 0; y < height; ++y)
+        rows[y] = &error_values[y * width];
+    findErrorFunctionMinimaInRows(&rows[0], width, height, 0, height, out_minima_indices);
+}
 
-    delete[] is_minima;
+// Minima are found with running minima over the window, first along the rows and then down the
+// columns, van Herk/Gil-Werman style: the padded input is cut into blocks of the window length,
+// and every window is covered by the suffix minimum of one block and the prefix minimum of the
+// next. That costs three comparisons per value whatever the window size. Padding and NaNs are
+// infinity, which is never less than anything just like NaN, so the result is the same as
+// comparing a value against each of its neighbours.
+static const int kMinimaWindowLength = 2 * kMinimaWindowSize;
+
+static int paddedMinimaLength(int len)
+{
+    const int padded = len + kMinimaWindowLength - 1;
+    return ((padded + kMinimaWindowLength - 1) / kMinimaWindowLength) * kMinimaWindowLength;
+}
+
+static void computeRowMinima(const float* row, int width, float* padded, float* prefix, float* suffix, float* out)
+{
+    const int len = kMinimaWindowLength;
+    const int padded_width = paddedMinimaLength(width);
+    const float inf = std::numeric_limits<float>::infinity();
+
+    for(int i = 0; i < padded_width; ++i) padded[i] = inf;
+    for(int x = 0; x < width; ++x) {
+        const float val = row[x];
+        padded[x + kMinimaWindowSize] = val == val ? val : inf;
+    }
+
+    for(int block = 0; block < padded_width; block += len) {
+        prefix[block] = padded[block];
+        for(int i = block + 1; i < block + len; ++i)
+            prefix[i] = Min(prefix[i-1], padded[i]);
+        suffix[block + len - 1] = padded[block + len - 1];
+        for(int i = block + len - 2; i >= block; --i)
+            suffix[i] = Min(suffix[i+1], padded[i]);
+    }
+
+    // the window for x is padded[x .. x + len - 1]
+    for(int x = 0; x < width; ++x)
+        out[x] = Min(suffix[x], prefix[x + len - 1]);
+}
+
+void findErrorFunctionMinimaInRows(const float* const* rows, int width, int height,
+                                   int first_row, int last_row, std::vector<int>& out_minima_indices)
+{
+    const int len = kMinimaWindowLength;
+    const int num_rows = last_row - first_row;
+    if(num_rows <= 0 || width <= 0) return;
+
+    // padded row 0 is the first row in the window of first_row. Rows outside of the error
+    // function, or past the window of last_row - 1, are padding.
+    const int base_row = first_row - kMinimaWindowSize;
+    const int end_row = Min(height, last_row + kMinimaWindowSize - 1);
+    const int num_padded_rows = paddedMinimaLength(num_rows);
+    const int padded_width = paddedMinimaLength(width);
+    const float inf = std::numeric_limits<float>::infinity();
+
+    std::vector<float> row_minima(num_padded_rows * width);
+    std::vector<float> prefix(num_padded_rows * width);
+    std::vector<float> suffix(num_padded_rows * width);
+    std::vector<unsigned char> is_minima(num_rows * width);
+    int i = 0;
+
+#pragma omp parallel private(i) shared(row_minima, rows)
+    {
+        std::vector<float> padded(padded_width), row_prefix(padded_width), row_suffix(padded_width);
+#pragma omp for
+        for(i = 0; i < num_padded_rows; ++i)
+        {
+            const int y = base_row + i;
+            float* out = &row_minima[i * width];
+            if(y < 0 || y >= end_row) {
+                for(int x = 0; x < width; ++x) out[x] = inf;
+            } else {
+                computeRowMinima(rows[y], width, &padded[0], &row_prefix[0], &row_suffix[0], out);
+            }
+        }
+    }
+
+    // the same down the columns, a whole row at a time.
+    const int num_blocks = num_padded_rows / len;
+#pragma omp parallel for private(i) shared(row_minima, prefix, suffix)
+    for(i = 0; i < num_blocks; ++i)
+    {
+        const int block = i * len;
+        float* p = &prefix[block * width];
+        const float* in = &row_minima[block * width];
+        for(int x = 0; x < width; ++x) p[x] = in[x];
+        for(int r = 1; r < len; ++r) {
+            p += width; in += width;
+            for(int x = 0; x < width; ++x) p[x] = Min(p[x - width], in[x]);
+        }
+
+        float* s = &suffix[(block + len - 1) * width];
+        in = &row_minima[(block + len - 1) * width];
+        for(int x = 0; x < width; ++x) s[x] = in[x];
+        for(int r = len - 2; r >= 0; --r) {
+            s -= width; in -= width;
+            for(int x = 0; x < width; ++x) s[x] = Min(s[x + width], in[x]);
+        }
+    }
+
+#pragma omp parallel for private(i) shared(prefix, suffix, is_minima, rows)
+    for(i = 0; i < num_rows; ++i)
+    {
+        const float* row = rows[first_row + i];
+        const float* s = &suffix[i * width];
+        const float* p = &prefix[(i + len - 1) * width];
+        unsigned char* out = &is_minima[i * width];
+        for(int x = 0; x < width; ++x)
+            out[x] = Min(s[x], p[x]) < row[x] ? 0 : 1;
+    }
+
+    const int row_total = num_rows * width;
+    for(i = 0; i < row_total; ++i) 
+        if(is_minima[i]) 
+            out_minima_indices.push_back(first_row * width + i);
 }
 
 bool exportMotionGraphToGraphViz(sqlite3* db, sqlite3_int64 graph_id, const char* filename )
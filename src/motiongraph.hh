@@ -10,6 +10,7 @@
 #include "intrusive_ptr.hh"
 #include "clipdb.hh"
 #include "clip.hh"
+#include "cloudkernels.hh"
 
 class MGEdge;
 
@@ -199,6 +200,7 @@ class MotionGraph
     mutable Query m_stmt_get_all_node_info;
 	mutable Query m_stmt_delete_edge;
 	mutable Query m_stmt_add_t_edge;
+	mutable Query m_stmt_find_clip_edge;
 
 	void PrepareStatements();
 public:
@@ -215,6 +217,8 @@ public:
 									Vec3_arg align_offset, Quaternion_arg align_rot);
 	sqlite3_int64 AddNode(sqlite3_int64 clip_id, int frame_num);
 	sqlite3_int64 FindNode(sqlite3_int64 clip_id, int frame_num) const;
+	// returns the non-transition edge of clip_id that passes over frame_num, 0 if there isn't one.
+	sqlite3_int64 FindClipEdge(sqlite3_int64 clip_id, int frame_num) const;
 
 	bool GetNodeInfo(sqlite3_int64 node_id, MGNodeInfo& out) const;
     void GetNodeInfos(std::vector<MGNodeInfo>& out) const;
@@ -226,6 +230,7 @@ public:
 	bool DeleteEdge(sqlite3_int64 id);
 
 	void GetEdgeIDs(std::vector<sqlite3_int64>& out) const;
+	void GetClipIDs(std::vector<sqlite3_int64>& out) const; // clips with nodes in the graph
 
 	// return graph used for doing graph-like algorithms. edges point to nodes and nodes have a list of outgoing edges.
 	AlgorithmMotionGraphHandle GetAlgorithmGraph() const;
@@ -242,6 +247,41 @@ public:
 
 bool exportMotionGraphToGraphViz(sqlite3* db, sqlite3_int64 graph_id, const char* filename );
 
+// Weighted sums over corresponding points of two clouds. Enough to compute the alignment
+// between the clouds and the squared error after alignment, and they can be added and
+// subtracted to slide a comparison window.
+struct CloudMoments
+{
+	double w;                                   // sum w
+	double from_x, from_z;                      // sum w * from
+	double to_x, to_z;                          // sum w * to
+	double a;                                   // sum w * (x * z' - x' * z)
+	double b;                                   // sum w * (x * x' + z * z')
+	double c;                                   // sum w * (|p|^2 + |p'|^2 - 2 * y * y')
+
+	CloudMoments() { clear(); }
+	void clear() { w = from_x = from_z = to_x = to_z = a = b = c = 0.0; }
+	void add(const CloudMoments& o, double scale = 1.0) {
+		w += scale * o.w;
+		from_x += scale * o.from_x; from_z += scale * o.from_z;
+		to_x += scale * o.to_x; to_z += scale * o.to_z;
+		a += scale * o.a; b += scale * o.b; c += scale * o.c;
+	}
+	void sub(const CloudMoments& o) { add(o, -1.0); }
+};
+
+void accumulateCloudMoments(const Vec3* from_cloud,
+							const Vec3* to_cloud,
+							const float *weights,
+							int count,
+							CloudMoments& out);
+
+// Solve for the alignment from moments and return the squared error after alignment.
+float computeAlignmentFromMoments(const CloudMoments& moments,
+								  float inv_total_weights,
+								  Vec3& align_translation,
+								  float& align_rotation);
+
 void computeCloudAlignment(const Vec3* from_cloud,
 						   const Vec3* to_cloud,
 						   int points_per_frame,
@@ -261,11 +301,136 @@ float computeCloudDifference(const Vec3* from_cloud,
 							 float align_rotation,
 							 int numThreads);
 
+// Compute num_cells consecutive values on one diagonal of the error function, starting with
+// from_frame compared to to_frame. Per-frame moments are computed once and a window of
+// window_frames frames is slid along the diagonal, so each value costs O(points_per_frame)
+// instead of O(window_frames * points_per_frame). Windows are shortened at the end of either
+// cloud. frame_weights are the weights of the first frame of the window, later frames are
+// scaled down linearly to weight_falloff, like MotionGraphBuilder's joint weights.
+// Results are written every out_stride elements, out_translations and out_angles can be 0.
+// Single threaded, callers split the work by diagonal.
+void computeErrorFunctionDiagonal(const Vec3* from_cloud,
+								  int from_cloud_len,
+								  const Vec3* to_cloud,
+								  int to_cloud_len,
+								  int points_per_frame,
+								  int window_frames,
+								  const float *frame_weights,
+								  float weight_falloff,
+								  float inv_total_weights,
+								  int from_frame,
+								  int to_frame,
+								  int num_cells,
+								  float* out_errors,
+								  Vec3* out_translations,
+								  float* out_angles,
+								  int out_stride);
+
+// computeErrorFunctionDiagonal that gives up on cells that can't be under cutoff. Samples of
+// each frame pair are compared in sample_order (highest weights first is best), and a frame pair
+// stops early once the samples so far can't be aligned closely enough for any window that
+// contains it to be under cutoff. Those windows get that lower bound instead of their error,
+// and no alignment. cutoff < 0 or a null sample_order computes every cell. Returns the number
+// of cells bounded.
+int computeBoundedErrorFunctionDiagonal(const Vec3* from_cloud,
+										int from_cloud_len,
+										const Vec3* to_cloud,
+										int to_cloud_len,
+										int points_per_frame,
+										int window_frames,
+										const float *frame_weights,
+										float weight_falloff,
+										float inv_total_weights,
+										int from_frame,
+										int to_frame,
+										int num_cells,
+										float* out_errors,
+										Vec3* out_translations,
+										float* out_angles,
+										int out_stride,
+										const int* sample_order,
+										float cutoff);
+
+// Point cloud stored as 16 bit fixed point offsets into the bounding box of its points, one
+// array per coordinate, which is half the size of the same cloud in Vec3s. Each coordinate is
+// rounded to the nearest of 65536 steps across the box, so a point moves by at most
+// GetMaxError(). Alignment is a rigid transform, and the weighted distance after the best
+// alignment is 1-Lipschitz in the points, so the square root of the error between windows of
+// two packed clouds is within sqrt(sum of weights) * (max error of one + max error of the other)
+// of the square root of the error between the original windows.
+struct PackedCloud
+{
+	Vec3 origin;                                // point = origin + scale * (x, y, z)
+	Vec3 scale;
+	std::vector<unsigned short> x, y, z;
+
+	void Pack(const Vec3* points, int count);
+	void Unpack(int first, int count, Vec3* out) const;
+	Vec3 GetPoint(int i) const { return Vec3(origin.x + scale.x * x[i], origin.y + scale.y * y[i], origin.z + scale.z * z[i]); }
+	float GetMaxError() const { return 0.5f * magnitude(scale); }
+	int GetNumPoints() const { return x.size(); }
+};
+
+// computeBoundedErrorFunctionDiagonal on packed clouds.
+int computeBoundedErrorFunctionDiagonal(const PackedCloud& from_cloud,
+										int from_cloud_len,
+										const PackedCloud& to_cloud,
+										int to_cloud_len,
+										int points_per_frame,
+										int window_frames,
+										const float *frame_weights,
+										float weight_falloff,
+										float inv_total_weights,
+										int from_frame,
+										int to_frame,
+										int num_cells,
+										float* out_errors,
+										Vec3* out_translations,
+										float* out_angles,
+										int out_stride,
+										const int* sample_order,
+										float cutoff);
+
+// computeBoundedErrorFunctionDiagonal on SoA clouds, with the kernel picked by selectCloudKernel.
+int computeBoundedErrorFunctionDiagonal(const SoACloud& from_cloud,
+										int from_cloud_len,
+										const SoACloud& to_cloud,
+										int to_cloud_len,
+										int points_per_frame,
+										int window_frames,
+										const float *frame_weights,
+										float weight_falloff,
+										float inv_total_weights,
+										int from_frame,
+										int to_frame,
+										int num_cells,
+										float* out_errors,
+										Vec3* out_translations,
+										float* out_angles,
+										int out_stride,
+										const int* sample_order,
+										float cutoff);
+
+// Minima are values that are no greater than any other in the surrounding window, which
+// spans kMinimaWindowSize cells before and kMinimaWindowSize-1 after in each direction.
+const int kMinimaWindowSize = 3;
+
 void findErrorFunctionMinima(const float* error_values, 
 							 int width, 
 							 int height, 
 							 std::vector<int>& out_mimima_indices);
 
+// Find the minima on rows [first_row, last_row) of a height x width error function. rows[y]
+// must point at row y for the rows in the window, [first_row - kMinimaWindowSize, last_row +
+// kMinimaWindowSize) clipped to the error function. Indices are y * width + x, and are appended
+// to out_minima_indices.
+void findErrorFunctionMinimaInRows(const float* const* rows,
+								   int width,
+								   int height,
+								   int first_row,
+								   int last_row,
+								   std::vector<int>& out_minima_indices);
+
 /*
 sqlite3_int64 createTransitionClip(sqlite3* db, 
 								   const Skeleton *skel,
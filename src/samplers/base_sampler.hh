@@ -1,19 +1,35 @@
 #ifndef INCLUDED_base_sampler_HH
 #define INCLUDED_base_sampler_HH
 
+#include <vector>
+
 class Vec3;
 class Clip;
 
 class CloudSampler
 {
 public:
+	virtual ~CloudSampler() {}
 	virtual int GetSamplesPerFrame() = 0;
 	virtual void GetSamples(Vec3* allSamples, int sampleCount, 
 		const Clip* clip, int numFrames) = 0;
+	// GetSamples for numClips clips in one call, so the frames of all of them can be spread over
+	// the sampler's threads. allSamples[i] must have room for numFrames[i] frames.
+	virtual void GetSamplesForClips(Vec3* const* allSamples, const Clip* const* clips,
+		const int* numFrames, int numClips) = 0;
 	virtual void GetSampleWeights(float *samplesForFrame) = 0;
+
+	// Bytes that identify the points GetSamples produces for a given clip - the kind of sampler,
+	// the sample interval and whatever picks the sample points. Used to key cached clouds.
+	virtual void GetSignature(std::vector<char>& out) = 0;
 		
 protected:
 	CloudSampler() {}
+
+	static void AppendSignature(std::vector<char>& out, const void* data, int num_bytes) {
+		const char* bytes = (const char*)data;
+		out.insert(out.end(), bytes, bytes + num_bytes);
+	}
 };
 
 #endif
@@ -1,9 +1,9 @@
 #include <omp.h>
 #include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include "clip.hh"
-#include "anim/clipcontroller.hh"
-#include "anim/pose.hh"
+#include "anim/clipevaluator.hh"
 #include "Mat4.hh"
 #include "skeleton.hh"
 #include "mesh_sampler.hh"
@@ -11,9 +11,9 @@
 #include "assert.hh"
 #include "mesh.hh"
 
-// Support functions
-static void poseSamples(Vec3* out, int num_samples, const std::vector<int>& sample_indices, 
-				const Mesh* mesh, const Pose* pose);
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
 MeshCloudSampler::MeshCloudSampler()
@@ -30,42 +30,182 @@ MeshCloudSampler::~MeshCloudSampler()
 
 void MeshCloudSampler::Init(int numRequestedSamples, 
 	const Skeleton* skel, const Mesh* mesh,
-	int numComputeThreads, float sampleInterval)
+	int numComputeThreads, float sampleInterval, unsigned int seed)
 {
 	m_mesh = mesh;
 	m_skel = skel;
 	m_numThreads = Max(numComputeThreads,1);
 	m_sampleInterval = sampleInterval;
 
-	// choose random vertices of the mesh.
-	// This may not give the best distribution over the character necessarily since
-	// it doesn't take into account density of mesh (where we probably want number of points
-	// in an area to be roughly the same).
-	// If it is a problem, I can try a stratified sampling.
+	SelectSampleVerts(numRequestedSamples, seed);
 
-	m_sampleVerts.clear();
+	// sort the list so we at least access data in a predictable way
+	std::sort( m_sampleVerts.begin(), m_sampleVerts.end());
+
+	InitInfluences();
+}
+
+namespace {
+	// cells per axis are limited so a cell's coordinates fit in 21 bits each.
+	const int kMaxCellsPerAxis = 1 << 20;
+
+	// Small generator with the same results on every platform, unlike rand(), so a seed always
+	// picks the same vertices.
+	class SampleRandom
+	{
+		unsigned long long m_state;
+	public:
+		explicit SampleRandom(unsigned int seed) : m_state(seed) { Next(); }
+		unsigned int Next() {
+			m_state = m_state * 6364136223846793005ULL + 1442695040888963407ULL;
+			return (unsigned int)(m_state >> 32);
+		}
+		int Below(int n) { return int(Next() % (unsigned int)n); }
+	};
+
+	struct CellVert {
+		unsigned long long cell;
+		unsigned int order;                     // random, so the vertices of a cell are in random order
+		int vert;
+		bool operator<(const CellVert& other) const {
+			if(cell != other.cell) return cell < other.cell;
+			if(order != other.order) return order < other.order;
+			return vert < other.vert;
+		}
+	};
 
-	std::vector<int> candidates ;
-	const int num_verts = mesh->GetNumVerts();
+	unsigned long long cellKey(const float* vert, const float* lo, float cell_size) {
+		unsigned long long key = 0;
+		for(int i = 0; i < 3; ++i) {
+			const int coord = Clamp(int((vert[i] - lo[i]) / cell_size), 0, kMaxCellsPerAxis);
+			key = (key << 21) | (unsigned long long)coord;
+		}
+		return key;
+	}
 
-	candidates.reserve(num_verts);
-	
-	for(int i = 0; i < num_verts; ++i) 
-		candidates.push_back(i);
-	
+	int countCells(const float* verts, int num_verts, const float* lo, float cell_size, std::vector<unsigned long long>& keys) {
+		keys.resize(num_verts);
+		for(int i = 0; i < num_verts; ++i)
+			keys[i] = cellKey(&verts[3*i], lo, cell_size);
+		std::sort(keys.begin(), keys.end());
+		return std::unique(keys.begin(), keys.end()) - keys.begin();
+	}
+}
+
+// Picks vertices spread evenly over the mesh, instead of evenly over its vertices, which puts most
+// of the points where the mesh is dense. The bounding box is divided into cubic cells, sized so
+// about numRequestedSamples of them have vertices in them, and the cells are visited in a random
+// order taking one random vertex from each until there are enough. If there are fewer cells than
+// samples, the cells are visited again for their next vertex.
+void MeshCloudSampler::SelectSampleVerts(int numRequestedSamples, unsigned int seed)
+{
+	m_sampleVerts.clear();
+	const int num_verts = m_mesh->GetNumVerts();
 	numRequestedSamples = Min(num_verts, numRequestedSamples);
+	if(numRequestedSamples <= 0)
+		return;
 	m_sampleVerts.reserve(numRequestedSamples);
 
-	for(int i = 0; i < numRequestedSamples; ++i) 
-	{
-		int rand_index = rand() % candidates.size();
+	const float* verts = m_mesh->GetPositionPtr();
+	float lo[3] = { verts[0], verts[1], verts[2] };
+	float hi[3] = { verts[0], verts[1], verts[2] };
+	for(int i = 1; i < num_verts; ++i) {
+		for(int j = 0; j < 3; ++j) {
+			lo[j] = Min(lo[j], verts[3*i + j]);
+			hi[j] = Max(hi[j], verts[3*i + j]);
+		}
+	}
+	const float box_size = Max(hi[0] - lo[0], Max(hi[1] - lo[1], hi[2] - lo[2]));
+	const float min_cell_size = Max(box_size, 1e-6f) / kMaxCellsPerAxis;
 
-		m_sampleVerts.push_back(candidates[rand_index]);
-		candidates.erase( candidates.begin() + rand_index );
+	// A surface's vertices fill a number of cells proportional to 1/cell_size^2. Start as if the
+	// mesh were one face of the box, and correct the size from the cells actually filled. Prefer
+	// the fewest cells that still give every sample a cell to itself, a few more are fine.
+	std::vector<unsigned long long> keys;
+	float cell_size = Max(min_cell_size, box_size / sqrtf(float(numRequestedSamples)));
+	float best_size = cell_size;
+	int best_count = 0;
+	for(int iter = 0; iter < 8; ++iter) {
+		const int count = countCells(verts, num_verts, lo, cell_size, keys);
+		const bool enough = count >= numRequestedSamples;
+		const bool best_enough = best_count >= numRequestedSamples;
+		if(best_count == 0 || (enough && (!best_enough || count < best_count)) || (!best_enough && count > best_count)) {
+			best_size = cell_size;
+			best_count = count;
+		}
+		if((enough && count <= numRequestedSamples + numRequestedSamples / 8) || (!enough && cell_size <= min_cell_size))
+			break;
+		cell_size = Max(min_cell_size, cell_size * sqrtf(float(count) / numRequestedSamples));
 	}
+	keys.clear();
 
-	// sort the list so we at least access data in a predictable way
-	std::sort( m_sampleVerts.begin(), m_sampleVerts.end());
+	SampleRandom random(seed);
+	std::vector<CellVert> cell_verts(num_verts);
+	for(int i = 0; i < num_verts; ++i) {
+		CellVert cv = { cellKey(&verts[3*i], lo, best_size), random.Next(), i };
+		cell_verts[i] = cv;
+	}
+	std::sort(cell_verts.begin(), cell_verts.end());
+
+	// next vertex to take and end of each cell's vertices in cell_verts, in a random order.
+	std::vector< std::pair<int,int> > cells;
+	for(int first = 0; first < num_verts; ) {
+		int last = first + 1;
+		while(last < num_verts && cell_verts[last].cell == cell_verts[first].cell)
+			++last;
+		cells.push_back( std::make_pair(first, last) );
+		first = last;
+	}
+	for(int i = cells.size() - 1; i > 0; --i)
+		std::swap(cells[i], cells[random.Below(i + 1)]);
+
+	while((int)m_sampleVerts.size() < numRequestedSamples) {
+		int num_left = 0;
+		const int num_cells = cells.size();
+		for(int i = 0; i < num_cells && (int)m_sampleVerts.size() < numRequestedSamples; ++i) {
+			m_sampleVerts.push_back( cell_verts[ cells[i].first++ ].vert );
+			if(cells[i].first < cells[i].second)
+				cells[num_left++] = cells[i];
+		}
+		cells.resize(num_left);
+	}
+}
+
+void MeshCloudSampler::InitInfluences()
+{
+	const float *vert_data = m_mesh->GetPositionPtr();
+	const char *mat_indices = m_mesh->GetSkinMatricesPtr();
+	const float *skin_weights = m_mesh->GetSkinWeightsPtr();
+	const int numSamples = m_sampleVerts.size();
+
+	m_firstInfluence.clear();
+	m_influences.clear();
+	m_restX.clear();
+	m_restY.clear();
+	m_restZ.clear();
+	m_firstInfluence.reserve(numSamples + 1);
+	m_restX.reserve(numSamples);
+	m_restY.reserve(numSamples);
+	m_restZ.reserve(numSamples);
+
+	for(int i = 0; i < numSamples; ++i)
+	{
+		const int sample = m_sampleVerts[i];
+		m_restX.push_back(vert_data[3*sample]);
+		m_restY.push_back(vert_data[3*sample+1]);
+		m_restZ.push_back(vert_data[3*sample+2]);
+
+		m_firstInfluence.push_back(m_influences.size());
+		for(int j = 0; j < 4; ++j) {
+			const float weight = skin_weights[4*sample + j];
+			if(weight == 0.f)
+				continue;
+			Influence influence = { int(mat_indices[4*sample + j]), weight };
+			ASSERT(influence.joint < m_skel->GetNumJoints());
+			m_influences.push_back(influence);
+		}
+	}
+	m_firstInfluence.push_back(m_influences.size());
 }
 
 int MeshCloudSampler::GetSamplesPerFrame()
@@ -77,59 +217,69 @@ void MeshCloudSampler::GetSamples(Vec3* allSamples, int sampleCount,
 	const Clip* clip, int numFrames)
 {
 	ASSERT(allSamples);
-	int i;
-	int frame_offset, tid;
-	// init
-
 	const int samplesPerFrame = m_sampleVerts.size();
 	const int writeCount = samplesPerFrame * numFrames;
 	if(sampleCount < writeCount) {
 		fprintf(stderr, "wrong size passed to GetSamples(). Expected %d, got %d\n", writeCount, sampleCount);
 		return;
 	}
-	memset(allSamples, 0, sizeof(Vec3) * writeCount);
+	GetSamplesForClips(&allSamples, &clip, &numFrames, 1);
+}
 
-	ClipController **controllers = new ClipController*[m_numThreads];
-	for(int i = 0; i < m_numThreads; ++i) {
-		controllers[i] = new ClipController(m_skel);
-		controllers[i]->SetClip(clip);
+void MeshCloudSampler::GetSamplesForClips(Vec3* const* allSamples, const Clip* const* clips,
+	const int* numFrames, int numClips)
+{
+	// batches of frames of all the clips, as (clip, first frame)
+	std::vector< std::pair<int,int> > batches;
+	for(int clip = 0; clip < numClips; ++clip) {
+		ASSERT(allSamples[clip]);
+		for(int frame = 0; frame < numFrames[clip]; frame += kSkinFrames)
+			batches.push_back( std::make_pair(clip, frame) );
 	}
 
-	// variables to make OpenMP happy
+	// each thread's evaluator and the matrices for the frames it is skinning
 	const int numThreads = m_numThreads;
-	const Mesh* mesh = m_mesh;
-	const std::vector<int>& sampleVerts = m_sampleVerts;
-	float sampleInterval = m_sampleInterval;
-	
+	const int matsPerThread = m_skel->GetNumJoints() * 12 * kSkinFrames;
+	std::vector<ClipEvaluator*> evaluators(numThreads);
+	for(int i = 0; i < numThreads; ++i)
+		evaluators[i] = new ClipEvaluator(m_skel, m_mesh->GetTransform());
+	std::vector<float> threadMats(numThreads * matsPerThread, 0.f);
+
+	const int samplesPerFrame = m_sampleVerts.size();
+	const float sampleInterval = m_sampleInterval;
+	const int numBatches = batches.size();
+	int batch = 0;
+
 	omp_set_num_threads(numThreads);
 
-#pragma omp parallel for												\
-	shared(controllers,mesh,sampleVerts,allSamples,sampleInterval,numFrames) \
-	private(i,tid,frame_offset)
-	for(i = 0; i < numFrames; ++i)
+#pragma omp parallel for private(batch) shared(batches, evaluators, threadMats)
+	for(batch = 0; batch < numBatches; ++batch)
 	{
-		tid = omp_get_thread_num();
+		const int tid = omp_get_thread_num();
 		ASSERT(tid < numThreads);
-		frame_offset = i * samplesPerFrame;
+		const int clip = batches[batch].first;
+		const int first_frame = batches[batch].second;
+		const int batch_frames = Min(int(kSkinFrames), numFrames[clip] - first_frame);
+		float* mats = &threadMats[tid * matsPerThread];
 
-		controllers[tid]->SetTime( i * sampleInterval );
-		controllers[tid]->ComputePose();
-		controllers[tid]->ComputeMatrices( mesh->GetTransform() );
-
-		poseSamples(&allSamples[frame_offset],
-					samplesPerFrame,
-					sampleVerts, 
-					mesh, 
-					controllers[tid]->GetPose());
+		evaluators[tid]->SetClip(clips[clip]);
+		evaluators[tid]->ComputeMatrices(first_frame, batch_frames, sampleInterval, mats, kSkinFrames);
+		SkinFrames(&allSamples[clip][first_frame * samplesPerFrame], batch_frames, mats);
 	}
 
-	// clean up
-	for(int i = 0; i < numThreads; ++i) {
-		delete controllers[i];
-	}
-	delete[] controllers;
+	for(int i = 0; i < numThreads; ++i)
+		delete evaluators[i];
 }
 
+void MeshCloudSampler::GetSignature(std::vector<char>& out)
+{
+	static const char kType[] = "mesh";
+	out.clear();
+	AppendSignature(out, kType, sizeof(kType));
+	AppendSignature(out, &m_sampleInterval, sizeof(m_sampleInterval));
+	if(!m_sampleVerts.empty())
+		AppendSignature(out, &m_sampleVerts[0], sizeof(int) * m_sampleVerts.size());
+}
 
 void MeshCloudSampler::GetSampleWeights(float *samplesForFrame)
 { 
@@ -155,49 +305,76 @@ void MeshCloudSampler::GetSampleWeights(float *samplesForFrame)
 	}
 }
 
-// Get point from a clip controller. 
-// 'samples' must be of at least num_samples * sample_indicies.size() in length.
-// It begins by starting at a particular frame, and then sampling every sample_interval for num_samples iterations.
-// This allows for clips that are running at variable FPS to be used.
-// Pose must be initialized with the same skeleton as the clip_controller.
-
-static void poseSamples(Vec3* out, int num_samples, const std::vector<int>& sample_indices, 
-						const Mesh* mesh, const Pose* pose)
+// Linear blend skinning of every sample for numFrames frames of matrices from ClipEvaluator::ComputeMatrices.
+// Frames are independent, so the SSE2 path skins four at once. Both paths transform a point
+// and sum the weighted results in the same order as transform_point, and since only zero weights
+// are dropped, the points are the same whichever path computes them.
+void MeshCloudSampler::SkinFrames(Vec3* out, int numFrames, const float* mats) const
 {
-	const float *vert_data = mesh->GetPositionPtr();
-	const char *mat_indices = mesh->GetSkinMatricesPtr();
-	const float *weights = mesh->GetSkinWeightsPtr();
-	
-	const Mat4* mats = pose->GetMatricesPtr();
-
-	Vec3 v0,v1,v2,v3;
-	int i = 0;
-
-	for(i = 0; i < num_samples; ++i) {
-		int sample = sample_indices[i];
-		int vert_sample = sample*3;
-		int mat_sample = sample*4;
-		Vec3 mesh_vert(vert_data[vert_sample],vert_data[vert_sample+1],vert_data[vert_sample+2]);
-		const float *w = &weights[mat_sample];
-		const char* indices = &mat_indices[mat_sample];
-		ASSERT(indices[0] < pose->GetNumJoints() && 
-			   indices[1] < pose->GetNumJoints() && 
-			   indices[2] < pose->GetNumJoints() && 
-			   indices[3] < pose->GetNumJoints());
-		const Mat4& m1 = mats[ int(indices[0]) ];
-		const Mat4& m2 = mats[ int(indices[1]) ];
-		const Mat4& m3 = mats[ int(indices[2]) ];
-		const Mat4& m4 = mats[ int(indices[3]) ];
-	
-		v0 = transform_point( m1, mesh_vert );
-		v1 = transform_point( m2, mesh_vert );
-		v2 = transform_point( m3, mesh_vert );
-		v3 = transform_point( m4, mesh_vert );
-
-		(void)w;
-		out[i] = w[0] * v0 + 
-			w[1] * v1 + 
-			w[2] * v2 + 
-			w[3] * v3;
+	const int samplesPerFrame = m_sampleVerts.size();
+	const Influence* influences = m_influences.empty() ? 0 : &m_influences[0];
+
+#ifdef __SSE2__
+	for(int frame = 0; frame < numFrames; frame += 4)
+	{
+		const int count = Min(4, numFrames - frame);
+		for(int sample = 0; sample < samplesPerFrame; ++sample)
+		{
+			const __m128 rest_x = _mm_set1_ps(m_restX[sample]);
+			const __m128 rest_y = _mm_set1_ps(m_restY[sample]);
+			const __m128 rest_z = _mm_set1_ps(m_restZ[sample]);
+			__m128 x = _mm_setzero_ps(), y = _mm_setzero_ps(), z = _mm_setzero_ps();
+
+			const Influence* last = influences + m_firstInfluence[sample+1];
+			for(const Influence* inf = influences + m_firstInfluence[sample]; inf != last; ++inf)
+			{
+				const float* m = &mats[inf->joint * 12 * kSkinFrames + frame];
+				const __m128 w = _mm_set1_ps(inf->weight);
+				__m128 t;
+				t = _mm_mul_ps(_mm_loadu_ps(m + 0*kSkinFrames), rest_x);
+				t = _mm_add_ps(t, _mm_mul_ps(_mm_loadu_ps(m + 1*kSkinFrames), rest_y));
+				t = _mm_add_ps(t, _mm_mul_ps(_mm_loadu_ps(m + 2*kSkinFrames), rest_z));
+				t = _mm_add_ps(t, _mm_loadu_ps(m + 3*kSkinFrames));
+				x = _mm_add_ps(x, _mm_mul_ps(w, t));
+				t = _mm_mul_ps(_mm_loadu_ps(m + 4*kSkinFrames), rest_x);
+				t = _mm_add_ps(t, _mm_mul_ps(_mm_loadu_ps(m + 5*kSkinFrames), rest_y));
+				t = _mm_add_ps(t, _mm_mul_ps(_mm_loadu_ps(m + 6*kSkinFrames), rest_z));
+				t = _mm_add_ps(t, _mm_loadu_ps(m + 7*kSkinFrames));
+				y = _mm_add_ps(y, _mm_mul_ps(w, t));
+				t = _mm_mul_ps(_mm_loadu_ps(m + 8*kSkinFrames), rest_x);
+				t = _mm_add_ps(t, _mm_mul_ps(_mm_loadu_ps(m + 9*kSkinFrames), rest_y));
+				t = _mm_add_ps(t, _mm_mul_ps(_mm_loadu_ps(m + 10*kSkinFrames), rest_z));
+				t = _mm_add_ps(t, _mm_loadu_ps(m + 11*kSkinFrames));
+				z = _mm_add_ps(z, _mm_mul_ps(w, t));
+			}
+
+			float xs[4], ys[4], zs[4];
+			_mm_storeu_ps(xs, x);
+			_mm_storeu_ps(ys, y);
+			_mm_storeu_ps(zs, z);
+			for(int lane = 0; lane < count; ++lane)
+				out[(frame + lane) * samplesPerFrame + sample] = Vec3(xs[lane], ys[lane], zs[lane]);
+		}
+	}
+#else
+	for(int frame = 0; frame < numFrames; ++frame)
+	{
+		for(int sample = 0; sample < samplesPerFrame; ++sample)
+		{
+			const Vec3 rest(m_restX[sample], m_restY[sample], m_restZ[sample]);
+			Vec3 point(0,0,0);
+
+			const Influence* last = influences + m_firstInfluence[sample+1];
+			for(const Influence* inf = influences + m_firstInfluence[sample]; inf != last; ++inf)
+			{
+				const float* m = &mats[inf->joint * 12 * kSkinFrames + frame];
+				const float x = m[0*kSkinFrames] * rest.x + m[1*kSkinFrames] * rest.y + m[2*kSkinFrames] * rest.z + m[3*kSkinFrames];
+				const float y = m[4*kSkinFrames] * rest.x + m[5*kSkinFrames] * rest.y + m[6*kSkinFrames] * rest.z + m[7*kSkinFrames];
+				const float z = m[8*kSkinFrames] * rest.x + m[9*kSkinFrames] * rest.y + m[10*kSkinFrames] * rest.z + m[11*kSkinFrames];
+				point += inf->weight * Vec3(x, y, z);
+			}
+			out[frame * samplesPerFrame + sample] = point;
+		}
 	}
+#endif
 }
@@ -9,25 +9,44 @@ class Skeleton;
 
 class MeshCloudSampler : public CloudSampler
 {
+	// frames skinned together. Each thread takes this many frames of a clip at a time, poses
+	// them, then skins every sample in all of them with one pass over the influences.
+	enum { kSkinFrames = 16 };
+
+	struct Influence {
+		int joint;
+		float weight;
+	};
+
 	const Mesh *m_mesh;
 	const Skeleton *m_skel;
 	std::vector<int> m_sampleVerts;	
+	std::vector<int> m_firstInfluence;          // influences of sample i are [m_firstInfluence[i], m_firstInfluence[i+1])
+	std::vector<Influence> m_influences;        // joints moving each sample, without the zero weights
+	std::vector<float> m_restX, m_restY, m_restZ; // sample positions in the bind pose
 	int m_numThreads;
 	float m_sampleInterval;
+
+	void SelectSampleVerts(int numRequestedSamples, unsigned int seed);
+	void InitInfluences();
+	void SkinFrames(Vec3* out, int numFrames, const float* mats) const;
 public:
 	MeshCloudSampler();
 	~MeshCloudSampler();
 
 	void Init(int numRequestedSamples, const Skeleton* skel, const Mesh* mesh,
-		int numComputeThreads, float sampleInterval);
+		int numComputeThreads, float sampleInterval, unsigned int seed);
 
 	// from CloudSampler
 
 	int GetSamplesPerFrame();
 	void GetSamples(Vec3 *allSamples, int sampleCount, 
 		const Clip* clip, int numFrames);
+	void GetSamplesForClips(Vec3* const* allSamples, const Clip* const* clips,
+		const int* numFrames, int numClips);
 
 	void GetSampleWeights(float *samplesForFrame);
+	void GetSignature(std::vector<char>& out);
 };
 
 #endif
@@ -1,15 +1,15 @@
+#include <omp.h>
 #include <cstdio>
 #include "assert.hh"
 #include "samplers/skeleton_sampler.hh"
 #include "clip.hh"
-#include "anim/clipcontroller.hh"
-#include "anim/pose.hh"
-#include "Mat4.hh"
+#include "anim/clipevaluator.hh"
 #include "skeleton.hh"
 #include "MathUtil.hh"
 
 SkeletonCloudSampler::SkeletonCloudSampler()
     : m_skel(0)
+    , m_numThreads(0)
     , m_samplesPerFrame(0)
     , m_sampleInterval(0.f)
 {}
@@ -18,9 +18,10 @@ SkeletonCloudSampler::~SkeletonCloudSampler()
 {
 }
 
-void SkeletonCloudSampler::Init(int requestedNumPoints, const Skeleton* skel, float sampleInterval)
+void SkeletonCloudSampler::Init(int requestedNumPoints, const Skeleton* skel, int numComputeThreads, float sampleInterval)
 {
     m_skel = skel;
+    m_numThreads = Max(numComputeThreads, 1);
     m_sampleInterval = sampleInterval;
     m_numJointSamples.clear();
     m_samples.clear();
@@ -82,33 +83,87 @@ void SkeletonCloudSampler::GetSamples(Vec3* allSamples, int sampleCount, const C
         return;
     }
 
-    memset(allSamples, 0, sizeof(Vec3) * writeCount);
-    ClipController controller(m_skel);
-    controller.SetClip(clip);
+    GetSamplesForClips(&allSamples, &clip, &numFrames, 1);
+}
+
+void SkeletonCloudSampler::GetSamplesForClips(Vec3* const* allSamples, const Clip* const* clips,
+    const int* numFrames, int numClips)
+{
+    // batches of frames of all the clips, as (clip, first frame)
+    std::vector< std::pair<int,int> > batches;
+    for(int clip = 0; clip < numClips; ++clip)
+        for(int frame = 0; frame < numFrames[clip]; frame += kSampleFrames)
+            batches.push_back( std::make_pair(clip, frame) );
+
+    // each thread's evaluator and matrices
+    const int numThreads = m_numThreads;
+    const int matsPerThread = m_skel->GetNumJoints() * 12 * kSampleFrames;
+    std::vector<ClipEvaluator*> evaluators(numThreads);
+    for(int i = 0; i < numThreads; ++i)
+        evaluators[i] = new ClipEvaluator(m_skel, Mat4(Mat4::ident_t()));
+    std::vector<float> threadMats(numThreads * matsPerThread);
 
     const float sampleInterval = m_sampleInterval;
-    const int numJoints = m_skel->GetNumJoints();
+    const int numBatches = batches.size();
+    int batch = 0;
+
+    omp_set_num_threads(numThreads);
+
+#pragma omp parallel for private(batch) shared(batches, evaluators, threadMats)
+    for(batch = 0; batch < numBatches; ++batch)
+    {
+        const int tid = omp_get_thread_num();
+        ASSERT(tid < numThreads);
+        const int clip = batches[batch].first;
+        const int firstFrame = batches[batch].second;
+        const int batchFrames = Min(int(kSampleFrames), numFrames[clip] - firstFrame);
+        float* mats = &threadMats[tid * matsPerThread];
+
+        evaluators[tid]->SetClip(clips[clip]);
+        evaluators[tid]->ComputeMatrices(firstFrame, batchFrames, sampleInterval, mats, kSampleFrames);
+        SampleFrames(&allSamples[clip][firstFrame * m_samplesPerFrame], batchFrames, mats);
+    }
 
+    for(int i = 0; i < numThreads; ++i)
+        delete evaluators[i];
+}
+
+// Transforms the points on each joint by numFrames frames of matrices from
+// ClipEvaluator::ComputeMatrices, the same as transform_point.
+void SkeletonCloudSampler::SampleFrames(Vec3* out, int numFrames, const float* mats) const
+{
+    const int numJoints = m_skel->GetNumJoints();
     int sampleIdx = 0;
     for(int frame = 0; frame < numFrames; ++frame)
     {
-        controller.SetTime( frame * sampleInterval );
-        controller.ComputePose();
-        controller.ComputeMatrices( (Mat4::ident_t()) );
-        const Mat4* mats = controller.GetPose()->GetMatricesPtr();
-
         int sampleSrcIdx = 0;
         for(int i = 0; i < numJoints; ++i)
         {
+            const float* m = &mats[i * 12 * kSampleFrames + frame];
             const int numSamples = m_numJointSamples[i];
             for(int sample = 0; sample < numSamples; ++sample)
             {
-                allSamples[sampleIdx++] = transform_point( mats[i], m_samples[sampleSrcIdx++] );
+                const Vec3& pt = m_samples[sampleSrcIdx++];
+                out[sampleIdx++] = Vec3(
+                    m[0*kSampleFrames] * pt.x + m[1*kSampleFrames] * pt.y + m[2*kSampleFrames] * pt.z + m[3*kSampleFrames],
+                    m[4*kSampleFrames] * pt.x + m[5*kSampleFrames] * pt.y + m[6*kSampleFrames] * pt.z + m[7*kSampleFrames],
+                    m[8*kSampleFrames] * pt.x + m[9*kSampleFrames] * pt.y + m[10*kSampleFrames] * pt.z + m[11*kSampleFrames]);
             }
         }
     }
+    ASSERT(sampleIdx == numFrames * m_samplesPerFrame);
+}
 
-    ASSERT(sampleIdx == writeCount);
+void SkeletonCloudSampler::GetSignature(std::vector<char>& out)
+{
+    static const char kType[] = "skeleton";
+    out.clear();
+    AppendSignature(out, kType, sizeof(kType));
+    AppendSignature(out, &m_sampleInterval, sizeof(m_sampleInterval));
+    if(!m_numJointSamples.empty())
+        AppendSignature(out, &m_numJointSamples[0], sizeof(int) * m_numJointSamples.size());
+    if(!m_samples.empty())
+        AppendSignature(out, &m_samples[0], sizeof(Vec3) * m_samples.size());
 }
 
 void SkeletonCloudSampler::GetSampleWeights(float *samplesForFrame)
@@ -9,24 +9,31 @@ class Skeleton;
 
 class SkeletonCloudSampler : public CloudSampler
 {
+    enum { kSampleFrames = 64 };                // frames of a clip each thread samples at a time
+
     const Skeleton* m_skel;
+    int m_numThreads;
 
     int m_samplesPerFrame;                      // sum of values in m_numJointSamples
     std::vector< int > m_numJointSamples;       // number of samples for each joint. (size should be == #joints)
     std::vector< Vec3 > m_samples;              // all of the sample positions in rest position.
     float m_sampleInterval;                     // sample period.. distance between sample points on a joint.
 
+    void SampleFrames(Vec3* out, int numFrames, const float* mats) const;
 public:
     SkeletonCloudSampler();
     ~SkeletonCloudSampler();
 
-    void Init(int requestedNumPoints, const Skeleton* skel, float sampleInterval);
+    void Init(int requestedNumPoints, const Skeleton* skel, int numComputeThreads, float sampleInterval);
     
     // CloudSampler interface
     int GetSamplesPerFrame() ;
     void GetSamples(Vec3* allSamples, int sampleCount,
         const Clip* clip, int numFrames);
+    void GetSamplesForClips(Vec3* const* allSamples, const Clip* const* clips,
+        const int* numFrames, int numClips);
     void GetSampleWeights(float *samplesForFrame);
+    void GetSignature(std::vector<char>& out);
 };
 
 #endif
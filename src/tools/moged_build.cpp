@@ -0,0 +1,413 @@
+// moged-build: build a motion graph for an entity file without the editor.
+//
+// usage: moged-build [options] entity.db
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <omp.h>
+#include "sql/sqlite3.h"
+#include "dbhelpers.hh"
+#include "MathUtil.hh"
+#include "entity.hh"
+#include "mogedevents.hh"
+#include "motiongraph.hh"
+#include "mgbuilder.hh"
+#include "skeleton.hh"
+#include "clipdb.hh"
+#include "mesh.hh"
+
+using namespace std;
+
+static void usage(const char* prog)
+{
+	fprintf(stderr,
+			"usage: %s [options] entity.db\n"
+			"  -n name       name of the new motion graph\n"
+			"  -e error      maximum error threshold (default 0.5)\n"
+			"  -t seconds    transition length (default 0.25)\n"
+			"  -f fps        fps to sample clips at (default 120)\n"
+			"  -r rate       fraction of mesh vertices to use for point clouds (default 0.01)\n"
+			"  -m points     maximum point cloud size (default 100)\n"
+			"  -g seed       seed for picking the mesh vertices to sample (default 0)\n"
+			"  -w falloff    weight falloff (default 0.75)\n"
+			"  -c factor     search a coarse error function first, skipping this many frames and points\n"
+			"  -i            only compare windows that a k-d tree of window descriptors finds close enough\n"
+			"                to be under the threshold, instead of every window of every pair\n"
+			"  -u            skip clip pairs whose clips are too different for any window to be under the\n"
+			"                threshold\n"
+			"  -b            stop comparing a pair of frames once its heaviest points are too far apart for\n"
+			"                any window with it to be under the threshold\n"
+			"  -z            store clouds as 16 bit fixed point, half the memory but points move slightly\n"
+			"  -v kernel     store clouds as SoA and compare them with kernel: auto, scalar, sse2 or avx.\n"
+			"                scalar gives the same results as Vec3 clouds, the others round differently\n"
+			"  -d frames     of candidates between the same clips that start and end this close, keep\n"
+			"                the best, and have split points this close share a node\n"
+			"  -s rows       rows of the error function to keep per tile, 0 keeps all of it (default 256)\n"
+			"  -j threads    number of OpenMP threads (default %d)\n"
+			"  -x            don't use or update the point cloud cache\n"
+			"  -E            save the error functions with the graph\n"
+			"  -R graph_id   extract transitions from the error functions saved with another graph\n"
+			"                instead of comparing clips\n"
+			"  -A graph_id   add the clips that aren't in an existing graph to it instead of building\n"
+			"                a new graph\n"
+			"  -k seconds    save the search progress this often, 0 to never save it (default 60)\n"
+			"  -K graph_id   resume an interrupted build of a graph\n"
+			"  -P processes  split the search into this many shards, each searched by a worker process\n"
+			"                with its own copy of the entity file, then merge them and finish here\n"
+			"  -S shard/num  only search this shard of the pairs of the graph resumed with -K, and stop\n"
+			"                after saving them to its checkpoint\n"
+			"  -M file       merge the search that a shard checkpointed in a copy of the entity file\n"
+			"                into the graph resumed with -K before resuming it\n"
+			"  -p            skip pruning\n"
+			"  -q            only report errors and statistics\n",
+			prog, omp_get_max_threads());
+}
+
+static void AddFloatArg(std::vector<std::string>& args, const char* opt, float value)
+{
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%.9g", value);
+	args.push_back(opt);
+	args.push_back(buf);
+}
+
+static void AddIntArg(std::vector<std::string>& args, const char* opt, sqlite3_int64 value)
+{
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%lld", value);
+	args.push_back(opt);
+	args.push_back(buf);
+}
+
+static bool ParseCloudKernel(const char* name, CloudKernel& out)
+{
+	for(int i = 0; i < kNumCloudKernels; ++i) {
+		if(strcmp(name, getCloudKernelName(CloudKernel(i))) == 0) {
+			out = CloudKernel(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Search graph_id's pairs in num_shards worker processes. Each worker resumes the graph's checkpoint
+// in its own copy of the entity file, so the workers never write to the same database. Returns the
+// copies for merging, whether or not their worker finished. If the copies can't all be made, the
+// ones that were are removed and false is returned.
+static bool RunShards(const char* prog, sqlite3* db, const char* filename, sqlite3_int64 graph_id,
+					  int num_shards, const MotionGraphBuilder::Settings& settings,
+					  std::vector<std::string>& shard_files)
+{
+	for(int i = 0; i < num_shards; ++i) {
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".shard%d", i);
+		const std::string shard_file = std::string(filename) + suffix;
+		if(sql_copy_database(db, shard_file.c_str()) != SQLITE_OK) {
+			fprintf(stderr, "Could not copy %s to %s\n", filename, shard_file.c_str());
+			unlink(shard_file.c_str());
+			for(int copied = 0; copied < (int)shard_files.size(); ++copied)
+				unlink(shard_files[copied].c_str());
+			shard_files.clear();
+			return false;
+		}
+		shard_files.push_back(shard_file);
+	}
+
+	std::vector<std::string> args;
+	args.push_back(prog);
+	AddFloatArg(args, "-e", settings.error_threshold);
+	AddFloatArg(args, "-t", settings.transition_length);
+	AddFloatArg(args, "-f", settings.sample_rate);
+	AddFloatArg(args, "-r", settings.point_cloud_rate);
+	AddIntArg(args, "-m", settings.max_point_cloud_size);
+	AddIntArg(args, "-g", settings.sample_seed);
+	AddFloatArg(args, "-w", settings.weight_falloff);
+	AddIntArg(args, "-c", settings.coarse_factor);
+	if(settings.index_windows)
+		args.push_back("-i");
+	if(settings.cull_pairs)
+		args.push_back("-u");
+	if(settings.early_exit)
+		args.push_back("-b");
+	if(settings.pack_clouds)
+		args.push_back("-z");
+	if(settings.soa_clouds) {
+		args.push_back("-v");
+		args.push_back(getCloudKernelName(settings.cloud_kernel));
+	}
+	AddIntArg(args, "-s", settings.tile_rows);
+	AddIntArg(args, "-j", Max(1, settings.num_threads / num_shards));
+	AddFloatArg(args, "-k", settings.checkpoint_interval);
+	AddIntArg(args, "-K", graph_id);
+	if(!settings.cache_clouds)
+		args.push_back("-x");
+	args.push_back("-q");
+	args.push_back("-S");
+	args.push_back("");
+	args.push_back("");
+
+	cout.flush();
+	fflush(stdout);
+
+	std::vector<pid_t> workers;
+	for(int i = 0; i < num_shards; ++i) {
+		char shard[32];
+		snprintf(shard, sizeof(shard), "%d/%d", i, num_shards);
+		args[args.size() - 2] = shard;
+		args.back() = shard_files[i];
+
+		std::vector<char*> argv;
+		for(int arg = 0; arg < (int)args.size(); ++arg)
+			argv.push_back(const_cast<char*>(args[arg].c_str()));
+		argv.push_back(0);
+
+		pid_t pid = fork();
+		if(pid == 0) {
+			execvp(prog, &argv[0]);
+			fprintf(stderr, "Could not run %s\n", prog);
+			_exit(127);
+		}
+		if(pid < 0)
+			fprintf(stderr, "Could not start the worker for shard %s\n", shard);
+		workers.push_back(pid);
+	}
+
+	for(int i = 0; i < num_shards; ++i) {
+		int status = 0;
+		if(workers[i] < 0 || waitpid(workers[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			fprintf(stderr, "The worker for shard %d/%d failed, its unfinished pairs will be searched here.\n",
+					i, num_shards);
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	MotionGraphBuilder::Settings settings;
+	settings.num_threads = omp_get_max_threads();
+	settings.error_threshold = 0.5f;
+	settings.point_cloud_rate = 0.01f;
+	settings.max_point_cloud_size = 100;
+	settings.transition_length = 0.25f;
+	settings.sample_rate = 120.f;
+	settings.weight_falloff = 0.75f;
+	settings.tile_rows = 256;
+	settings.cache_clouds = true;
+	settings.checkpoint_interval = 60.f;
+
+	std::string name = "MotionGraph";
+	bool prune = true;
+	bool quiet = false;
+	sqlite3_int64 stored_graph_id = 0;
+	sqlite3_int64 add_graph_id = 0;
+	sqlite3_int64 resume_graph_id = 0;
+	int num_processes = 1;
+	std::vector<std::string> merge_files;
+
+	int opt;
+	while((opt = getopt(argc, argv, "n:e:t:f:r:m:g:w:c:iubzv:d:s:j:xER:A:k:K:P:S:M:pqh")) != -1) {
+		switch(opt) {
+		case 'n': name = optarg; break;
+		case 'e': settings.error_threshold = atof(optarg); break;
+		case 't': settings.transition_length = atof(optarg); break;
+		case 'f': settings.sample_rate = atof(optarg); break;
+		case 'r': settings.point_cloud_rate = atof(optarg); break;
+		case 'm': settings.max_point_cloud_size = atoi(optarg); break;
+		case 'g': settings.sample_seed = strtoul(optarg, 0, 10); break;
+		case 'w': settings.weight_falloff = atof(optarg); break;
+		case 'c': settings.coarse_factor = atoi(optarg); break;
+		case 'i': settings.index_windows = true; break;
+		case 'u': settings.cull_pairs = true; break;
+		case 'b': settings.early_exit = true; break;
+		case 'z': settings.pack_clouds = true; break;
+		case 'd': settings.split_separation = atoi(optarg); break;
+		case 'v':
+			settings.soa_clouds = true;
+			if(!ParseCloudKernel(optarg, settings.cloud_kernel)) {
+				fprintf(stderr, "Unknown kernel %s.\n", optarg);
+				return 1;
+			}
+			break;
+		case 's': settings.tile_rows = atoi(optarg); break;
+		case 'j': settings.num_threads = atoi(optarg); break;
+		case 'x': settings.cache_clouds = false; break;
+		case 'E': settings.save_error_functions = true; break;
+		case 'R': stored_graph_id = atoll(optarg); break;
+		case 'A': add_graph_id = atoll(optarg); break;
+		case 'k': settings.checkpoint_interval = atof(optarg); break;
+		case 'K': resume_graph_id = atoll(optarg); break;
+		case 'P': num_processes = atoi(optarg); break;
+		case 'S':
+			if(sscanf(optarg, "%d/%d", &settings.shard_index, &settings.num_shards) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'M': merge_files.push_back(optarg); break;
+		case 'p': prune = false; break;
+		case 'q': quiet = true; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if(optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	const char* filename = argv[optind];
+
+	if((settings.num_shards > 1 || !merge_files.empty()) && !resume_graph_id) {
+		fprintf(stderr, "-S and -M need a graph to resume with -K.\n");
+		return 1;
+	}
+	if(num_processes > 1 && (stored_graph_id || settings.num_shards > 1)) {
+		fprintf(stderr, "-P can't be used with -R or -S.\n");
+		return 1;
+	}
+	if((num_processes > 1 || settings.num_shards > 1) && settings.save_error_functions) {
+		fprintf(stderr, "Shards can't save error functions, -E can't be used with -P or -S.\n");
+		return 1;
+	}
+	if(num_processes > 1 && settings.checkpoint_interval <= 0.f) {
+		fprintf(stderr, "Shards are merged from their checkpoints, -P needs a checkpoint interval.\n");
+		return 1;
+	}
+
+	settings.ComputeSampling();
+
+	Events::EventSystem evsys;
+	Entity entity(&evsys);
+	entity.SetFilename(filename);
+	if(!entity.HasDB()) {
+		fprintf(stderr, "Could not open %s\n", filename);
+		return 1;
+	}
+
+	const Skeleton* skel = entity.GetSkeleton();
+	const ClipDB* clips = entity.GetClips();
+	if(skel == 0 || clips == 0 || clips->GetNumClips() == 0) {
+		fprintf(stderr, "No clips to add to graph.\n");
+		return 1;
+	}
+
+	ostream null_out(0);
+	ostream& out = quiet ? null_out : cout;
+
+	MotionGraphBuilder builder(entity.GetDB(), skel, entity.GetMesh());
+	std::string error;
+	if(!builder.Init(settings, error)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+
+	out << "Starting with: " << endl
+		<< "No. OMP Threads: " << builder.GetSettings().num_threads << endl
+		<< "Maximum Error Threshold: " << settings.error_threshold << endl
+		<< "Point Cloud Sample Rate: " << settings.point_cloud_rate << endl
+		<< "Requested Number of points in cloud: " << builder.GetNumPointsRequested() << endl
+		<< "Cloud Samples Per Frame: " << builder.GetSamplesPerFrame() << endl
+		<< "Transition Length: " << settings.transition_length << endl
+		<< "FPS Sample Rate: " << settings.sample_rate << endl
+		<< "Transition Samples: " << settings.num_samples << endl
+		<< "Cloud Sample Interval: " << settings.sample_interval << endl
+		<< "Falloff is " << settings.weight_falloff << endl
+		<< "Coarse search factor: " << settings.coarse_factor << endl
+		<< "Window index: " << (settings.index_windows ? "yes" : "no") << endl
+		<< "Cull clip pairs: " << (settings.cull_pairs ? "yes" : "no") << endl
+		<< "Early exit: " << (settings.early_exit ? "yes" : "no") << endl
+		<< "Pack clouds: " << (settings.pack_clouds ? "yes" : "no") << endl
+		<< "SoA clouds: " << (settings.soa_clouds ? getCloudKernelName(builder.GetSettings().cloud_kernel) : "no") << endl
+		<< "Split separation: " << settings.split_separation << endl
+		<< "Error function tile rows: " << settings.tile_rows << endl;
+
+	const sqlite3_int64 existing_graph_id = resume_graph_id ? resume_graph_id : add_graph_id;
+	sqlite3_int64 graph_id = existing_graph_id ? existing_graph_id : NewMotionGraph(entity.GetDB(), skel->GetID(), name.c_str());
+	entity.SetCurrentMotionGraph( graph_id );
+	MotionGraph *graph = entity.GetMotionGraph();
+	if(graph == 0) {
+		if(existing_graph_id)
+			fprintf(stderr, "No motion graph with id %lld.\n", existing_graph_id);
+		else
+			fprintf(stderr, "Failed to create new motion graph.\n");
+		return 1;
+	}
+
+	double start_time = omp_get_wtime();
+
+	// a sharded search starts the graph and its checkpoint here, then resumes it from what the
+	// shards checkpointed, and searches whatever pairs a failed shard didn't finish itself.
+	std::vector<std::string> shard_files;
+	if(num_processes > 1) {
+		if(!resume_graph_id) {
+			if(add_graph_id)
+				builder.StartAddClips(graph, clips, out);
+			else
+				builder.Start(graph, clips, out);
+		}
+		out << "Searching in " << num_processes << " shards." << endl;
+		if(!RunShards(argv[0], entity.GetDB(), filename, graph_id, num_processes, builder.GetSettings(), shard_files)) {
+			if(!existing_graph_id)
+				entity.DeleteMotionGraph(graph_id);
+			return 1;
+		}
+		merge_files.insert(merge_files.end(), shard_files.begin(), shard_files.end());
+	}
+
+	const int num_merge_files = merge_files.size();
+	for(int i = 0; i < num_merge_files; ++i) {
+		if(!builder.MergeCheckpoint(graph, merge_files[i].c_str(), out))
+			fprintf(stderr, "Could not merge %s, its pairs will be searched here.\n", merge_files[i].c_str());
+	}
+	for(int i = 0; i < (int)shard_files.size(); ++i)
+		unlink(shard_files[i].c_str());
+
+	if(resume_graph_id || num_processes > 1) {
+		if(!builder.StartResume(graph, clips, out)) {
+			fprintf(stderr, "Could not resume building graph %lld.\n", graph_id);
+			if(!existing_graph_id)
+				entity.DeleteMotionGraph(graph_id);
+			return 1;
+		}
+	} else if(add_graph_id)
+		builder.StartAddClips(graph, clips, out);
+	else
+		builder.Start(graph, clips, out);
+	if(stored_graph_id) {
+		if(!builder.RunStoredTransitionSearch(clips, stored_graph_id, out)) {
+			fprintf(stderr, "Could not extract transitions from graph %lld.\n", stored_graph_id);
+			if(!existing_graph_id)
+				entity.DeleteMotionGraph(graph_id);
+			return 1;
+		}
+	} else
+		builder.RunTransitionSearch(clips, out);
+
+	if(settings.num_shards > 1) {
+		cout << "Searched shard " << settings.shard_index << "/" << settings.num_shards << " of graph "
+			 << graph_id << ": " << builder.GetStats().num_pairs << " clip pairs, "
+			 << builder.GetStats().num_candidates << " transition candidates in "
+			 << omp_get_wtime() - start_time << "s." << endl;
+		return 0;
+	}
+
+	builder.RunGraphAssembly(out);
+	if(prune)
+		builder.RunPruning(graph, out);
+
+	double total_time = omp_get_wtime() - start_time;
+
+	cout << "Built motion graph \"" << graph->GetName() << "\" (id " << graph->GetID() << ") with "
+		 << graph->GetNumNodes() << " nodes and " << graph->GetNumEdges() << " edges in "
+		 << total_time << "s." << endl;
+	builder.PrintStats(cout);
+	return 0;
+}